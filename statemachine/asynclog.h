@@ -0,0 +1,664 @@
+#ifndef ASYNCLOG
+#define ASYNCLOG
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <streambuf>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "renderer.h"
+
+namespace logging
+{
+    // Writing straight to the console from a machine makes whichever thread
+    // is running it pay for a syscall, and for however long the terminal,
+    // pipe or file takes to accept the bytes. A Logger takes the output
+    // instead: the machine's thread copies it into slots in a queue that
+    // was allocated up front and carries on, and the Logger's own thread
+    // gathers everything that has been queued and writes it in as few
+    // syscalls as it can, one per file descriptor per batch.
+    //
+    // Any number of threads can queue at once, claiming their slots with a
+    // compare and swap on the head, and nobody ever waits on a lock. A
+    // message that doesn't fit in what is left of the queue is dropped and
+    // counted rather than block the machine.
+    //
+    // The output of the machines can all go through one: screens through a
+    // LogDisplay, transmit output through a Stream, and error messages
+    // through errors() once the Logger is routing them. A LogDisplay or
+    // Stream given a Logger must not outlive it, errors() stops using one
+    // before its stop returns
+
+    class Logger
+    {
+    public:
+
+        static constexpr std::size_t slot_size{ 256 };
+
+        // The queue holds slot_count slots, rounded up to a power of two,
+        // 16MB by default. interval is how long the writer sleeps when
+        // there's nothing to write
+        explicit Logger(std::size_t slot_count = std::size_t{ 1 } << 16,
+            std::chrono::microseconds interval = std::chrono::microseconds{ 500 });
+
+        ~Logger();
+
+        Logger(const Logger&) = delete;
+        Logger& operator=(const Logger&) = delete;
+
+        // Queues the pieces as one message for fd, they are written
+        // together and in order with the other messages for the same fd.
+        // False if the queue was too full or the logger has been stopped,
+        // in which case nothing is queued and the message counts as dropped
+        bool write(int fd, std::span<const iovec> pieces);
+
+        bool write(int fd, std::string_view text)
+        {
+            iovec piece = render::segment(text);
+            return write(fd, { &piece, 1 });
+        }
+
+        // Sends errors() through this logger until it is stopped
+        void route_errors();
+
+        // Writes everything already queued and stops the writer, writes
+        // after that are refused. Waits for writes already under way, so
+        // every write that returned true is written. The destructor does
+        // the same if it hasn't been done
+        void stop();
+
+        std::uint64_t messages() const { return messages_.load(std::memory_order_relaxed); }
+        std::uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+        std::uint64_t syscalls() const { return syscalls_.load(std::memory_order_relaxed); }
+        std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+        bool stopped() const { return stopping_.load(std::memory_order_relaxed); }
+
+    private:
+
+        // A message takes as many consecutive slots as it needs, only the
+        // first says how many. sequence is the slot's position in the queue
+        // while it is free and one more once a message has been copied in
+        struct alignas(64) Slot
+        {
+            static constexpr std::size_t payload{ slot_size - 16 };
+
+            std::atomic<std::uint64_t> sequence{};
+            std::int32_t fd{};
+            std::uint16_t length{};
+            std::uint16_t slots{};
+            char bytes[payload];
+        };
+
+        static_assert(sizeof(Slot) == slot_size);
+
+        // What the writer has gathered for one fd so far
+        struct Batch
+        {
+            int fd{};
+            std::vector<char> bytes;
+        };
+
+        // Sent as soon as a batch gets this big, otherwise when the queue
+        // is empty
+        static constexpr std::size_t batch_bytes{ std::size_t{ 1 } << 16 };
+
+        void run();
+        bool enqueue(int fd, std::span<const iovec> pieces);
+        bool drain();
+        Batch& batch(int fd);
+        void send(Batch& batch);
+
+        std::size_t mask_{};
+        std::unique_ptr<Slot[]> slots_;
+
+        // Producers only touch the head, the writer only the tail
+        alignas(64) std::atomic<std::uint64_t> head_{};
+        alignas(64) std::uint64_t tail_{};
+
+        std::vector<Batch> batches_;
+
+        std::atomic<std::uint64_t> messages_{};
+        std::atomic<std::uint64_t> bytes_{};
+        std::atomic<std::uint64_t> syscalls_{};
+        alignas(64) std::atomic<std::uint64_t> dropped_{};
+
+        // Writes that got in before stopping_ was set and may not have
+        // published their slots yet, the writer's last drain waits for them
+        alignas(64) std::atomic<std::uint32_t> writers_{};
+
+        std::chrono::microseconds interval_{};
+        std::atomic<bool> stopping_{};
+        std::atomic<bool> finished_{};
+        std::thread thread_;
+    };
+
+    // The logger errors() goes through, if any
+    constinit std::atomic<Logger*> error_logger{};
+
+    // Threads that may be writing through error_logger, counted before they
+    // load it, so a logger that has stopped routing errors can wait for the
+    // last of them before it goes away
+    constinit std::atomic<std::uint32_t> error_writers{};
+
+
+    // Collects what is streamed into it and queues it as one message when
+    // a string ending a line is written, the stream is flushed or the
+    // buffer fills. Without a logger, or if the logger's queue is full, it
+    // writes the text itself with one syscall, the same as an unbuffered
+    // std::cerr would. Like any streambuf it belongs to one thread
+    class LineBuffer : public std::streambuf
+    {
+    public:
+
+        // A null logger means whichever logger errors() is routed to
+        LineBuffer(Logger* logger, int fd)
+            : logger_(logger)
+            , fd_(fd)
+        {
+            setp(line_.data(), line_.data() + line_.size());
+        }
+
+    protected:
+
+        virtual int overflow(int c) override;
+        virtual std::streamsize xsputn(const char* text, std::streamsize count) override;
+        virtual int sync() override;
+
+    private:
+
+        Logger* logger_{};
+        int fd_{};
+
+        std::array<char, 512> line_{};
+    };
+
+    class Stream : public std::ostream
+    {
+    public:
+
+        Stream(Logger* logger, int fd)
+            : std::ostream(nullptr)
+            , buffer_(logger, fd)
+        {
+            rdbuf(&buffer_);
+        }
+
+    private:
+
+        LineBuffer buffer_;
+    };
+
+    // Where the machines write their error messages, std::cerr's fd and
+    // through the logger that route_errors was last called on. One stream
+    // per thread, so lines from different threads never mix
+    std::ostream& errors()
+    {
+        thread_local Stream stream{ nullptr, STDERR_FILENO };
+        return stream;
+    }
+
+    // Shows a session's screens by queueing them on a logger. Screens are
+    // sent whole, so unlike render::Renderer it can be shared by any number
+    // of sessions on any number of threads
+    class LogDisplay : public render::Display
+    {
+    public:
+
+        explicit LogDisplay(Logger& logger, int fd = STDOUT_FILENO)
+            : logger_(&logger)
+            , fd_(fd)
+        {
+        }
+
+        virtual void show(render::Screen screen) override;
+
+    private:
+
+        Logger* logger_{};
+        int fd_{};
+    };
+
+
+    // Writes the whole buffer, retrying when interrupted or only part of it
+    // was written. Nothing sensible to do if the fd has gone away
+    std::uint64_t write_all(int fd, const char* bytes, std::size_t size)
+    {
+        std::uint64_t syscalls{};
+
+        while (size > 0)
+        {
+            ssize_t written = ::write(fd, bytes, size);
+            ++syscalls;
+
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                break;
+            }
+
+            bytes += written;
+            size -= static_cast<std::size_t>(written);
+        }
+
+        return syscalls;
+    }
+
+    // The same for a screen's pieces, in as few writevs as it takes
+    std::uint64_t write_all(int fd, render::Screen screen)
+    {
+        std::uint64_t syscalls{};
+        std::vector<iovec> pieces(screen.begin(), screen.end());
+
+        iovec* pending = pieces.data();
+        std::size_t count = pieces.size();
+
+        while (count > 0)
+        {
+            int batch = static_cast<int>(count < IOV_MAX ? count : IOV_MAX);
+            ssize_t written = ::writev(fd, pending, batch);
+            ++syscalls;
+
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                break;
+            }
+
+            // Skip what was fully written and trim the piece that was not
+            std::size_t remaining = static_cast<std::size_t>(written);
+
+            while (count > 0 && remaining >= pending->iov_len)
+            {
+                remaining -= pending->iov_len;
+                ++pending;
+                --count;
+            }
+
+            if (count > 0)
+            {
+                pending->iov_base = static_cast<char*>(pending->iov_base) + remaining;
+                pending->iov_len -= remaining;
+            }
+        }
+
+        return syscalls;
+    }
+
+
+    // Logger
+
+    Logger::Logger(std::size_t slot_count, std::chrono::microseconds interval)
+        : mask_(std::bit_ceil(std::max<std::size_t>(slot_count, 2)) - 1)
+        , slots_(new Slot[mask_ + 1])
+        , interval_(interval)
+    {
+        for (std::size_t i = 0; i <= mask_; ++i)
+        {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        thread_ = std::thread{ [this] { run(); } };
+    }
+
+    Logger::~Logger()
+    {
+        stop();
+    }
+
+    void Logger::stop()
+    {
+        if (!thread_.joinable())
+        {
+            return;
+        }
+
+        // Stops routing errors here, then waits out any thread that
+        // loaded the pointer before it was cleared and may still call write
+        Logger* self = this;
+        error_logger.compare_exchange_strong(self, nullptr, std::memory_order_seq_cst);
+
+        while (error_writers.load(std::memory_order_seq_cst) > 0)
+        {
+            std::this_thread::yield();
+        }
+
+        // Refuses new messages, so a writer falls back on writing directly
+        // rather than queue what would never be written, and waits for the
+        // ones that got in first to publish before the writer's last drain
+        stopping_.store(true, std::memory_order_seq_cst);
+
+        while (writers_.load(std::memory_order_seq_cst) > 0)
+        {
+            std::this_thread::yield();
+        }
+
+        finished_.store(true, std::memory_order_release);
+        thread_.join();
+    }
+
+    void Logger::route_errors()
+    {
+        error_logger.store(this, std::memory_order_release);
+    }
+
+    bool Logger::write(int fd, std::span<const iovec> pieces)
+    {
+        // Counted before stopping_ is checked, and stop sets stopping_
+        // before it reads the count, so either this write is refused or
+        // stop waits for it to publish
+        writers_.fetch_add(1, std::memory_order_seq_cst);
+
+        bool queued = !stopping_.load(std::memory_order_seq_cst) && enqueue(fd, pieces);
+
+        writers_.fetch_sub(1, std::memory_order_release);
+
+        if (!queued)
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        return queued;
+    }
+
+    bool Logger::enqueue(int fd, std::span<const iovec> pieces)
+    {
+
+        std::size_t length{};
+
+        for (const iovec& piece : pieces)
+        {
+            length += piece.iov_len;
+        }
+
+        std::size_t count = std::max<std::size_t>((length + Slot::payload - 1) / Slot::payload, 1);
+
+        if (count > (mask_ + 1) / 2)
+        {
+            return false;
+        }
+
+        // Claims count slots at once. The writer frees slots in order, so
+        // if the last one wanted is free all the ones before it are too
+        std::uint64_t position = head_.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            std::uint64_t last = position + count - 1;
+            std::uint64_t sequence = slots_[last & mask_].sequence.load(std::memory_order_acquire);
+
+            if (sequence == last)
+            {
+                if (head_.compare_exchange_weak(position, position + count, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (static_cast<std::int64_t>(sequence - last) < 0)
+            {
+                // Still holds a message from the last time round
+                return false;
+            }
+            else
+            {
+                // Another thread got there first
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Copies the pieces across the slots, a piece can span slots and a
+        // slot can hold several pieces
+        std::size_t piece{};
+        std::size_t offset{};
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            Slot& slot = slots_[(position + i) & mask_];
+            std::size_t filled{};
+
+            while (filled < Slot::payload && piece < pieces.size())
+            {
+                std::size_t take = std::min(Slot::payload - filled, pieces[piece].iov_len - offset);
+                std::memcpy(slot.bytes + filled, static_cast<const char*>(pieces[piece].iov_base) + offset, take);
+
+                filled += take;
+                offset += take;
+
+                if (offset == pieces[piece].iov_len)
+                {
+                    ++piece;
+                    offset = 0;
+                }
+            }
+
+            slot.fd = fd;
+            slot.length = static_cast<std::uint16_t>(filled);
+            slot.slots = static_cast<std::uint16_t>(count);
+            slot.sequence.store(position + i + 1, std::memory_order_release);
+        }
+
+        return true;
+    }
+
+    void Logger::run()
+    {
+        while (!finished_.load(std::memory_order_acquire))
+        {
+            if (!drain())
+            {
+                std::this_thread::sleep_for(interval_);
+            }
+        }
+
+        // Whatever was queued before the logger was stopped
+        while (drain())
+        {
+        }
+    }
+
+    bool Logger::drain()
+    {
+        std::uint64_t messages{};
+        std::uint64_t bytes{};
+
+        while (true)
+        {
+            Slot& first = slots_[tail_ & mask_];
+
+            if (first.sequence.load(std::memory_order_acquire) != tail_ + 1)
+            {
+                break;
+            }
+
+            // The rest of the message may still be being copied in, the
+            // slots are published in order so checking the last is enough
+            std::size_t count = first.slots;
+            std::uint64_t last = tail_ + count - 1;
+
+            if (slots_[last & mask_].sequence.load(std::memory_order_acquire) != last + 1)
+            {
+                break;
+            }
+
+            Batch& out = batch(first.fd);
+
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                Slot& slot = slots_[(tail_ + i) & mask_];
+                out.bytes.insert(out.bytes.end(), slot.bytes, slot.bytes + slot.length);
+                bytes += slot.length;
+            }
+
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                slots_[(tail_ + i) & mask_].sequence.store(tail_ + i + mask_ + 1, std::memory_order_release);
+            }
+
+            tail_ += count;
+            ++messages;
+
+            if (out.bytes.size() >= batch_bytes)
+            {
+                send(out);
+            }
+        }
+
+        for (Batch& out : batches_)
+        {
+            send(out);
+        }
+
+        messages_.fetch_add(messages, std::memory_order_relaxed);
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+
+        return messages > 0;
+    }
+
+    Logger::Batch& Logger::batch(int fd)
+    {
+        for (Batch& out : batches_)
+        {
+            if (out.fd == fd)
+            {
+                return out;
+            }
+        }
+
+        batches_.push_back({ fd, {} });
+        batches_.back().bytes.reserve(batch_bytes * 2);
+
+        return batches_.back();
+    }
+
+    void Logger::send(Batch& batch)
+    {
+        if (!batch.bytes.empty())
+        {
+            syscalls_.fetch_add(write_all(batch.fd, batch.bytes.data(), batch.bytes.size()), std::memory_order_relaxed);
+            batch.bytes.clear();
+        }
+    }
+
+
+    // LogDisplay
+
+    void LogDisplay::show(render::Screen screen)
+    {
+        // Written here if the queue is full or the logger has stopped, so
+        // the user never loses a prompt
+        if (!logger_->write(fd_, screen))
+        {
+            write_all(fd_, screen);
+        }
+    }
+
+
+    // LineBuffer
+
+    int LineBuffer::overflow(int c)
+    {
+        sync();
+
+        if (c != traits_type::eof())
+        {
+            *pptr() = static_cast<char>(c);
+            pbump(1);
+        }
+
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize LineBuffer::xsputn(const char* text, std::streamsize count)
+    {
+        std::streamsize written{};
+
+        while (written < count)
+        {
+            if (pptr() == epptr())
+            {
+                sync();
+            }
+
+            std::streamsize take = std::min<std::streamsize>(count - written, epptr() - pptr());
+            const char* end = std::find(text + written, text + written + take, '\n');
+
+            // A line is sent as soon as it ends
+            bool line_ends = end != text + written + take;
+            take = end - (text + written) + (line_ends ? 1 : 0);
+
+            std::memcpy(pptr(), text + written, static_cast<std::size_t>(take));
+            pbump(static_cast<int>(take));
+            written += take;
+
+            if (line_ends)
+            {
+                sync();
+            }
+        }
+
+        return written;
+    }
+
+    int LineBuffer::sync()
+    {
+        std::size_t size = static_cast<std::size_t>(pptr() - pbase());
+
+        if (size == 0)
+        {
+            return 0;
+        }
+
+        std::string_view text{ pbase(), size };
+        bool queued{};
+
+        if (logger_)
+        {
+            queued = logger_->write(fd_, text);
+        }
+        else
+        {
+            // Counted before the pointer is loaded, so the logger can't be
+            // destroyed while this thread is still using it
+            error_writers.fetch_add(1, std::memory_order_seq_cst);
+
+            Logger* logger = error_logger.load(std::memory_order_seq_cst);
+            queued = logger && logger->write(fd_, text);
+
+            error_writers.fetch_sub(1, std::memory_order_release);
+        }
+
+        if (!queued)
+        {
+            write_all(fd_, pbase(), size);
+        }
+
+        setp(line_.data(), line_.data() + line_.size());
+        return 0;
+    }
+}
+
+#endif
@@ -1,15 +1,89 @@
 #ifndef BOOKEXAMPLE
 #define BOOKEXAMPLE
 
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <limits>
 #include <cassert>
 
+#include "statemachine.h"
+#include "latency.h"
+#include "unhandled.h"
+#include "asynclog.h"
+#include "journal.h"
+
 namespace book
 {
     class TCPConnection;
 
+    // The connection refers to its states by name and keeps the current
+    // one by value, see fsm::VariantDispatch. The book uses a singleton per
+    // state, which works just as well when, as here, states have no data
+    enum class TCPStateName
+    {
+        Established,
+        Listen,
+        Closed,
+        FinWait,
+        count
+    };
+
+    // For traces and anything else that shows a state
+    constexpr std::string_view name(TCPStateName value)
+    {
+        switch (value)
+        {
+        case TCPStateName::Established: return "Established";
+        case TCPStateName::Listen: return "Listen";
+        case TCPStateName::Closed: return "Closed";
+        case TCPStateName::FinWait: return "FinWait";
+        case TCPStateName::count: break;
+        }
+
+        return "";
+    }
+
+    // Requests are queued as events, so a state can make further requests
+    // of the connection while it handles one, see TCPState::raise
+    enum class TCPRequest
+    {
+        transmit,
+        active_open,
+        passive_open,
+        close,
+        synchronize,
+        acknowledge,
+        send,
+        count
+    };
+
+    constexpr std::string_view name(TCPRequest value)
+    {
+        switch (value)
+        {
+        case TCPRequest::transmit: return "transmit";
+        case TCPRequest::active_open: return "active_open";
+        case TCPRequest::passive_open: return "passive_open";
+        case TCPRequest::close: return "close";
+        case TCPRequest::synchronize: return "synchronize";
+        case TCPRequest::acknowledge: return "acknowledge";
+        case TCPRequest::send: return "send";
+        case TCPRequest::count: break;
+        }
+
+        return "";
+    }
+
+    struct TCPEvent
+    {
+        TCPRequest request{};
+
+        // Only for transmit
+        std::ostream* stream{};
+    };
+
     // Abstract base class of all states
     class TCPState
     {
@@ -38,7 +112,17 @@ namespace book
 
     protected:
 
-        void change_state(TCPConnection* context, TCPState* state);
+        void change_state(TCPConnection* context, TCPStateName name);
+
+        // Queues a request that the connection handles once the current one
+        // has finished, before control returns to whoever made the request
+        void raise(TCPConnection* context, TCPRequest request);
+
+    private:
+
+        // What every default handler does, counts the request and reports
+        // it, see unhandled::Pairs
+        void not_handled(TCPConnection* context, TCPRequest request);
     };
 
     // The state destructor doesn't do anything in this case, but is required to
@@ -46,85 +130,203 @@ namespace book
     TCPState::~TCPState() = default;
 
 
+    // Concrete States shown in the example
+
+    class TCPEstablished final : public TCPState
+    {
+    public:
+
+        virtual void transmit(TCPConnection* context, std::ostream& stream) override;
+        virtual void close(TCPConnection* context) override;
+    };
+
+    class TCPListen final : public TCPState
+    {
+    public:
+
+        virtual void send(TCPConnection* context) override;
+    };
+
+    class TCPClosed final : public TCPState
+    {
+    public:
+
+        virtual void active_open(TCPConnection* context) override;
+        virtual void passive_open(TCPConnection* context) override;
+    };
+
+    // Not in the book, waiting for the other end to acknowledge our FIN
+    class TCPFinWait final : public TCPState
+    {
+    public:
+
+        virtual void acknowledge(TCPConnection* context) override;
+    };
+
     // The context which provides an interface for clients
     class TCPConnection
     {
     public:
 
-        TCPConnection();
-
         // The public interface that specifies the requests that can be made
-        // It does not implement requests, but forwards them to the active state
-        void transmit(std::ostream& stream) { current_state_->transmit(this, stream); };
-        void active_open() { current_state_->active_open(this); };
-        void passive_open() { current_state_->passive_open(this); };
-        void close() { current_state_->close(this); };
-        void synchronize() { current_state_->synchronize(this); };
-        void acknowledge() { current_state_->acknowledge(this); };
-        void send() { current_state_->send(this); };
+        // It does not implement requests, but forwards them to the active state.
+        // Each returns whether the request, and whatever the states raised
+        // while handling it, was handled
+        unhandled::Status transmit(std::ostream& stream) { return request({ TCPRequest::transmit, &stream }); };
+        unhandled::Status active_open() { return request({ TCPRequest::active_open }); };
+        unhandled::Status passive_open() { return request({ TCPRequest::passive_open }); };
+        unhandled::Status close() { return request({ TCPRequest::close }); };
+        unhandled::Status synchronize() { return request({ TCPRequest::synchronize }); };
+        unhandled::Status acknowledge() { return request({ TCPRequest::acknowledge }); };
+        unhandled::Status send() { return request({ TCPRequest::send }); };
+
+        // Number of times a state has moved the connection to another state
+        std::uint64_t transition_count() const { return machine_.transition_count(); }
+
+        // Puts the connection in a state without it counting as a
+        // transition, see graph::probe_book
+        void restore(TCPStateName state) { machine_.reset(state); }
+
+        TCPStateName state() const { return machine_.state(); }
+
+        // Journals every request made of the connection as machine id,
+        // before it is handled, see journal::Journal
+        void attach_journal(journal::Journal* journal, journal::MachineId id) { journal_.attach(journal, id); }
 
     private:
 
         // To allow only states to access the change_state function
         friend TCPState;
 
-        void change_state(TCPState* state)
-        {
-            assert(state);
+        void change_state(TCPStateName name) { machine_.change_state(name); }
 
-            current_state_ = state;
-        }
+        // Handles the event and everything the states raise while handling
+        // it before returning
+        unhandled::Status request(const TCPEvent& event);
+        void post(const TCPEvent& event);
+        void handle(const TCPEvent& event);
+
+        // The states are listed in the order of TCPStateName
+        using Machine = fsm::StateMachine<TCPConnection, TCPStateName,
+            fsm::VariantDispatch<TCPStateName, TCPEstablished, TCPListen, TCPClosed, TCPFinWait>>;
+
+        // Start in the closed state
+        Machine machine_{ TCPStateName::Closed };
+
+        // Sized to what the handlers raise: the event being handled is out
+        // of the queue, and no handler raises more than one follow up, see
+        // TCPEstablished::close. Room for two keeps the capacity a power of two
+        // and the connection small, a handler raising more is a bug and the
+        // rest are dropped
+        fsm::RunToCompletion<TCPEvent, 2> events_;
 
-        // This pointer does not maintain ownership of the state (no new/delete)
-        // it is only used to have a changeable reference to the current state
-        TCPState* current_state_{};
+        // Set by a default handler, see TCPState::not_handled
+        bool unhandled_{};
+
+        journal::Tap journal_;
     };
 
     // Normally would define this in implementation file to avoid cyclic dependence
-    void TCPState::change_state(TCPConnection* context, TCPState* state)
+    void TCPState::change_state(TCPConnection* context, TCPStateName name)
     {
         assert(context);
 
-        context->change_state(state);
+        context->change_state(name);
     }
 
+    void TCPState::raise(TCPConnection* context, TCPRequest request)
+    {
+        assert(context);
 
-    // Concrete States shown in the example
+        context->post({ request });
+    }
 
-    class TCPEstablished : public TCPState
+    void TCPState::not_handled(TCPConnection* context, TCPRequest request)
     {
-    public:
+        assert(context);
 
-        static TCPState* instance();
+        TCPStateName state = context->machine_.state();
 
-        virtual void transmit(TCPConnection* context, std::ostream& stream) override;
-        virtual void close(TCPConnection* context) override;
-    };
+        stats::Unhandled<TCPStateName, TCPRequest>::add(state, request);
+        unhandled::Pairs<TCPStateName, TCPRequest>::report(state, request);
+
+        context->unhandled_ = true;
+    }
 
-    class TCPListen : public TCPState
+    unhandled::Status TCPConnection::request(const TCPEvent& event)
     {
-    public:
+        // Only requests from outside, what the states raise follows from them
+        if (journal_) [[unlikely]]
+        {
+            journal_.record(journal::Kind::tcp, event.request);
+        }
 
-        static TCPState* instance();
+        unhandled_ = false;
+        post(event);
 
-        virtual void send(TCPConnection* context) override;
-    };
+        return unhandled_ ? unhandled::Status::unhandled : unhandled::Status::handled;
+    }
 
-    class TCPClosed : public TCPState
+    void TCPConnection::post(const TCPEvent& event)
     {
-    public:
+        if (!events_.post(event, [this](const TCPEvent& next) { handle(next); }))
+        {
+            logging::errors() << "Error: TCPConnection event queue is full, request dropped" << std::endl;
+        }
+    }
 
-        static TCPState* instance();
+    void TCPConnection::handle(const TCPEvent& event)
+    {
+        trace::EventScope scope{ event.request };
+        latency::Timer<TCPStateName, TCPRequest> timer{ machine_.state(), event.request };
 
-        virtual void active_open(TCPConnection* context) override;
-        virtual void passive_open(TCPConnection* context) override;
-    };
+        switch (event.request)
+        {
+        case TCPRequest::transmit:
+        {
+            assert(event.stream);
+            machine_.dispatch(this, &TCPState::transmit, *event.stream);
+            break;
+        }
+        case TCPRequest::active_open:
+        {
+            machine_.dispatch(this, &TCPState::active_open);
+            break;
+        }
+        case TCPRequest::passive_open:
+        {
+            machine_.dispatch(this, &TCPState::passive_open);
+            break;
+        }
+        case TCPRequest::close:
+        {
+            machine_.dispatch(this, &TCPState::close);
+            break;
+        }
+        case TCPRequest::synchronize:
+        {
+            machine_.dispatch(this, &TCPState::synchronize);
+            break;
+        }
+        case TCPRequest::acknowledge:
+        {
+            machine_.dispatch(this, &TCPState::acknowledge);
+            break;
+        }
+        case TCPRequest::send:
+        {
+            machine_.dispatch(this, &TCPState::send);
+            break;
+        }
+        case TCPRequest::count: break;
+        }
+    }
 
     // All of the handler functions should normally be defined in separate
     // implementation files to avoid cyclical dependencies when changing states
-    // There are other methods of chosing the next state to transition to
-    // without the current state needing to know the class of the next state
-    // such as a lookup table or map but this is how the book example does it
+    // The book has each state name the class of the state it transitions
+    // to, here they only name the TCPStateName so that states don't depend
+    // on each other's classes
 
     // Established
     void TCPEstablished::transmit(TCPConnection* context, std::ostream& stream)
@@ -140,12 +342,24 @@ namespace book
         assert(context);
 
         // The example in the book simply transitions directly to Listen
-        //change_state(context, TCPListen::instance());
+        //change_state(context, TCPStateName::Listen);
 
         // In a real connection there are several intermediate steps as mentioned
         // "send FIN, recieve ACK of FIN"
 
-        change_state(context, TCPListen::instance());
+        // Sending the FIN is left out, the peer's ACK of it is raised as an
+        // event and is handled in FinWait before close returns
+        change_state(context, TCPStateName::FinWait);
+        raise(context, TCPRequest::acknowledge);
+    }
+
+    // FinWait
+    void TCPFinWait::acknowledge(TCPConnection* context)
+    {
+        assert(context);
+
+        // The close is complete, back to where the book's example goes
+        change_state(context, TCPStateName::Listen);
     }
 
     // Listen
@@ -154,12 +368,12 @@ namespace book
         assert(context);
 
         // The example in the book simply transitions directly to Established
-        //change_state(context, TCPEstablished::instance());
+        //change_state(context, TCPStateName::Established);
 
         // In a real connection there are several intermediate steps as mentioned
         // "send SYN, recieve SYN, ACK, etc."
 
-        change_state(context, TCPEstablished::instance());
+        change_state(context, TCPStateName::Established);
     }
 
     // Closed
@@ -168,12 +382,12 @@ namespace book
         assert(context);
 
         // The example in the book simply transitions directly to Established
-        //change_state(context, TCPEstablished::instance());
+        //change_state(context, TCPStateName::Established);
 
         // In a real connection there are several intermediate steps as mentioned
         // "send SYN, recieve SYN, ACK, etc."
 
-        change_state(context, TCPEstablished::instance());
+        change_state(context, TCPStateName::Established);
     }
 
     void TCPClosed::passive_open(TCPConnection* context)
@@ -181,7 +395,7 @@ namespace book
         assert(context);
 
         // Transition to the listen state to prepare for establishing a connection
-        change_state(context, TCPListen::instance());
+        change_state(context, TCPStateName::Listen);
     }
 
 
@@ -197,71 +411,50 @@ namespace book
         connection.send();
 
         connection.transmit(std::cout);
-    }
-
-    TCPConnection::TCPConnection()
-    {
-        // Start in the closed state
-        change_state(TCPClosed::instance());
-    }
 
-    // The static instance functions could be defined in the header
-    // or implementation files without causing cyclic dependency
-    // so the choice comes down to conventions
+        // Goes through FinWait and back to Listen within the one call
+        connection.close();
 
-    TCPState* TCPEstablished::instance()
-    {
-        static TCPEstablished state{};
-        return &state;
-    }
-
-    TCPState* TCPListen::instance()
-    {
-        static TCPListen state{};
-        return &state;
-    }
+        connection.send();
 
-    TCPState* TCPClosed::instance()
-    {
-        static TCPClosed state{};
-        return &state;
+        connection.transmit(std::cout);
     }
 
     // Default handler implementations to warn the user that a derived state does not implement them
 
     void TCPState::transmit(TCPConnection* context, std::ostream& stream)
     {
-        std::cerr << "Error: current state does not implement TCPState::transmit" << std::endl;
+        not_handled(context, TCPRequest::transmit);
     };
 
     void TCPState::active_open(TCPConnection* context)
     {
-        std::cerr << "Error: current state does not implement TCPState::active_open" << std::endl;
+        not_handled(context, TCPRequest::active_open);
     };
 
     void TCPState::passive_open(TCPConnection* context)
     {
-        std::cerr << "Error: current state does not implement TCPState::passive_open" << std::endl;
+        not_handled(context, TCPRequest::passive_open);
     };
 
     void TCPState::close(TCPConnection* context)
     {
-        std::cerr << "Error: current state does not implement TCPState::close" << std::endl;
+        not_handled(context, TCPRequest::close);
     };
 
     void TCPState::synchronize(TCPConnection* context)
     {
-        std::cerr << "Error: current state does not implement TCPState::synchronize" << std::endl;
+        not_handled(context, TCPRequest::synchronize);
     };
 
     void TCPState::acknowledge(TCPConnection* context)
     {
-        std::cerr << "Error: current state does not implement TCPState::acknowledge" << std::endl;
+        not_handled(context, TCPRequest::acknowledge);
     };
 
     void TCPState::send(TCPConnection* context)
     {
-        std::cerr << "Error: current state does not implement TCPState::send" << std::endl;
+        not_handled(context, TCPRequest::send);
     };
 }
 
@@ -1,23 +1,134 @@
 #ifndef CHATBOT
 #define CHATBOT
 
+#include <array>
 #include <iostream>
-#include <string>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <cstdint>
+#include <cassert>
+
+#include "statemachine.h"
+#include "latency.h"
+#include "unhandled.h"
+#include "asynclog.h"
+#include "renderer.h"
+#include "compactpatient.h"
+#include "prompts.h"
+#include "patientstore.h"
+#include "lineinput.h"
+#include "journal.h"
 
 namespace chat
 {
+    // Names of the states, each of which is a singleton. The bot's state
+    // machine maps a name to its state with get_state
+    enum class StateName
+    {
+        StartState,
+        MainMenuState,
+        CollectNameState,
+        CollectAddressState,
+        CollectAgeState,
+        CollectHeightState,
+        EditNameState,
+        EditAddressState,
+        EditAgeState,
+        EditHeightState,
+        ConfirmInfoState,
+        EditOptionsState,
+        FinishedState,
+
+        // Superstates, the bot is never in one of these directly
+        PatientState,
+        EditingState,
+
+        count
+    };
+
+    // For traces and anything else that shows a state
+    constexpr std::string_view name(StateName value)
+    {
+        switch (value)
+        {
+        case StateName::StartState: return "StartState";
+        case StateName::MainMenuState: return "MainMenuState";
+        case StateName::CollectNameState: return "CollectNameState";
+        case StateName::CollectAddressState: return "CollectAddressState";
+        case StateName::CollectAgeState: return "CollectAgeState";
+        case StateName::CollectHeightState: return "CollectHeightState";
+        case StateName::EditNameState: return "EditNameState";
+        case StateName::EditAddressState: return "EditAddressState";
+        case StateName::EditAgeState: return "EditAgeState";
+        case StateName::EditHeightState: return "EditHeightState";
+        case StateName::ConfirmInfoState: return "ConfirmInfoState";
+        case StateName::EditOptionsState: return "EditOptionsState";
+        case StateName::FinishedState: return "FinishedState";
+        case StateName::PatientState: return "PatientState";
+        case StateName::EditingState: return "EditingState";
+        case StateName::count: break;
+        }
+
+        return "";
+    }
 
-    struct Patient
+    // The requests a bot passes on to its state
+    enum class Request
     {
-        // Information learned by the bot
-        std::string name;
-        std::string address;
-        int age;
-        int height;
+        prompt_user,
+        process_input,
+        count
     };
 
+    constexpr std::string_view name(Request value)
+    {
+        switch (value)
+        {
+        case Request::prompt_user: return "prompt_user";
+        case Request::process_input: return "process_input";
+        case Request::count: break;
+        }
+
+        return "";
+    }
+
+    // Everything to do with one patient is nested in PatientState, which
+    // starts a new patient whenever it is entered from the menu. The edit
+    // states are nested further in EditingState, which they share their
+    // behaviour with
+    constexpr std::array<StateName, fsm::state_count<StateName>> make_state_parents()
+    {
+        std::array<StateName, fsm::state_count<StateName>> parents{};
+        parents.fill(StateName::count);
+
+        for (StateName name : { StateName::CollectNameState, StateName::CollectAddressState,
+            StateName::CollectAgeState, StateName::CollectHeightState, StateName::ConfirmInfoState,
+            StateName::EditOptionsState, StateName::EditingState })
+        {
+            parents[fsm::index_of(name)] = StateName::PatientState;
+        }
+
+        for (StateName name : { StateName::EditNameState, StateName::EditAddressState,
+            StateName::EditAgeState, StateName::EditHeightState })
+        {
+            parents[fsm::index_of(name)] = StateName::EditingState;
+        }
+
+        return parents;
+    }
+
+    inline constexpr std::array<StateName, fsm::state_count<StateName>> state_parents{ make_state_parents() };
+
     class ChatBot;
 
+    // Every bot in the process shares the one instance of each state, on
+    // whatever threads the bots run on, without any locking. That is only
+    // safe because a state never changes: the states have no data members
+    // and everything that differs between sessions lives in the ChatBot.
+    // A state that needs data of its own has to keep it immutable once
+    // constructed (const members set up by the constructor) to stay
+    // shareable
     class State
     {
     public:
@@ -26,34 +137,121 @@ namespace chat
         virtual void prompt_user(ChatBot* bot);
         virtual void process_input(ChatBot* bot);
 
+        // Entry and exit actions of superstates, run by transitions into or
+        // out of the states nested in them
+        virtual void on_enter(ChatBot* bot);
+        virtual void on_exit(ChatBot* bot);
+
         // State is a friend of Chatbot (the context), but derived states
         // are not. Derived states must use this function instead
-        void change_state(ChatBot* bot, State* state);
+        void change_state(ChatBot* bot, StateName name);
+
+        // What the default handlers do, counts the request and reports it,
+        // see unhandled::Pairs
+        void not_handled(ChatBot* bot, Request request);
 
         // Helper functions that give derived states access to the context
-        void set_patient_name(ChatBot* bot, std::string name);
-        void set_patient_address(ChatBot* bot, std::string address);
+        // False, and the patient unchanged, for text a compact::Patient
+        // can't hold
+        bool set_patient_name(ChatBot* bot, std::string_view name);
+        bool set_patient_address(ChatBot* bot, std::string_view address);
         void set_patient_age(ChatBot* bot, int age);
         void set_patient_height(ChatBot* bot, int height);
 
+        // Forgets the current patient and the text it kept in the arena
+        void start_patient(ChatBot* bot);
+
+        // Appends the current patient to the bot's store, if it has one
+        void save_patient(ChatBot* bot);
+
+        // Read the next answer from the session's input
+        input::Result<std::string_view> read_line(ChatBot* bot);
+        input::Result<int> read_int(ChatBot* bot);
+
+        // A number outside [min, max] is reported as out of range
+        input::Result<int> read_int(ChatBot* bot, int min, int max);
+
+        // For input the state can't use. The bot stays in the current state
+        // and the next screen tells the user what was wrong, except at the
+        // end of input which finishes the session
+        void reject_input(ChatBot* bot, input::Error error);
+
+        // Replaces the session's screen, one syscall at most
+        void show(ChatBot* bot, render::Screen screen);
+        void show(ChatBot* bot, std::string_view screen);
+
         virtual ~State() = 0;
     };
 
     State::~State() = default;
 
+    State* get_state(StateName name);
+
     class ChatBot
     {
     public:
 
-        ChatBot();
+        // Sessions read from the console by default, but any reader can be
+        // supplied so bots can be driven by something other than a terminal
+        ChatBot(render::Display& display, input::LineReader& input = input::console());
 
         bool running() const;
 
-        // Forward requests to the current state
-        void prompt_user() { current_state_->prompt_user(this); };
-        void process_input() { current_state_->process_input(this); };
+        // Forward requests to the current state, returning whether it
+        // handled them
+        unhandled::Status prompt_user()
+        {
+            trace::EventScope scope{ Request::prompt_user };
+            latency::Timer<StateName, Request> timer{ machine_.state(), Request::prompt_user };
+
+            // A finished session ignores requests, so they aren't journaled
+            if (journal_ && running()) [[unlikely]]
+            {
+                journal_.record(journal::Kind::chat, journal::ChatEvent::prompt_user);
+            }
 
-        const Patient& get_patient_info() const { return patient_; }
+            unhandled_ = false;
+            machine_.dispatch(this, &State::prompt_user);
+
+            return unhandled_ ? unhandled::Status::unhandled : unhandled::Status::handled;
+        }
+
+        unhandled::Status process_input()
+        {
+            trace::EventScope scope{ Request::process_input };
+            latency::Timer<StateName, Request> timer{ machine_.state(), Request::process_input };
+
+            // Write-ahead, the line is read and journaled before the state
+            // can act on it, and the state is handed the same line. Every
+            // state but the finished one reads exactly one
+            if (journal_ && running()) [[unlikely]]
+            {
+                read_ahead_ = input_->next_line();
+                journal::record_input(journal_, journal::Kind::chat, *read_ahead_);
+            }
+
+            unhandled_ = false;
+            machine_.dispatch(this, &State::process_input);
+            read_ahead_.reset();
+
+            return unhandled_ ? unhandled::Status::unhandled : unhandled::Status::handled;
+        }
+
+        compact::PatientView get_patient_info() const { return compact::view(patient_, text_); }
+
+        // Where "Save" puts the patient, saving does nothing without a store
+        void attach_store(store::PatientStore* store) { store_ = store; }
+
+        // Journals every request made of the bot as machine id, with the
+        // line it read, see journal::Journal
+        void attach_journal(journal::Journal* journal, journal::MachineId id) { journal_.attach(journal, id); }
+
+        // Number of times a state has moved the bot to another state
+        std::uint64_t transition_count() const { return machine_.transition_count(); }
+
+        // Puts the bot in a state without it counting as a transition or
+        // running entry actions, see graph::probe_chat
+        void restore(StateName state) { machine_.reset(state); }
 
     private:
 
@@ -62,21 +260,38 @@ namespace chat
         // be directly altered from the outside
         friend State;
 
-        void change_state(State* state)
-        {
-            assert(state);
+        using Machine = fsm::StateMachine<ChatBot, StateName, fsm::SingletonDispatch<State, StateName, &get_state>,
+            fsm::Hierarchy<StateName, state_parents>>;
 
-            current_state_ = state;
-        }
+        Machine machine_{ StateName::StartState };
+
+        compact::Patient patient_{};
+
+        // Holds the text of the current patient, reused for every patient
+        // the session adds
+        compact::TextArena text_;
+
+        store::PatientStore* store_{};
 
-        State* current_state_{};
+        // Not owned, both must outlive the bot
+        render::Display* display_{};
+        input::LineReader* input_{};
 
-        Patient patient_;
+        // Why the last answer was rejected, shown with the next screen
+        input::Error input_error_{ input::Error::none };
+
+        // Set by a default handler, see State::not_handled
+        bool unhandled_{};
+
+        journal::Tap journal_;
+
+        // The line a journaled bot read for its state, see process_input
+        std::optional<input::Result<std::string_view>> read_ahead_;
     };
 
     // States
 
-    class StartState : public State
+    class StartState final : public State
     {
     public:
 
@@ -85,7 +300,7 @@ namespace chat
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class MainMenuState : public State
+    class MainMenuState final : public State
     {
     public:
 
@@ -94,7 +309,7 @@ namespace chat
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectNameState : public State
+    class CollectNameState final : public State
     {
     public:
 
@@ -103,7 +318,7 @@ namespace chat
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectAddressState : public State
+    class CollectAddressState final : public State
     {
     public:
 
@@ -112,7 +327,7 @@ namespace chat
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectAgeState : public State
+    class CollectAgeState final : public State
     {
     public:
 
@@ -121,7 +336,7 @@ namespace chat
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectHeightState : public State
+    class CollectHeightState final : public State
     {
     public:
 
@@ -131,52 +346,64 @@ namespace chat
     };
 
 
-    class EditNameState : public State
+    class PatientState final : public State
+    {
+    public:
+
+        static State* instance();
+        virtual void on_enter(ChatBot* bot) override;
+    };
+
+    // The edit states all read an answer and go back to the edit options
+    // once they have one, each only has to say how its answer is read
+    class EditingState : public State
     {
     public:
 
         static State* instance();
-        virtual void prompt_user(ChatBot* bot) override;
         virtual void process_input(ChatBot* bot) override;
+
+        // Returns true if the answer was used
+        virtual bool accept_answer(ChatBot* bot);
     };
 
-    class EditAddressState : public State
+    class EditNameState final : public EditingState
     {
     public:
 
         static State* instance();
         virtual void prompt_user(ChatBot* bot) override;
-        virtual void process_input(ChatBot* bot) override;
+        virtual bool accept_answer(ChatBot* bot) override;
     };
 
-    class EditAgeState : public State
+    class EditAddressState final : public EditingState
     {
     public:
 
         static State* instance();
         virtual void prompt_user(ChatBot* bot) override;
-        virtual void process_input(ChatBot* bot) override;
+        virtual bool accept_answer(ChatBot* bot) override;
     };
 
-    class EditHeightState : public State
+    class EditAgeState final : public EditingState
     {
     public:
 
         static State* instance();
         virtual void prompt_user(ChatBot* bot) override;
-        virtual void process_input(ChatBot* bot) override;
+        virtual bool accept_answer(ChatBot* bot) override;
     };
 
-    class ConfirmInfoState : public State
+    class EditHeightState final : public EditingState
     {
     public:
 
         static State* instance();
         virtual void prompt_user(ChatBot* bot) override;
-        virtual void process_input(ChatBot* bot) override;
+        virtual bool accept_answer(ChatBot* bot) override;
     };
 
-    class EditOptionsState : public State
+    class ConfirmInfoState final : public State
     {
     public:
 
@@ -185,7 +412,7 @@ namespace chat
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class FinishedState : public State
+    class EditOptionsState final : public State
     {
     public:
 
@@ -194,58 +421,68 @@ namespace chat
         virtual void process_input(ChatBot* bot) override;
     };
 
-    // Utility function to "Clear" the console window
-    void clear_screen();
+    class FinishedState final : public State
+    {
+    public:
+
+        static State* instance();
+        virtual void prompt_user(ChatBot* bot) override;
+        virtual void process_input(ChatBot* bot) override;
+    };
 
     // Start State
     void StartState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Welcome\n\n\n\n\nPress enter to start" << std::endl;
+        show(bot, prompt::start);
     }
 
     void StartState::process_input(ChatBot* bot)
     {
-        std::string line;
-        getline(std::cin, line);
+        // Any line will do, even an empty one
+        auto line = read_line(bot);
 
-        std::cout << "Contents: (" << line << ')' << std::endl;
+        if (!line)
+        {
+            reject_input(bot, line.error);
+            return;
+        }
 
-        change_state(bot, MainMenuState::instance());
+        change_state(bot, StateName::MainMenuState);
     }
 
 
     // MainMenu State
     void MainMenuState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Main Menu\n\n\n\n\n";
-        std::cout << "1. Add Patient\n2. Exit\n\n\n";
-        std::cout << "Type a number according to your selection and press enter\n" << std::endl;
+        show(bot, prompt::main_menu);
     }
 
     void MainMenuState::process_input(ChatBot* bot)
     {
-        int in;
-        std::cin >> in;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        auto choice = read_int(bot);
 
-        switch (in)
+        if (!choice)
+        {
+            reject_input(bot, choice.error);
+            return;
+        }
+
+        switch (choice.value)
         {
         case 1:
         {
-            change_state(bot, CollectNameState::instance());
+            change_state(bot, StateName::CollectNameState);
             break;
         }
         case 2:
         {
-            change_state(bot, FinishedState::instance());
+            change_state(bot, StateName::FinishedState);
             break;
         }
         default:
         {
+            // Not one of the options on screen
+            reject_input(bot, input::Error::out_of_range);
             break;
         }
         }
@@ -255,187 +492,262 @@ namespace chat
     // CollectName State
     void CollectNameState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Name\n\n\n\n\n\n";
-        std::cout << "Type your name and press enter\n" << std::endl;
+        show(bot, prompt::collect_name);
     }
 
     void CollectNameState::process_input(ChatBot* bot)
     {
-        std::string name;
-        getline(std::cin, name);
-        set_patient_name(bot, name);
-        change_state(bot, CollectAddressState::instance());
+        auto name = read_line(bot);
+
+        if (!name)
+        {
+            reject_input(bot, name.error);
+            return;
+        }
+
+        if (!set_patient_name(bot, name.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return;
+        }
+
+        change_state(bot, StateName::CollectAddressState);
     }
 
 
     // CollectAddress State
     void CollectAddressState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Address\n\n\n\n\n\n";
-        std::cout << "Type your address and press enter\n" << std::endl;
+        show(bot, prompt::collect_address);
     }
 
     void CollectAddressState::process_input(ChatBot* bot)
     {
-        std::string address;
-        getline(std::cin, address);
-        set_patient_address(bot, address);
-        change_state(bot, CollectAgeState::instance());
+        auto address = read_line(bot);
+
+        if (!address)
+        {
+            reject_input(bot, address.error);
+            return;
+        }
+
+        if (!set_patient_address(bot, address.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return;
+        }
+
+        change_state(bot, StateName::CollectAgeState);
     }
 
 
     // CollectAge State
     void CollectAgeState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Age\n\n\n\n\n\n";
-        std::cout << "Type your age and press enter\n" << std::endl;
+        show(bot, prompt::collect_age);
     }
 
     void CollectAgeState::process_input(ChatBot* bot)
     {
-        int age{};
-        std::cin >> age;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_age(bot, age);
-        change_state(bot, CollectHeightState::instance());
+        auto age = read_int(bot, 0, compact::max_age);
+
+        if (!age)
+        {
+            reject_input(bot, age.error);
+            return;
+        }
+
+        set_patient_age(bot, age.value);
+        change_state(bot, StateName::CollectHeightState);
     }
 
 
     // CollectHeight State
     void CollectHeightState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Height\n\n\n\n\n\n";
-        std::cout << "Type your height and press enter\n" << std::endl;
+        show(bot, prompt::collect_height);
     }
 
     void CollectHeightState::process_input(ChatBot* bot)
     {
-        int height{};
-        std::cin >> height;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_height(bot, height);
-        change_state(bot, ConfirmInfoState::instance());
+        auto height = read_int(bot, 0, compact::max_height);
+
+        if (!height)
+        {
+            reject_input(bot, height.error);
+            return;
+        }
+
+        set_patient_height(bot, height.value);
+        change_state(bot, StateName::ConfirmInfoState);
+    }
+
+
+    // Patient State
+    void PatientState::on_enter(ChatBot* bot)
+    {
+        // Entered from the main menu, edits and confirming stay inside
+        start_patient(bot);
+    }
+
+
+    // Editing State
+    void EditingState::process_input(ChatBot* bot)
+    {
+        if (accept_answer(bot))
+        {
+            change_state(bot, StateName::EditOptionsState);
+        }
     }
 
 
     // EditName State
     void EditNameState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Name\n\n\n\n\n\n";
-        std::cout << "Type your name and press enter\n" << std::endl;
+        show(bot, prompt::edit_name);
     }
 
-    void EditNameState::process_input(ChatBot* bot)
+    bool EditNameState::accept_answer(ChatBot* bot)
     {
-        std::string name;
-        getline(std::cin, name);
-        set_patient_name(bot, name);
-        change_state(bot, EditOptionsState::instance());
+        auto name = read_line(bot);
+
+        if (!name)
+        {
+            reject_input(bot, name.error);
+            return false;
+        }
+
+        if (!set_patient_name(bot, name.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return false;
+        }
+
+        return true;
     }
 
 
     // EditAddress State
     void EditAddressState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Address\n\n\n\n\n\n";
-        std::cout << "Type your address and press enter\n" << std::endl;
+        show(bot, prompt::edit_address);
     }
 
-    void EditAddressState::process_input(ChatBot* bot)
+    bool EditAddressState::accept_answer(ChatBot* bot)
     {
-        std::string address;
-        getline(std::cin, address);
-        set_patient_address(bot, address);
-        change_state(bot, EditOptionsState::instance());
+        auto address = read_line(bot);
+
+        if (!address)
+        {
+            reject_input(bot, address.error);
+            return false;
+        }
+
+        if (!set_patient_address(bot, address.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return false;
+        }
+
+        return true;
     }
 
 
     // EditAge State
     void EditAgeState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Age\n\n\n\n\n\n";
-        std::cout << "Type your age and press enter\n" << std::endl;
+        show(bot, prompt::edit_age);
     }
 
-    void EditAgeState::process_input(ChatBot* bot)
+    bool EditAgeState::accept_answer(ChatBot* bot)
     {
-        int age{};
-        std::cin >> age;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_age(bot, age);
-        change_state(bot, EditOptionsState::instance());
+        auto age = read_int(bot, 0, compact::max_age);
+
+        if (!age)
+        {
+            reject_input(bot, age.error);
+            return false;
+        }
+
+        set_patient_age(bot, age.value);
+        return true;
     }
 
 
     // EditHeight State
     void EditHeightState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Height\n\n\n\n\n\n";
-        std::cout << "Type your height and press enter\n" << std::endl;
+        show(bot, prompt::edit_height);
     }
 
-    void EditHeightState::process_input(ChatBot* bot)
+    bool EditHeightState::accept_answer(ChatBot* bot)
     {
-        int height{};
-        std::cin >> height;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_height(bot, height);
-        change_state(bot, EditOptionsState::instance());
+        auto height = read_int(bot, 0, compact::max_height);
+
+        if (!height)
+        {
+            reject_input(bot, height.error);
+            return false;
+        }
+
+        set_patient_height(bot, height.value);
+        return true;
     }
 
 
     // ConfirmInfo State
     void ConfirmInfoState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        Patient patient{ bot->get_patient_info() };
-
-        std::cout << "Confirm Info is Correct\n\n\n";
-        std::cout << "Patient Name: " << patient.name << '\n';
-        std::cout << "Patient Address: " << patient.address << '\n';
-        std::cout << "Patient Age: " << patient.age << '\n';
-        std::cout << "Patient Height: " << patient.height << "\n\n\n";
-        std::cout << "1. Edit Patient Info\n2. Save and Return to Menu\n\n\n";
-        std::cout << "Type a number according to your selection and press enter\n" << std::endl;
+        const compact::PatientView patient = bot->get_patient_info();
+
+        // Only the digits of values outside the precomputed table end up here
+        prompt::DecimalBuffer age{};
+        prompt::DecimalBuffer height{};
+
+        // The fixed text is precompiled, the patient fields are slotted in
+        // between so the whole screen goes out in one writev
+        const iovec screen[]{
+            render::segment(prompt::confirm_info::name),
+            render::segment(patient.name),
+            render::segment(prompt::confirm_info::address),
+            render::segment(patient.address),
+            render::segment(prompt::confirm_info::age),
+            render::segment(prompt::decimal(patient.age, age)),
+            render::segment(prompt::confirm_info::height),
+            render::segment(prompt::decimal(patient.height, height)),
+            render::segment(prompt::confirm_info::options)
+        };
+
+        show(bot, screen);
     }
 
     void ConfirmInfoState::process_input(ChatBot* bot)
     {
-        int in;
-        std::cin >> in;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        auto choice = read_int(bot);
 
-        switch (in)
+        if (!choice)
+        {
+            reject_input(bot, choice.error);
+            return;
+        }
+
+        switch (choice.value)
         {
         case 1:
         {
-            change_state(bot, EditOptionsState::instance());
+            change_state(bot, StateName::EditOptionsState);
             break;
         }
         case 2:
         {
-            change_state(bot, MainMenuState::instance());
+            save_patient(bot);
+            change_state(bot, StateName::MainMenuState);
             break;
         }
         default:
         {
+            // Not one of the options on screen
+            reject_input(bot, input::Error::out_of_range);
             break;
         }
         }
@@ -445,48 +757,50 @@ namespace chat
     // EditOptions State
     void EditOptionsState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Info\n\n\n\n\n";
-        std::cout << "1. Edit Name\n2. Edit Address\n3. Edit Age\n4. Edit Height\n5. Save and Continue\n\n\n";
-        std::cout << "Type a number according to your selection and press enter\n" << std::endl;
+        show(bot, prompt::edit_options);
     }
 
     void EditOptionsState::process_input(ChatBot* bot)
     {
-        int in;
-        std::cin >> in;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        auto choice = read_int(bot);
 
-        switch (in)
+        if (!choice)
+        {
+            reject_input(bot, choice.error);
+            return;
+        }
+
+        switch (choice.value)
         {
         case 1:
         {
-            change_state(bot, EditNameState::instance());
+            change_state(bot, StateName::EditNameState);
             break;
         }
         case 2:
         {
-            change_state(bot, EditAddressState::instance());
+            change_state(bot, StateName::EditAddressState);
             break;
         }
         case 3:
         {
-            change_state(bot, EditAgeState::instance());
+            change_state(bot, StateName::EditAgeState);
             break;
         }
         case 4:
         {
-            change_state(bot, EditHeightState::instance());
+            change_state(bot, StateName::EditHeightState);
             break;
         }
         case 5:
         {
-            change_state(bot, ConfirmInfoState::instance());
+            change_state(bot, StateName::ConfirmInfoState);
             break;
         }
         default:
         {
+            // Not one of the options on screen
+            reject_input(bot, input::Error::out_of_range);
             break;
         }
         }
@@ -507,7 +821,19 @@ namespace chat
 
     void run_chat_demo()
     {
-        ChatBot bot{};
+        // Only the lines that changed since the last prompt are sent to the
+        // terminal, once per turn
+        render::Renderer renderer{};
+
+        // Saved patients outlive the demo
+        store::PatientStore store{ "patients.log" };
+
+        ChatBot bot{ renderer };
+
+        if (store.is_open())
+        {
+            bot.attach_store(&store);
+        }
 
         while (bot.running())
         {
@@ -516,139 +842,310 @@ namespace chat
         }
     }
 
-    void State::change_state(ChatBot* bot, State* state)
+    void State::change_state(ChatBot* bot, StateName name)
     {
         assert(bot);
-        bot->change_state(state);
+        bot->machine_.change_state(bot, name);
     }
 
-    void State::set_patient_name(ChatBot* bot, std::string name)
+    void State::not_handled(ChatBot* bot, Request request)
     {
-        bot->patient_.name = name;
+        assert(bot);
+
+        StateName state = bot->machine_.state();
+
+        stats::Unhandled<StateName, Request>::add(state, request);
+        unhandled::Pairs<StateName, Request>::report(state, request);
+
+        bot->unhandled_ = true;
     }
 
-    void State::set_patient_address(ChatBot* bot, std::string address)
+    bool State::set_patient_name(ChatBot* bot, std::string_view name)
     {
-        bot->patient_.address = address;
+        // The only copy, straight out of the line reader's buffer
+        return compact::replace_name(bot->patient_, bot->text_, name);
+    }
+
+    bool State::set_patient_address(ChatBot* bot, std::string_view address)
+    {
+        return compact::replace_address(bot->patient_, bot->text_, address);
     }
 
     void State::set_patient_age(ChatBot* bot, int age)
     {
-        bot->patient_.age = age;
+        assert(age >= 0 && age <= compact::max_age);
+        bot->patient_.age = static_cast<std::uint8_t>(age);
     }
 
     void State::set_patient_height(ChatBot* bot, int height)
     {
-        bot->patient_.height = height;
+        assert(height >= 0 && height <= compact::max_height);
+        bot->patient_.height = static_cast<std::uint16_t>(height);
+    }
+
+    void State::start_patient(ChatBot* bot)
+    {
+        assert(bot);
+
+        // Keeps the arena's memory, edits reuse it through
+        // compact::replace_name and replace_address
+        bot->patient_ = {};
+        bot->text_.clear();
+    }
+
+    void State::save_patient(ChatBot* bot)
+    {
+        assert(bot);
+
+        if (bot->store_)
+        {
+            const compact::PatientView patient = bot->get_patient_info();
+
+            // Durability is left to the store's group commit, the session
+            // doesn't wait for the disk before moving on
+            if (!bot->store_->append(patient.name, patient.address, patient.age, patient.height))
+            {
+                logging::errors() << "Error: patient store is full, patient was not saved" << std::endl;
+            }
+        }
+    }
+
+    input::Result<std::string_view> State::read_line(ChatBot* bot)
+    {
+        assert(bot);
+
+        if (bot->read_ahead_) [[unlikely]]
+        {
+            return *std::exchange(bot->read_ahead_, std::nullopt);
+        }
+
+        return bot->input_->next_line();
+    }
+
+    input::Result<int> State::read_int(ChatBot* bot)
+    {
+        // Through read_line so a journaled bot's state gets its line
+        input::Result<std::string_view> line = read_line(bot);
+
+        if (!line)
+        {
+            return { 0, line.error };
+        }
+
+        return input::parse_int(line.value);
+    }
+
+    input::Result<int> State::read_int(ChatBot* bot, int min, int max)
+    {
+        input::Result<int> result = read_int(bot);
+
+        if (result && (result.value < min || result.value > max))
+        {
+            result.error = input::Error::out_of_range;
+        }
+
+        return result;
+    }
+
+    void State::reject_input(ChatBot* bot, input::Error error)
+    {
+        assert(bot);
+
+        if (error == input::Error::end_of_input)
+        {
+            change_state(bot, StateName::FinishedState);
+            return;
+        }
+
+        bot->input_error_ = error;
+    }
+
+    void State::show(ChatBot* bot, render::Screen screen)
+    {
+        assert(bot);
+
+        if (bot->input_error_ == input::Error::none)
+        {
+            bot->display_->show(screen);
+            return;
+        }
+
+        // Add the reason the last answer was rejected below the screen
+        constexpr std::size_t max_segments{ 16 };
+        assert(screen.size() < max_segments);
+
+        iovec segments[max_segments];
+        std::size_t count{};
+
+        for (const iovec& segment : screen)
+        {
+            segments[count++] = segment;
+        }
+
+        segments[count++] = render::segment(prompt::invalid_input_message(bot->input_error_));
+        bot->input_error_ = input::Error::none;
+
+        bot->display_->show({ segments, count });
+    }
+
+    void State::show(ChatBot* bot, std::string_view screen)
+    {
+        const iovec segment = render::segment(screen);
+        show(bot, { &segment, 1 });
     }
 
-    ChatBot::ChatBot()
+    ChatBot::ChatBot(render::Display& display, input::LineReader& input)
+        : display_(&display), input_(&input)
     {
-        change_state(StartState::instance());
     }
 
     bool ChatBot::running() const
     {
-        return current_state_ != FinishedState::instance();
+        return machine_.state() != StateName::FinishedState;
+    }
+
+    State* get_state(StateName name)
+    {
+        switch (name)
+        {
+        case StateName::StartState: return StartState::instance();
+        case StateName::MainMenuState: return MainMenuState::instance();
+        case StateName::CollectNameState: return CollectNameState::instance();
+        case StateName::CollectAddressState: return CollectAddressState::instance();
+        case StateName::CollectAgeState: return CollectAgeState::instance();
+        case StateName::CollectHeightState: return CollectHeightState::instance();
+        case StateName::EditNameState: return EditNameState::instance();
+        case StateName::EditAddressState: return EditAddressState::instance();
+        case StateName::EditAgeState: return EditAgeState::instance();
+        case StateName::EditHeightState: return EditHeightState::instance();
+        case StateName::ConfirmInfoState: return ConfirmInfoState::instance();
+        case StateName::EditOptionsState: return EditOptionsState::instance();
+        case StateName::FinishedState: return FinishedState::instance();
+        case StateName::PatientState: return PatientState::instance();
+        case StateName::EditingState: return EditingState::instance();
+        case StateName::count: break;
+        }
+
+        return nullptr;
     }
 
+    // The states every bot shares. Constant initialized at namespace scope
+    // instead of being a static inside instance(), which left a thread safe
+    // initialization guard to check on every lookup and so every transition
+    constinit StartState start_state{};
+    constinit MainMenuState main_menu_state{};
+    constinit CollectNameState collect_name_state{};
+    constinit CollectAddressState collect_address_state{};
+    constinit CollectAgeState collect_age_state{};
+    constinit CollectHeightState collect_height_state{};
+    constinit EditNameState edit_name_state{};
+    constinit EditAddressState edit_address_state{};
+    constinit EditAgeState edit_age_state{};
+    constinit EditHeightState edit_height_state{};
+    constinit ConfirmInfoState confirm_info_state{};
+    constinit EditOptionsState edit_options_state{};
+    constinit FinishedState finished_state{};
+    constinit PatientState patient_state{};
+    constinit EditingState editing_state{};
+
     State* StartState::instance()
     {
-        static StartState state;
-        return &state;
+        return &start_state;
     }
 
     State* MainMenuState::instance()
     {
-        static MainMenuState state;
-        return &state;
+        return &main_menu_state;
     }
 
     State* CollectNameState::instance()
     {
-        static CollectNameState state;
-        return &state;
+        return &collect_name_state;
     }
 
     State* CollectAddressState::instance()
     {
-        static CollectAddressState state;
-        return &state;
+        return &collect_address_state;
     }
 
     State* CollectAgeState::instance()
     {
-        static CollectAgeState state;
-        return &state;
+        return &collect_age_state;
     }
 
     State* CollectHeightState::instance()
     {
-        static CollectHeightState state;
-        return &state;
+        return &collect_height_state;
     }
 
     State* EditNameState::instance()
     {
-        static EditNameState state;
-        return &state;
+        return &edit_name_state;
     }
 
     State* EditAddressState::instance()
     {
-        static EditAddressState state;
-        return &state;
+        return &edit_address_state;
     }
 
     State* EditAgeState::instance()
     {
-        static EditAgeState state;
-        return &state;
+        return &edit_age_state;
     }
 
     State* EditHeightState::instance()
     {
-        static EditHeightState state;
-        return &state;
+        return &edit_height_state;
     }
 
     State* ConfirmInfoState::instance()
     {
-        static ConfirmInfoState state;
-        return &state;
+        return &confirm_info_state;
     }
 
     State* EditOptionsState::instance()
     {
-        static EditOptionsState state;
-        return &state;
+        return &edit_options_state;
     }
 
     State* FinishedState::instance()
     {
-        static FinishedState state;
-        return &state;
+        return &finished_state;
+    }
+
+    State* PatientState::instance()
+    {
+        return &patient_state;
+    }
+
+    State* EditingState::instance()
+    {
+        return &editing_state;
     }
 
 
     void State::prompt_user(ChatBot* bot)
     {
-        std::cout << "Error: State does not implement State::prompt_user" << std::endl;
+        not_handled(bot, Request::prompt_user);
     }
 
     void State::process_input(ChatBot* bot)
     {
-        std::cout << "Error: State does not implement State::process_input" << std::endl;
+        not_handled(bot, Request::process_input);
     }
 
-    void clear_screen()
+    void State::on_enter(ChatBot* bot)
     {
-        for (int i = 0; i < 100; ++i)
-        {
-            std::cout << "\n";
-        }
+    }
 
-        std::cout << std::endl;
+    void State::on_exit(ChatBot* bot)
+    {
+    }
+
+    bool EditingState::accept_answer(ChatBot* bot)
+    {
+        logging::errors() << "Error: State does not implement EditingState::accept_answer" << std::endl;
+        return false;
     }
 }
 
@@ -0,0 +1,337 @@
+#ifndef COMPACTPATIENT
+#define COMPACTPATIENT
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace compact
+{
+    // The original Patient was two std::strings and two ints, 72 bytes before
+    // the strings spill to the heap, and every set_patient_name copied the
+    // input into a by-value string and then again into the struct. Here the
+    // text of a patient lives in an arena owned by the session (or by a
+    // shard of stored patients) and the record itself only holds offsets
+    // and lengths into it, with age and height narrowed to what they need.
+    // Input is copied exactly once, from the line reader into the arena
+
+    // Longest name or address a record can hold, longer text is refused
+    constexpr std::size_t max_text_length{ std::numeric_limits<std::uint16_t>::max() };
+
+    // Offsets are 32 bit, a shard should be split long before its arena
+    // holds this much
+    constexpr std::size_t max_arena_size{ std::numeric_limits<std::uint32_t>::max() };
+
+    constexpr int max_age{ std::numeric_limits<std::uint8_t>::max() };
+    constexpr int max_height{ std::numeric_limits<std::uint16_t>::max() };
+
+    // The location of a string in an arena
+    struct TextRef
+    {
+        std::uint32_t offset{};
+        std::uint16_t length{};
+    };
+
+    // 16 bytes, laid out by hand so the narrow fields share the padding
+    struct Patient
+    {
+        std::uint32_t name_offset{};
+        std::uint32_t address_offset{};
+        std::uint16_t name_length{};
+        std::uint16_t address_length{};
+        std::uint16_t height{};
+        std::uint8_t age{};
+
+        TextRef name() const { return { name_offset, name_length }; }
+        TextRef address() const { return { address_offset, address_length }; }
+
+        void set_name(TextRef text) { name_offset = text.offset; name_length = text.length; }
+        void set_address(TextRef text) { address_offset = text.offset; address_length = text.length; }
+    };
+
+    static_assert(sizeof(Patient) == 16, "Patient should stay two words");
+
+    // What the states read when they show a patient. Valid until the arena
+    // the patient's text lives in is next changed
+    struct PatientView
+    {
+        std::string_view name;
+        std::string_view address;
+        int age{};
+        int height{};
+    };
+
+    // Append only storage for the text of many patients. Strings are
+    // referred to by offset so the storage can grow without invalidating
+    // the records that point into it
+    class TextArena
+    {
+    public:
+
+        // Nothing, and nothing stored, if the text is longer than
+        // max_text_length or the arena has run out of offsets
+        std::optional<TextRef> store(std::string_view text);
+
+        // Stores text in place of old, which the caller no longer needs:
+        // over it if the text fits or old is the last string stored, after
+        // everything else otherwise. Nothing, and old untouched, if the text
+        // can't be stored
+        std::optional<TextRef> replace(TextRef old, std::string_view text);
+
+        // Moves the strings refs point to down over everything else, which
+        // is forgotten, and updates refs to match
+        void compact(std::span<TextRef> refs);
+
+        bool has_room(std::size_t bytes) const { return bytes <= max_arena_size - bytes_.size(); }
+
+        std::string_view view(TextRef text) const
+        {
+            assert(std::size_t{ text.offset } + text.length <= bytes_.size());
+            return { bytes_.data() + text.offset, text.length };
+        }
+
+        // Forgets every string but keeps the memory for reuse
+        void clear() { bytes_.clear(); }
+
+        std::size_t size() const { return bytes_.size(); }
+        std::size_t capacity() const { return bytes_.capacity(); }
+
+    private:
+
+        std::vector<char> bytes_;
+    };
+
+    PatientView view(const Patient& patient, const TextArena& arena)
+    {
+        return { arena.view(patient.name()), arena.view(patient.address()), patient.age, patient.height };
+    }
+
+    // A session's arena holds the text of its one patient, so edits write
+    // over the old text where they can, and once more of the arena is
+    // left behind by edits than is in use it is packed down to the two
+    // strings. False, and the patient unchanged, if the text is too long
+    bool replace_name(Patient& patient, TextArena& arena, std::string_view name);
+    bool replace_address(Patient& patient, TextArena& arena, std::string_view address);
+
+
+    // A shard of patients held in memory, one arena for all of their text
+    class PatientTable
+    {
+    public:
+
+        // Nothing, and nothing added, if a field is out of the range the
+        // record can hold or the shard is full
+        std::optional<std::uint32_t> add(std::string_view name, std::string_view address, int age, int height);
+
+        PatientView get(std::uint32_t index) const { return view(records_[index], text_); }
+
+        std::size_t size() const { return records_.size(); }
+
+        // Everything the shard has allocated, including room to grow
+        std::size_t footprint() const
+        {
+            return sizeof(*this) + records_.capacity() * sizeof(Patient) + text_.capacity();
+        }
+
+        // What the patients themselves take up
+        std::size_t bytes_used() const
+        {
+            return records_.size() * sizeof(Patient) + text_.size();
+        }
+
+    private:
+
+        std::vector<Patient> records_;
+        TextArena text_;
+    };
+
+
+    // TextArena
+
+    std::optional<TextRef> TextArena::store(std::string_view text)
+    {
+        if (text.size() > max_text_length || !has_room(text.size()))
+        {
+            return std::nullopt;
+        }
+
+        TextRef ref{ static_cast<std::uint32_t>(bytes_.size()), static_cast<std::uint16_t>(text.size()) };
+        bytes_.insert(bytes_.end(), text.begin(), text.end());
+
+        return ref;
+    }
+
+    std::optional<TextRef> TextArena::replace(TextRef old, std::string_view text)
+    {
+        if (text.size() > max_text_length)
+        {
+            return std::nullopt;
+        }
+
+        assert(std::size_t{ old.offset } + old.length <= bytes_.size());
+
+        if (text.size() <= old.length)
+        {
+            std::copy(text.begin(), text.end(), bytes_.begin() + old.offset);
+            return TextRef{ old.offset, static_cast<std::uint16_t>(text.size()) };
+        }
+
+        if (std::size_t{ old.offset } + old.length == bytes_.size())
+        {
+            // The last string, so it can grow where it is
+            bytes_.resize(old.offset);
+            return store(text);
+        }
+
+        return store(text);
+    }
+
+    void TextArena::compact(std::span<TextRef> refs)
+    {
+        // Lowest offset first, so each string only ever moves down
+        std::vector<TextRef*> order(refs.size());
+
+        for (std::size_t i = 0; i < refs.size(); ++i)
+        {
+            order[i] = &refs[i];
+        }
+
+        std::sort(order.begin(), order.end(), [](const TextRef* a, const TextRef* b) { return a->offset < b->offset; });
+
+        std::size_t end{};
+
+        for (TextRef* ref : order)
+        {
+            // Strings only move down, which std::copy allows to overlap
+            std::copy_n(bytes_.begin() + ref->offset, ref->length, bytes_.begin() + static_cast<std::ptrdiff_t>(end));
+            ref->offset = static_cast<std::uint32_t>(end);
+            end += ref->length;
+        }
+
+        bytes_.resize(end);
+    }
+
+
+    // Patient
+
+    bool replace_text(Patient& patient, TextArena& arena, bool name, std::string_view text)
+    {
+        std::optional<TextRef> ref = arena.replace(name ? patient.name() : patient.address(), text);
+
+        if (!ref)
+        {
+            return false;
+        }
+
+        name ? patient.set_name(*ref) : patient.set_address(*ref);
+
+        std::size_t used = std::size_t{ patient.name_length } + patient.address_length;
+
+        if (arena.size() > 2 * used + 64)
+        {
+            TextRef refs[]{ patient.name(), patient.address() };
+            arena.compact(refs);
+            patient.set_name(refs[0]);
+            patient.set_address(refs[1]);
+        }
+
+        return true;
+    }
+
+    bool replace_name(Patient& patient, TextArena& arena, std::string_view name)
+    {
+        return replace_text(patient, arena, true, name);
+    }
+
+    bool replace_address(Patient& patient, TextArena& arena, std::string_view address)
+    {
+        return replace_text(patient, arena, false, address);
+    }
+
+
+    // PatientTable
+
+    std::optional<std::uint32_t> PatientTable::add(std::string_view name, std::string_view address, int age, int height)
+    {
+        bool valid = age >= 0 && age <= max_age && height >= 0 && height <= max_height
+            && name.size() <= max_text_length && address.size() <= max_text_length
+            && text_.has_room(name.size() + address.size())
+            && records_.size() < std::numeric_limits<std::uint32_t>::max();
+
+        if (!valid)
+        {
+            return std::nullopt;
+        }
+
+        Patient patient{};
+        patient.set_name(*text_.store(name));
+        patient.set_address(*text_.store(address));
+        patient.age = static_cast<std::uint8_t>(age);
+        patient.height = static_cast<std::uint16_t>(height);
+
+        records_.push_back(patient);
+
+        return static_cast<std::uint32_t>(records_.size() - 1);
+    }
+
+
+    // Compares the memory used by count patients in the original layout
+    // with the compact one
+    void run_footprint_report(std::size_t count)
+    {
+        // The layout chat::Patient and nosingleton::Patient used to have
+        struct WidePatient
+        {
+            std::string name;
+            std::string address;
+            int age;
+            int height;
+        };
+
+        auto heap_bytes = [](const std::string& text)
+        {
+            // Short strings are stored inside the string object itself
+            return text.capacity() > std::string{}.capacity() ? text.capacity() + 1 : 0;
+        };
+
+        std::vector<WidePatient> wide;
+        wide.reserve(count);
+
+        PatientTable table{};
+
+        std::size_t wide_bytes{ count * sizeof(WidePatient) };
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            std::string name = "Patient " + std::to_string(i);
+            std::string address = std::to_string(i) + " Main Street, Springfield";
+
+            wide.push_back({ name, address, static_cast<int>(20 + i % 60), static_cast<int>(150 + i % 50) });
+            wide_bytes += heap_bytes(wide.back().name) + heap_bytes(wide.back().address);
+
+            if (!table.add(name, address, static_cast<int>(20 + i % 60), static_cast<int>(150 + i % 50)))
+            {
+                std::cerr << "Error: the shard is full after " << table.size() << " patients" << std::endl;
+                return;
+            }
+        }
+
+        std::cout << count << " patients\n"
+            << "  std::string layout: " << sizeof(WidePatient) << " byte records, "
+            << wide_bytes << " bytes total, " << static_cast<double>(wide_bytes) / count << " bytes/patient\n"
+            << "  compact layout:     " << sizeof(Patient) << " byte records, "
+            << table.footprint() << " bytes total, " << static_cast<double>(table.footprint()) / count
+            << " bytes/patient (" << static_cast<double>(table.bytes_used()) / count
+            << " without room to grow)" << std::endl;
+    }
+}
+
+#endif
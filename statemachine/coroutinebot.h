@@ -0,0 +1,573 @@
+#ifndef COROUTINEBOT
+#define COROUTINEBOT
+
+// Requires C++20 for <coroutine>
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <memory>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cassert>
+
+#include "chatbot.h"
+#include "lineinput.h"
+
+namespace coro
+{
+    // run_chat_demo dedicates a thread to each session because every
+    // process_input blocks on std::cin until the user types something.
+    // Here each session is a coroutine that suspends while it waits for
+    // its next line, so one event loop thread can drive any number of
+    // sessions and only wakes the one whose input actually arrived
+
+    // Fixed size block allocator for coroutine frames. Every session runs
+    // the same coroutine so every frame is the same size, which makes a
+    // simple free list sufficient. Suspending and resuming never allocate,
+    // and with the pool creating and destroying a session doesn't either
+    class FramePool
+    {
+    public:
+
+        FramePool(std::size_t block_size, std::size_t block_count);
+
+        FramePool(const FramePool&) = delete;
+        FramePool& operator=(const FramePool&) = delete;
+
+        void* allocate(std::size_t size);
+        void deallocate(void* frame);
+
+        // Returns a frame to whichever pool allocated it
+        static void release(void* frame);
+
+        // Frames that didn't fit in a block (or arrived when the pool was
+        // exhausted) and had to come from the global heap instead
+        std::size_t heap_fallbacks() const { return heap_fallbacks_; }
+
+    private:
+
+        // Free blocks store the link to the next free block in themselves
+        struct FreeBlock
+        {
+            FreeBlock* next;
+        };
+
+        // Each block starts with a pointer back to the pool so that the
+        // promise's operator delete, which only receives the frame
+        // address, can find where the frame came from
+        static constexpr std::size_t header_size_{ alignof(std::max_align_t) };
+
+        bool owns(const std::byte* block) const;
+
+        std::size_t block_size_{};
+        std::size_t block_count_{};
+        std::unique_ptr<std::byte[]> storage_;
+        FreeBlock* free_list_{};
+        std::size_t heap_fallbacks_{};
+
+        // Sessions can be opened and closed from any thread, but this is
+        // only taken on creation and destruction, never on resume
+        std::mutex mutex_;
+    };
+
+
+    class EventLoop;
+    class Channel;
+
+    // The coroutine return object. It only exists long enough to hand the
+    // handle over to the event loop which owns the frame from then on. It
+    // owns the frame until then, so one that is dropped without release
+    // destroys the frame rather than leak a block of the pool
+    class [[nodiscard]] Session
+    {
+    public:
+
+        struct promise_type
+        {
+            // The leading EventLoop argument of the coroutine selects the
+            // pool its frame is allocated from
+            template <typename... Args>
+            static void* operator new(std::size_t size, EventLoop& loop, Args&...);
+            static void operator delete(void* frame, std::size_t size);
+
+            Session get_return_object()
+            {
+                return Session{ std::coroutine_handle<promise_type>::from_promise(*this) };
+            }
+
+            // Run eagerly up to the first prompt so the user sees something
+            // as soon as the session is opened
+            std::suspend_never initial_suspend() noexcept { return {}; }
+
+            // Stay suspended at the end so the loop can notice the session
+            // is done and destroy the frame itself
+            std::suspend_always final_suspend() noexcept { return {}; }
+
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+
+        Session(Session&& other) noexcept
+            : handle_(std::exchange(other.handle_, nullptr))
+        {
+        }
+
+        Session& operator=(Session&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                handle_ = std::exchange(other.handle_, nullptr);
+            }
+
+            return *this;
+        }
+
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        ~Session() { reset(); }
+
+        // Hands the frame over, the caller has to destroy it
+        [[nodiscard]] std::coroutine_handle<promise_type> release()
+        {
+            return std::exchange(handle_, nullptr);
+        }
+
+    private:
+
+        void reset()
+        {
+            if (handle_)
+            {
+                std::exchange(handle_, nullptr).destroy();
+            }
+        }
+
+        explicit Session(std::coroutine_handle<promise_type> handle)
+            : handle_(handle)
+        {
+        }
+
+        std::coroutine_handle<promise_type> handle_{};
+    };
+
+
+    // The mailbox of a single session. The event loop copies each line
+    // into it and resumes the coroutine that is waiting on it
+    class Channel
+    {
+    public:
+
+        // co_await channel.next_line() suspends the session until the event
+        // loop delivers a line for it, the line is valid until the next await
+        auto next_line()
+        {
+            struct Awaiter
+            {
+                Channel* channel;
+
+                bool await_ready() const noexcept { return false; }
+
+                void await_suspend(std::coroutine_handle<> handle) noexcept
+                {
+                    channel->waiter_ = handle;
+                }
+
+                std::string& await_resume() const noexcept
+                {
+                    return channel->line_;
+                }
+            };
+
+            return Awaiter{ this };
+        }
+
+    private:
+
+        friend EventLoop;
+
+        std::coroutine_handle<> waiter_{};
+
+        // Keeps its capacity between turns so delivering a line doesn't
+        // allocate once the session has seen a line of similar length
+        std::string line_;
+
+        std::coroutine_handle<Session::promise_type> task_{};
+    };
+
+
+    using SessionId = std::size_t;
+
+    class EventLoop
+    {
+    public:
+
+        // All frames and channels are allocated up front for max_sessions
+        EventLoop(std::size_t max_sessions, render::Display& display);
+        ~EventLoop();
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        // Must be called before run() or from the loop thread itself
+        // Returns the id that input for the new session is posted to
+        SessionId open_session();
+
+        // Thread safe, can be called by any number of producer threads
+        void post(SessionId id, std::string_view line);
+
+        // Tells the loop no more input is coming so run() can return even
+        // if some sessions are still waiting for a line
+        void close();
+
+        // Blocks the calling thread, which becomes the loop thread, until
+        // every session has finished or the input has been closed
+        void run();
+
+        std::size_t live_sessions() const { return live_sessions_; }
+        std::size_t finished_sessions() const { return finished_sessions_; }
+
+        FramePool& frame_pool() { return frame_pool_; }
+        render::Display& display() { return display_; }
+
+    private:
+
+        struct Message
+        {
+            SessionId id{};
+            std::string line;
+        };
+
+        // Messages are written into slots that are reused rather than
+        // pushed and popped, so the strings keep their capacity
+        struct Inbox
+        {
+            std::vector<Message> messages;
+            std::size_t count{};
+        };
+
+        void deliver(Message& message);
+        void destroy(Channel& channel);
+
+        FramePool frame_pool_;
+        std::vector<Channel> channels_;
+        render::Display& display_;
+
+        SessionId next_id_{};
+        std::size_t live_sessions_{};
+        std::size_t finished_sessions_{};
+
+        // Producers fill one inbox while the loop drains the other
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        Inbox inbox_;
+        Inbox draining_;
+        bool closed_{ false };
+    };
+
+
+    // The same loop as run_chat_demo, except waiting for input suspends
+    // the session instead of blocking the thread
+    Session run_chat_session(EventLoop& loop, Channel& channel)
+    {
+        // Only ever holds the one line the session was resumed with
+        input::LineReader input{};
+
+        chat::ChatBot bot{ loop.display(), input };
+
+        while (bot.running())
+        {
+            bot.prompt_user();
+
+            input.set_line(co_await channel.next_line());
+
+            bot.process_input();
+        }
+    }
+
+
+    // FramePool
+
+    FramePool::FramePool(std::size_t block_size, std::size_t block_count)
+        : block_count_(block_count)
+    {
+        // Keep every block aligned as strictly as operator new would
+        constexpr std::size_t alignment{ alignof(std::max_align_t) };
+        block_size_ = (block_size + header_size_ + alignment - 1) / alignment * alignment;
+
+        storage_ = std::make_unique<std::byte[]>(block_size_ * block_count_);
+
+        // Thread the free list through the blocks back to front so blocks
+        // are handed out in address order
+        for (std::size_t i = block_count_; i > 0; --i)
+        {
+            auto* block = reinterpret_cast<FreeBlock*>(storage_.get() + (i - 1) * block_size_);
+            block->next = free_list_;
+            free_list_ = block;
+        }
+    }
+
+    void* FramePool::allocate(std::size_t size)
+    {
+        std::byte* block{};
+
+        {
+            std::lock_guard lock{ mutex_ };
+
+            if (size + header_size_ <= block_size_ && free_list_)
+            {
+                block = reinterpret_cast<std::byte*>(free_list_);
+                free_list_ = free_list_->next;
+            }
+            else
+            {
+                ++heap_fallbacks_;
+            }
+        }
+
+        if (!block)
+        {
+            block = static_cast<std::byte*>(::operator new(size + header_size_));
+        }
+
+        *reinterpret_cast<FramePool**>(block) = this;
+        return block + header_size_;
+    }
+
+    void FramePool::deallocate(void* frame)
+    {
+        std::byte* block = static_cast<std::byte*>(frame) - header_size_;
+
+        if (!owns(block))
+        {
+            ::operator delete(block);
+            return;
+        }
+
+        std::lock_guard lock{ mutex_ };
+
+        auto* free_block = reinterpret_cast<FreeBlock*>(block);
+        free_block->next = free_list_;
+        free_list_ = free_block;
+    }
+
+    void FramePool::release(void* frame)
+    {
+        std::byte* block = static_cast<std::byte*>(frame) - header_size_;
+        (*reinterpret_cast<FramePool**>(block))->deallocate(frame);
+    }
+
+    bool FramePool::owns(const std::byte* block) const
+    {
+        const std::byte* begin = storage_.get();
+        return block >= begin && block < begin + block_size_ * block_count_;
+    }
+
+
+    // Session
+
+    template <typename... Args>
+    void* Session::promise_type::operator new(std::size_t size, EventLoop& loop, Args&...)
+    {
+        return loop.frame_pool().allocate(size);
+    }
+
+    void Session::promise_type::operator delete(void* frame, std::size_t)
+    {
+        FramePool::release(frame);
+    }
+
+
+    // EventLoop
+
+    // A frame holds the bot, its input stream and the locals of the
+    // coroutine. 1 KiB leaves plenty of headroom, if the frame ever
+    // outgrows it the pool reports heap fallbacks rather than failing
+    EventLoop::EventLoop(std::size_t max_sessions, render::Display& display)
+        : frame_pool_(1024, max_sessions)
+        , channels_(max_sessions)
+        , display_(display)
+    {
+        inbox_.messages.resize(max_sessions);
+        draining_.messages.resize(max_sessions);
+    }
+
+    EventLoop::~EventLoop()
+    {
+        // Sessions that never received their remaining input
+        for (Channel& channel : channels_)
+        {
+            if (channel.task_)
+            {
+                destroy(channel);
+            }
+        }
+    }
+
+    SessionId EventLoop::open_session()
+    {
+        // Ids are never reused, so late input for a finished session
+        // can't be delivered to a newer one
+        SessionId id{ next_id_++ };
+        assert(id < channels_.size());
+
+        Channel& channel = channels_[id];
+        ++live_sessions_;
+
+        // Runs up to the first co_await before returning
+        channel.task_ = run_chat_session(*this, channel).release();
+
+        if (channel.task_.done())
+        {
+            destroy(channel);
+            ++finished_sessions_;
+        }
+
+        return id;
+    }
+
+    void EventLoop::post(SessionId id, std::string_view line)
+    {
+        {
+            std::lock_guard lock{ mutex_ };
+
+            if (inbox_.count == inbox_.messages.size())
+            {
+                // Only grows when producers get far ahead of the loop
+                inbox_.messages.resize(inbox_.messages.size() * 2 + 1);
+            }
+
+            Message& message = inbox_.messages[inbox_.count++];
+            message.id = id;
+            message.line.assign(line);
+        }
+
+        ready_.notify_one();
+    }
+
+    void EventLoop::close()
+    {
+        {
+            std::lock_guard lock{ mutex_ };
+            closed_ = true;
+        }
+
+        ready_.notify_one();
+    }
+
+    void EventLoop::run()
+    {
+        while (live_sessions_ > 0)
+        {
+            {
+                std::unique_lock lock{ mutex_ };
+                ready_.wait(lock, [this] { return inbox_.count > 0 || closed_; });
+
+                if (inbox_.count == 0)
+                {
+                    // Closed and nothing left to deliver
+                    return;
+                }
+
+                std::swap(inbox_, draining_);
+            }
+
+            // Deliver outside the lock so producers never wait on a session
+            for (std::size_t i = 0; i < draining_.count; ++i)
+            {
+                deliver(draining_.messages[i]);
+            }
+
+            draining_.count = 0;
+        }
+    }
+
+    void EventLoop::deliver(Message& message)
+    {
+        assert(message.id < channels_.size());
+        Channel& channel = channels_[message.id];
+
+        // Input for sessions that already finished is dropped
+        if (!channel.task_ || !channel.waiter_)
+        {
+            return;
+        }
+
+        // Swapping hands the channel the new line and gives the message
+        // slot the old buffer to reuse, so neither side allocates
+        channel.line_.swap(message.line);
+
+        std::exchange(channel.waiter_, nullptr).resume();
+
+        if (channel.task_.done())
+        {
+            destroy(channel);
+            ++finished_sessions_;
+        }
+    }
+
+    void EventLoop::destroy(Channel& channel)
+    {
+        std::exchange(channel.task_, nullptr).destroy();
+        channel.waiter_ = nullptr;
+        --live_sessions_;
+    }
+
+
+    void run_coroutine_demo()
+    {
+        // One scripted patient, the same answers a user would type
+        const std::vector<std::string_view> script{
+            "", "1", "Jane Doe", "1 Main Street", "42", "170", "2", "2" };
+
+        constexpr std::size_t session_count{ 10000 };
+
+        // The sessions all share one thread so there is no sensible way
+        // to show their screens, only the totals are of interest here
+        render::NullDisplay display{};
+
+        EventLoop loop{ session_count, display };
+
+        for (std::size_t i = 0; i < session_count; ++i)
+        {
+            loop.open_session();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        // Stands in for the network or terminal threads that would normally
+        // receive input, interleaving lines across all sessions
+        std::thread producer{ [&loop, &script]
+        {
+            for (std::string_view line : script)
+            {
+                for (SessionId id = 0; id < session_count; ++id)
+                {
+                    loop.post(id, line);
+                }
+            }
+
+            loop.close();
+        } };
+
+        loop.run();
+        producer.join();
+
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+        std::cout << "Ran " << loop.finished_sessions() << " sessions on one thread in "
+            << elapsed.count() << "s\n"
+            << "Frames allocated from the heap: " << loop.frame_pool().heap_fallbacks() << std::endl;
+    }
+}
+
+#endif
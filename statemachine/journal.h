@@ -0,0 +1,892 @@
+#ifndef JOURNAL
+#define JOURNAL
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <compare>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lineinput.h"
+
+namespace journal
+{
+    // An optional write-ahead journal of the requests made of the machines
+    // attached to it, so that a connection or chat session lost in a crash
+    // can be rebuilt by making the same requests of a fresh one.
+    //
+    // Records go into segment files in a directory, each allocated at its
+    // full size up front and mapped, so appending is a reservation with one
+    // atomic add and a copy, as in store::PatientStore, and never a system
+    // call. A committer thread makes everything appended since its last
+    // commit durable with one fdatasync, every commit interval or as soon
+    // as someone waits in sync (group commit). When a segment fills up
+    // appends move on to a spare the committer has already prepared, and
+    // segments that a snapshot has made redundant can be deleted with
+    // truncate.
+    //
+    // A journal never appends to a segment left by an earlier run, whose
+    // tail may have been torn by a crash, it always starts a new one
+
+    using MachineId = std::uint32_t;
+
+    // Which kind of machine a record is for, which decides what its event
+    // codes mean
+    enum class Kind : std::uint8_t
+    {
+        // book::TCPConnection, events are TCPRequest
+        tcp,
+
+        // chat::ChatBot and nosingleton::ChatBot, events are ChatEvent
+        chat,
+        nosingleton
+    };
+
+    // A journaled chat bot reads the line for process_input itself and
+    // journals it, or the reason it got none, before its state sees it.
+    // The state decides again what the line means when the bot is rebuilt
+    enum class ChatEvent : std::uint8_t
+    {
+        prompt_user,
+        process_input,
+        end_of_input,
+        line_too_long
+    };
+
+    // Events every kind of machine can have. A fresh machine has replaced
+    // the old one, and a snapshot holds the whole state of the machine in
+    // its payload, so neither needs anything journaled before it
+    constexpr std::uint8_t fresh_machine{ 0xff };
+    constexpr std::uint8_t snapshot{ 0xfe };
+
+    struct Entry
+    {
+        MachineId machine{};
+        Kind kind{};
+        std::uint8_t event{};
+
+        // Only valid during the visit
+        std::string_view payload;
+    };
+
+    // Every record starts with this header, followed by the payload and
+    // padding up to the next header
+    struct RecordHeader
+    {
+        // Written last, a record without its commit word was torn by a
+        // crash or is still being written
+        std::uint32_t commit;
+        std::uint32_t checksum;
+        MachineId machine;
+        std::uint16_t length;
+        Kind kind;
+        std::uint8_t event;
+    };
+
+    static_assert(sizeof(RecordHeader) == 16);
+
+    struct SegmentHeader
+    {
+        char magic[8];
+        std::uint64_t number;
+
+        // The number of the first segment the journal that wrote this one
+        // made, so that segments after a torn one can be told apart
+        std::uint64_t run;
+    };
+
+    constexpr std::uint32_t record_magic{ 0x4c415752 };
+
+    // Where the records of a segment end, written when the next record
+    // didn't fit or the journal was closed
+    constexpr std::uint32_t end_magic{ 0x444e4557 };
+
+    constexpr char segment_magic[8]{ 'S', 'M', 'W', 'A', 'L', '0', '0', '1' };
+
+    // Records start on their own cache line after the segment header
+    constexpr std::size_t data_offset{ 64 };
+    constexpr std::size_t record_alignment{ 8 };
+    constexpr std::size_t max_payload{ 0xffff };
+
+    std::uint64_t record_size(std::size_t length)
+    {
+        return (sizeof(RecordHeader) + length + record_alignment - 1) / record_alignment * record_alignment;
+    }
+
+    std::uint32_t checksum(const RecordHeader& header, std::string_view payload)
+    {
+        // FNV-1a over everything after the checksum and then the payload
+        std::uint32_t value{ 2166136261u };
+        const auto* bytes = reinterpret_cast<const unsigned char*>(&header);
+
+        for (std::size_t i = offsetof(RecordHeader, machine); i < sizeof(RecordHeader); ++i)
+        {
+            value ^= bytes[i];
+            value *= 16777619u;
+        }
+
+        for (char c : payload)
+        {
+            value ^= static_cast<unsigned char>(c);
+            value *= 16777619u;
+        }
+
+        return value;
+    }
+
+    std::string segment_path(const std::string& directory, std::uint64_t number)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/segment-%016llx.wal", static_cast<unsigned long long>(number));
+
+        return directory + name;
+    }
+
+    // The numbers of the segments in directory, oldest first
+    std::vector<std::uint64_t> list_segments(const std::string& directory)
+    {
+        std::vector<std::uint64_t> numbers;
+        DIR* listing = ::opendir(directory.c_str());
+
+        if (!listing)
+        {
+            return numbers;
+        }
+
+        constexpr std::string_view prefix{ "segment-" };
+        constexpr std::string_view suffix{ ".wal" };
+
+        while (dirent* file = ::readdir(listing))
+        {
+            std::string_view name{ file->d_name };
+
+            if (name.size() != prefix.size() + 16 + suffix.size() || !name.starts_with(prefix) || !name.ends_with(suffix))
+            {
+                continue;
+            }
+
+            std::uint64_t number{};
+            const char* digits = name.data() + prefix.size();
+
+            if (std::from_chars(digits, digits + 16, number, 16).ptr == digits + 16)
+            {
+                numbers.push_back(number);
+            }
+        }
+
+        ::closedir(listing);
+        std::sort(numbers.begin(), numbers.end());
+
+        return numbers;
+    }
+
+    // Deletes every segment in directory, returns how many there were
+    std::size_t remove(const std::string& directory)
+    {
+        std::size_t removed{};
+
+        for (std::uint64_t number : list_segments(directory))
+        {
+            removed += ::unlink(segment_path(directory, number).c_str()) == 0;
+        }
+
+        return removed;
+    }
+
+
+    class Journal
+    {
+    public:
+
+        // Creates directory if it isn't there. Segments are segment_size
+        // bytes, at least a megabyte
+        explicit Journal(const std::string& directory, std::size_t segment_size = std::size_t{ 64 } << 20,
+            std::chrono::microseconds commit_interval = std::chrono::milliseconds{ 1 });
+        ~Journal();
+
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+
+        bool is_open() const { return current_.load(std::memory_order_relaxed) != nullptr; }
+
+        // Lock free and safe to call from any number of threads. Returns
+        // false, and counts the record as lost, if the payload is too long
+        // or no new segment could be made. The record is durable once a
+        // later commit has covered it, which sync waits for
+        bool append(MachineId machine, Kind kind, std::uint8_t event, std::string_view payload = {});
+
+        // Blocks until everything appended before the call is durable
+        void sync();
+
+        // The segment records are being appended to
+        std::uint64_t segment() const;
+
+        // Deletes the segments numbered below before, whether from this run
+        // or an earlier one, once they have been committed. Returns how
+        // many were deleted
+        std::size_t truncate(std::uint64_t before);
+
+        std::uint64_t committed() const { return committed_records_.load(std::memory_order_relaxed); }
+        std::uint64_t commits() const { return commits_.load(std::memory_order_relaxed); }
+        std::uint64_t rotations() const { return rotations_.load(std::memory_order_relaxed); }
+        std::uint64_t lost() const { return lost_.load(std::memory_order_relaxed); }
+
+    private:
+
+        struct Segment
+        {
+            std::uint64_t number{};
+            int fd{ -1 };
+            std::byte* base{};
+
+            // Where the next record will be reserved, past the limit once
+            // the segment is full
+            alignas(64) std::atomic<std::uint64_t> tail{ data_offset };
+        };
+
+        // How far the committer has got, ordered by segment then offset
+        struct Position
+        {
+            std::uint64_t segment{};
+            std::uint64_t offset{};
+
+            auto operator<=>(const Position&) const = default;
+        };
+
+        std::unique_ptr<Segment> make_segment(std::uint64_t number);
+        void close_segment(Segment& segment);
+
+        void write(Segment& segment, std::uint64_t offset, MachineId machine, Kind kind, std::uint8_t event,
+            std::string_view payload);
+        void rotate(Segment* full);
+
+        void commit_loop();
+        void commit();
+
+        std::string directory_;
+        std::size_t segment_size_{};
+
+        // Every record has to end at or before the limit, which leaves room
+        // for the end marker after the last one
+        std::uint64_t limit_{};
+        std::chrono::microseconds commit_interval_{};
+        std::uint64_t run_{};
+
+        std::atomic<Segment*> current_{};
+
+        // Segments are kept, if not their mappings, until the journal is
+        // closed, an append that lost the race to a rotation may still look
+        // at the tail of an old one
+        std::vector<std::unique_ptr<Segment>> segments_;
+        std::unique_ptr<Segment> spare_;
+        std::uint64_t next_number_{};
+
+        // Set while a segment is being made without the lock
+        bool making_spare_{ false };
+
+        // Only the committer touches these, it has made everything before
+        // offset in segments_[scanning_] durable
+        std::size_t scanning_{};
+        std::uint64_t scanned_{ data_offset };
+
+        Position durable_{};
+
+        std::atomic<std::uint64_t> committed_records_{};
+        std::atomic<std::uint64_t> commits_{};
+        std::atomic<std::uint64_t> rotations_{};
+        std::atomic<std::uint64_t> lost_{};
+
+        // Guards the segments, the spare and the durable position
+        mutable std::mutex mutex_;
+        std::condition_variable commit_requested_;
+        std::condition_variable committed_;
+        std::condition_variable spare_made_;
+        bool sync_waiting_{ false };
+        bool stopping_{ false };
+        std::thread committer_;
+    };
+
+    // Journal
+
+    Journal::Journal(const std::string& directory, std::size_t segment_size, std::chrono::microseconds commit_interval)
+        : directory_(directory)
+        , segment_size_(std::max(segment_size, std::size_t{ 1 } << 20) / record_alignment * record_alignment)
+        , limit_(segment_size_ - record_alignment)
+        , commit_interval_(commit_interval)
+    {
+        ::mkdir(directory.c_str(), 0755);
+
+        std::vector<std::uint64_t> existing = list_segments(directory);
+        next_number_ = existing.empty() ? 1 : existing.back() + 1;
+        run_ = next_number_;
+
+        std::unique_ptr<Segment> first = make_segment(next_number_++);
+
+        if (!first)
+        {
+            std::cerr << "Error: could not create a journal segment in " << directory << std::endl;
+            return;
+        }
+
+        durable_ = { first->number, data_offset };
+        segments_.push_back(std::move(first));
+        current_.store(segments_.back().get(), std::memory_order_release);
+
+        committer_ = std::thread{ [this] { commit_loop(); } };
+    }
+
+    Journal::~Journal()
+    {
+        if (committer_.joinable())
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                stopping_ = true;
+            }
+
+            commit_requested_.notify_one();
+            committer_.join();
+        }
+
+        // Nothing is appending any more, so the segment can be ended where
+        // its records stop, which tells a reader the journal was closed
+        // rather than cut short
+        Segment* last = current_.load(std::memory_order_relaxed);
+
+        if (last && last->base)
+        {
+            std::uint64_t tail = last->tail.load(std::memory_order_relaxed);
+
+            if (tail <= limit_)
+            {
+                std::atomic_ref<std::uint32_t>{ reinterpret_cast<RecordHeader*>(last->base + tail)->commit }
+                    .store(end_magic, std::memory_order_release);
+                ::fdatasync(last->fd);
+            }
+        }
+
+        for (std::unique_ptr<Segment>& segment : segments_)
+        {
+            close_segment(*segment);
+        }
+
+        if (spare_)
+        {
+            close_segment(*spare_);
+            ::unlink(segment_path(directory_, spare_->number).c_str());
+        }
+    }
+
+    bool Journal::append(MachineId machine, Kind kind, std::uint8_t event, std::string_view payload)
+    {
+        if (payload.size() > max_payload)
+        {
+            lost_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        std::uint64_t size = record_size(payload.size());
+
+        for (;;)
+        {
+            Segment* segment = current_.load(std::memory_order_acquire);
+
+            if (!segment)
+            {
+                lost_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // Reserving space is the only point of contention between threads
+            std::uint64_t offset = segment->tail.fetch_add(size, std::memory_order_relaxed);
+
+            if (offset + size <= limit_)
+            {
+                write(*segment, offset, machine, kind, event, payload);
+                return true;
+            }
+
+            if (offset <= limit_)
+            {
+                // Exactly one reservation straddles the limit, and the
+                // thread that made it ends the segment and starts the next
+                std::atomic_ref<std::uint32_t>{ reinterpret_cast<RecordHeader*>(segment->base + offset)->commit }
+                    .store(end_magic, std::memory_order_release);
+                rotate(segment);
+            }
+            else
+            {
+                while (current_.load(std::memory_order_acquire) == segment)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    void Journal::write(Segment& segment, std::uint64_t offset, MachineId machine, Kind kind, std::uint8_t event,
+        std::string_view payload)
+    {
+        std::byte* record = segment.base + offset;
+
+        RecordHeader header{};
+        header.machine = machine;
+        header.length = static_cast<std::uint16_t>(payload.size());
+        header.kind = kind;
+        header.event = event;
+        header.checksum = checksum(header, payload);
+
+        // Everything but the commit word, which the committer may be
+        // reading already
+        constexpr std::size_t after_commit{ offsetof(RecordHeader, checksum) };
+
+        std::memcpy(record + after_commit, reinterpret_cast<const std::byte*>(&header) + after_commit,
+            sizeof(header) - after_commit);
+        std::memcpy(record + sizeof(header), payload.data(), payload.size());
+
+        std::atomic_ref<std::uint32_t>{ reinterpret_cast<RecordHeader*>(record)->commit }
+            .store(record_magic, std::memory_order_release);
+    }
+
+    void Journal::rotate(Segment* full)
+    {
+        {
+            std::unique_lock lock{ mutex_ };
+
+            assert(current_.load(std::memory_order_relaxed) == full);
+
+            // A spare the committer is still making will have the next
+            // number, so it has to be the next segment
+            spare_made_.wait(lock, [this] { return !making_spare_; });
+
+            std::unique_ptr<Segment> next = std::move(spare_);
+
+            if (!next)
+            {
+                // The slow path for when segments fill faster than the
+                // committer makes spares. Made without the lock like a
+                // spare, and marked as one so the committer doesn't make
+                // another in the meantime
+                std::uint64_t number = next_number_++;
+                making_spare_ = true;
+
+                lock.unlock();
+                next = make_segment(number);
+                lock.lock();
+
+                making_spare_ = false;
+            }
+
+            if (!next)
+            {
+                std::cerr << "Error: could not create a journal segment in " << directory_
+                    << ", records are being lost" << std::endl;
+
+                current_.store(nullptr, std::memory_order_release);
+                return;
+            }
+
+            segments_.push_back(std::move(next));
+            current_.store(segments_.back().get(), std::memory_order_release);
+        }
+
+        rotations_.fetch_add(1, std::memory_order_relaxed);
+        commit_requested_.notify_one();
+    }
+
+    void Journal::sync()
+    {
+        Segment* segment = current_.load(std::memory_order_acquire);
+
+        if (!segment)
+        {
+            return;
+        }
+
+        Position target{ segment->number, std::min(segment->tail.load(std::memory_order_relaxed), limit_) };
+
+        std::unique_lock lock{ mutex_ };
+
+        while (durable_ < target && !stopping_)
+        {
+            sync_waiting_ = true;
+            commit_requested_.notify_one();
+            committed_.wait(lock);
+        }
+    }
+
+    std::uint64_t Journal::segment() const
+    {
+        Segment* segment = current_.load(std::memory_order_acquire);
+        return segment ? segment->number : 0;
+    }
+
+    std::size_t Journal::truncate(std::uint64_t before)
+    {
+        {
+            // The committer has finished with, and closed, every segment
+            // before the one it is working on
+            std::lock_guard lock{ mutex_ };
+            before = std::min(before, durable_.segment);
+        }
+
+        std::size_t removed{};
+
+        for (std::uint64_t number : list_segments(directory_))
+        {
+            if (number < before)
+            {
+                removed += ::unlink(segment_path(directory_, number).c_str()) == 0;
+            }
+        }
+
+        return removed;
+    }
+
+    std::unique_ptr<Journal::Segment> Journal::make_segment(std::uint64_t number)
+    {
+        auto segment = std::make_unique<Segment>();
+        segment->number = number;
+
+        std::string path = segment_path(directory_, number);
+        segment->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if (segment->fd < 0)
+        {
+            return nullptr;
+        }
+
+        // Allocated now so a commit only ever has data to write, and mapped
+        // with its pages already in memory so appends don't fault them in
+        if (::posix_fallocate(segment->fd, 0, static_cast<off_t>(segment_size_)) != 0)
+        {
+            close_segment(*segment);
+            ::unlink(path.c_str());
+            return nullptr;
+        }
+
+        void* base = ::mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, segment->fd, 0);
+
+        if (base == MAP_FAILED)
+        {
+            close_segment(*segment);
+            ::unlink(path.c_str());
+            return nullptr;
+        }
+
+        segment->base = static_cast<std::byte*>(base);
+
+        auto* header = reinterpret_cast<SegmentHeader*>(segment->base);
+        std::memcpy(header->magic, segment_magic, sizeof(segment_magic));
+        header->number = number;
+        header->run = run_;
+
+        // A reader trusts the header of every segment it finds
+        ::fdatasync(segment->fd);
+
+        // The new file's name has to survive a crash as well as its contents
+        int directory = ::open(directory_.c_str(), O_RDONLY | O_DIRECTORY);
+
+        if (directory >= 0)
+        {
+            ::fsync(directory);
+            ::close(directory);
+        }
+
+        return segment;
+    }
+
+    void Journal::close_segment(Segment& segment)
+    {
+        if (segment.base)
+        {
+            ::munmap(segment.base, segment_size_);
+            segment.base = nullptr;
+        }
+
+        if (segment.fd >= 0)
+        {
+            ::close(segment.fd);
+            segment.fd = -1;
+        }
+    }
+
+    void Journal::commit_loop()
+    {
+        std::unique_lock lock{ mutex_ };
+
+        while (!stopping_)
+        {
+            commit_requested_.wait_for(lock, commit_interval_, [this] { return sync_waiting_ || stopping_; });
+            sync_waiting_ = false;
+
+            lock.unlock();
+            commit();
+            lock.lock();
+
+            // Ready for when the current segment fills up. Allocating and
+            // populating it takes a while, so only its number is taken with
+            // the lock held
+            if (!spare_ && !making_spare_ && !stopping_)
+            {
+                std::uint64_t number = next_number_++;
+                making_spare_ = true;
+
+                lock.unlock();
+                std::unique_ptr<Segment> spare = make_segment(number);
+                lock.lock();
+
+                spare_ = std::move(spare);
+                making_spare_ = false;
+                spare_made_.notify_all();
+            }
+        }
+
+        lock.unlock();
+        commit();
+    }
+
+    void Journal::commit()
+    {
+        Segment* segment{};
+
+        {
+            std::lock_guard lock{ mutex_ };
+            segment = segments_[scanning_].get();
+        }
+
+        std::uint64_t records{};
+
+        for (;;)
+        {
+            // Only a contiguous run of complete records can be committed, a
+            // record still being written holds back everything after it
+            std::uint64_t start = scanned_;
+            bool ended{ false };
+
+            while (scanned_ <= limit_)
+            {
+                auto* header = reinterpret_cast<RecordHeader*>(segment->base + scanned_);
+                std::uint32_t commit = std::atomic_ref<std::uint32_t>{ header->commit }.load(std::memory_order_acquire);
+
+                if (commit != record_magic)
+                {
+                    ended = commit == end_magic;
+                    break;
+                }
+
+                scanned_ += record_size(header->length);
+                ++records;
+            }
+
+            if (scanned_ > start || ended)
+            {
+                // On Linux this writes back what was written through the
+                // mapping too, and the blocks were allocated up front so
+                // there's no metadata to go with it
+                ::fdatasync(segment->fd);
+                commits_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            Segment* next{};
+
+            {
+                std::lock_guard lock{ mutex_ };
+
+                if (ended && scanning_ + 1 < segments_.size())
+                {
+                    next = segments_[scanning_ + 1].get();
+                }
+
+                durable_ = next ? Position{ next->number, data_offset } : Position{ segment->number, scanned_ };
+            }
+
+            if (!next)
+            {
+                break;
+            }
+
+            // Every record in the full segment is durable and no append
+            // will touch it again
+            close_segment(*segment);
+
+            segment = next;
+            ++scanning_;
+            scanned_ = data_offset;
+        }
+
+        committed_records_.fetch_add(records, std::memory_order_relaxed);
+        committed_.notify_all();
+    }
+
+
+    // What a machine keeps to journal its requests, nothing is journaled
+    // until it is attached to a journal
+    class Tap
+    {
+    public:
+
+        void attach(Journal* journal, MachineId machine)
+        {
+            journal_ = journal;
+            machine_ = machine;
+        }
+
+        explicit operator bool() const { return journal_ != nullptr; }
+
+        template <typename Event>
+        void record(Kind kind, Event event, std::string_view payload = {}) const
+        {
+            journal_->append(machine_, kind, static_cast<std::uint8_t>(event), payload);
+        }
+
+    private:
+
+        Journal* journal_{};
+        MachineId machine_{};
+    };
+
+    // Journals a chat bot's process_input with the line it read for its
+    // state, or with why it got none
+    void record_input(const Tap& tap, Kind kind, const input::Result<std::string_view>& line)
+    {
+        if (line)
+        {
+            tap.record(kind, ChatEvent::process_input, line.value);
+        }
+        else
+        {
+            tap.record(kind, line.error == input::Error::line_too_long ? ChatEvent::line_too_long : ChatEvent::end_of_input);
+        }
+    }
+
+
+    struct Recovery
+    {
+        std::uint64_t records{};
+        std::uint64_t segments{};
+
+        // Segments that stopped without an end marker, a crash or a journal
+        // that is still open. Segments after one from the same run are
+        // skipped, their records may depend on ones that were lost
+        std::uint64_t torn{};
+        std::uint64_t skipped{};
+    };
+
+    // Visits every record in the segments in directory, oldest first.
+    // Returns nothing if a segment can't be read
+    template <typename Visitor>
+    std::optional<Recovery> read(const std::string& directory, Visitor&& visit)
+    {
+        Recovery recovery{};
+        std::optional<std::uint64_t> torn_run;
+
+        for (std::uint64_t number : list_segments(directory))
+        {
+            std::string path = segment_path(directory, number);
+            int fd = ::open(path.c_str(), O_RDONLY);
+
+            struct stat status{};
+
+            if (fd < 0 || ::fstat(fd, &status) != 0 || static_cast<std::size_t>(status.st_size) < data_offset)
+            {
+                std::cerr << "Error: could not read journal segment " << path << std::endl;
+
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                }
+
+                return std::nullopt;
+            }
+
+            std::size_t size = static_cast<std::size_t>(status.st_size);
+            void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+
+            if (mapped == MAP_FAILED)
+            {
+                std::cerr << "Error: could not map journal segment " << path << std::endl;
+                return std::nullopt;
+            }
+
+            const auto* base = static_cast<const std::byte*>(mapped);
+            const auto* header = reinterpret_cast<const SegmentHeader*>(base);
+
+            if (std::memcmp(header->magic, segment_magic, sizeof(segment_magic)) != 0 || header->number != number)
+            {
+                std::cerr << "Error: " << path << " is not a journal segment" << std::endl;
+                ::munmap(mapped, size);
+                return std::nullopt;
+            }
+
+            if (torn_run == header->run)
+            {
+                ++recovery.skipped;
+                ::munmap(mapped, size);
+                continue;
+            }
+
+            ++recovery.segments;
+
+            std::uint64_t offset{ data_offset };
+            bool ended{ false };
+
+            while (offset + sizeof(RecordHeader) <= size)
+            {
+                const auto* record = reinterpret_cast<const RecordHeader*>(base + offset);
+
+                if (record->commit == end_magic)
+                {
+                    ended = true;
+                    break;
+                }
+
+                std::uint64_t record_end = offset + record_size(record->length);
+                std::string_view payload{ reinterpret_cast<const char*>(record + 1), record->length };
+
+                if (record->commit != record_magic || record_end > size || record->checksum != checksum(*record, payload))
+                {
+                    break;
+                }
+
+                visit(Entry{ record->machine, record->kind, record->event, payload });
+                ++recovery.records;
+
+                offset = record_end;
+            }
+
+            if (!ended)
+            {
+                ++recovery.torn;
+                torn_run = header->run;
+            }
+
+            ::munmap(mapped, size);
+        }
+
+        return recovery;
+    }
+}
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef LATENCY
+#define LATENCY
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+#include "trace.h"
+#include "transitionstats.h"
+
+namespace latency
+{
+    // How long each state takes to handle each request, as a histogram for
+    // every state and request pair, so a slow turn can be pinned on the
+    // handler that made it slow rather than on the flow as a whole.
+    //
+    // The histograms are high dynamic range: exact below 64 ticks and then
+    // 32 buckets for every power of two, so any value is within about 3% of
+    // the bucket it lands in, from a few nanoseconds to minutes, in 9KB.
+    // Each thread records into its own histograms like stats::CountMatrix
+    // counts, and snapshots of them merge by adding buckets.
+    //
+    // Timing a handler reads the clock twice, so unlike the counters it
+    // is off until enabled, when all a handler pays is a branch
+
+    class Histogram
+    {
+    public:
+
+        static constexpr unsigned sub_bucket_bits{ 5 };
+        static constexpr std::size_t sub_buckets{ std::size_t{ 1 } << sub_bucket_bits };
+
+        // Values from 2^40 ticks up all land in the last bucket
+        static constexpr unsigned max_magnitude{ 39 };
+        static constexpr std::size_t bucket_count{ (max_magnitude - sub_bucket_bits + 2) * sub_buckets };
+
+        static constexpr std::size_t index(std::uint64_t value)
+        {
+            if (value < 2 * sub_buckets)
+            {
+                return static_cast<std::size_t>(value);
+            }
+
+            unsigned magnitude = static_cast<unsigned>(std::bit_width(value)) - 1;
+
+            if (magnitude > max_magnitude)
+            {
+                return bucket_count - 1;
+            }
+
+            unsigned shift = magnitude - sub_bucket_bits;
+            std::size_t top = static_cast<std::size_t>(value >> shift);
+
+            return (magnitude - sub_bucket_bits + 1) * sub_buckets + (top - sub_buckets);
+        }
+
+        // The largest value that lands in the bucket
+        static constexpr std::uint64_t highest(std::size_t index)
+        {
+            if (index < 2 * sub_buckets)
+            {
+                return index;
+            }
+
+            unsigned shift = static_cast<unsigned>(index / sub_buckets) - 1;
+            std::uint64_t top = sub_buckets + index % sub_buckets;
+
+            return ((top + 1) << shift) - 1;
+        }
+
+        void record(std::uint64_t value) { stats::increment(counts_[index(value)]); }
+
+        class Snapshot
+        {
+        public:
+
+            void add(const Histogram& histogram)
+            {
+                for (std::size_t i = 0; i < bucket_count; ++i)
+                {
+                    counts_[i] += histogram.counts_[i].load(std::memory_order_relaxed);
+                }
+            }
+
+            void merge(const Snapshot& other)
+            {
+                for (std::size_t i = 0; i < bucket_count; ++i)
+                {
+                    counts_[i] += other.counts_[i];
+                }
+            }
+
+            std::uint64_t count() const
+            {
+                std::uint64_t total{};
+
+                for (std::uint64_t count : counts_)
+                {
+                    total += count;
+                }
+
+                return total;
+            }
+
+            // The value that fraction of the recorded values are at or
+            // below, to within the bucket's precision. 0 when empty
+            std::uint64_t percentile(double fraction) const
+            {
+                std::uint64_t total = count();
+
+                if (total == 0)
+                {
+                    return 0;
+                }
+
+                // At least one value, so the 0th percentile is the minimum
+                std::uint64_t wanted = static_cast<std::uint64_t>(fraction * static_cast<double>(total) + 0.5);
+                wanted = wanted > 0 ? wanted : 1;
+
+                std::uint64_t seen{};
+
+                for (std::size_t i = 0; i < bucket_count; ++i)
+                {
+                    seen += counts_[i];
+
+                    if (seen >= wanted)
+                    {
+                        return highest(i);
+                    }
+                }
+
+                return highest(bucket_count - 1);
+            }
+
+            std::uint64_t max() const { return percentile(1.0); }
+
+        private:
+
+            std::array<std::uint64_t, bucket_count> counts_{};
+        };
+
+    private:
+
+        std::array<std::atomic<std::uint64_t>, bucket_count> counts_{};
+    };
+
+    static_assert(Histogram::index(63) == 63 && Histogram::index(64) == 64 && Histogram::index(66) == 65);
+    static_assert(Histogram::highest(Histogram::index(1000)) >= 1000);
+    static_assert(Histogram::highest(Histogram::index(1000) - 1) < 1000);
+
+
+    constinit std::atomic<bool> enabled_flag{};
+
+    bool enabled()
+    {
+        return enabled_flag.load(std::memory_order_relaxed);
+    }
+
+    void enable(bool on)
+    {
+        enabled_flag.store(on, std::memory_order_relaxed);
+    }
+
+    // A histogram for every state and request pair of one kind of machine,
+    // in ticks, see trace::ticks
+    template <typename StateEnum, typename RequestEnum>
+    class Handlers
+    {
+    public:
+
+        static constexpr std::size_t states{ stats::enum_count<StateEnum> };
+        static constexpr std::size_t requests{ stats::enum_count<RequestEnum> };
+
+        static void record(StateEnum state, RequestEnum request, std::uint64_t ticks)
+        {
+            Blocks::local().histograms[index(state, request)].record(ticks);
+        }
+
+        // Merges every thread's histogram for the pair while they carry on
+        // recording
+        static Histogram::Snapshot snapshot(StateEnum state, RequestEnum request)
+        {
+            Histogram::Snapshot snapshot{};
+
+            Blocks::for_each([&snapshot, state, request](const Block& block)
+            {
+                snapshot.add(block.histograms[index(state, request)]);
+            });
+
+            return snapshot;
+        }
+
+    private:
+
+        struct alignas(64) Block
+        {
+            std::array<Histogram, states * requests> histograms{};
+        };
+
+        static constexpr std::size_t index(StateEnum state, RequestEnum request)
+        {
+            return static_cast<std::size_t>(state) * requests + static_cast<std::size_t>(request);
+        }
+
+        using Blocks = stats::PerThread<Block>;
+    };
+
+    // Times the handling of a request from construction to destruction
+    template <typename StateEnum, typename RequestEnum>
+    class Timer
+    {
+    public:
+
+        Timer(StateEnum state, RequestEnum request)
+            : state_(state)
+            , request_(request)
+            , start_(enabled() ? trace::ticks() : 0)
+        {
+        }
+
+        ~Timer()
+        {
+            if (start_ != 0) [[unlikely]]
+            {
+                Handlers<StateEnum, RequestEnum>::record(state_, request_, trace::ticks() - start_);
+            }
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+    private:
+
+        StateEnum state_;
+        RequestEnum request_;
+        std::uint64_t start_{};
+    };
+
+
+    // Percentiles in nanoseconds of every pair that recorded anything
+    template <typename StateEnum, typename RequestEnum>
+    void write_latencies(std::ostream& out)
+    {
+        double ns_per_tick = trace::ns_per_tick();
+
+        out << "Handler latency (ns)\n"
+            << std::setw(20) << "state" << std::setw(15) << "request" << std::setw(10) << "count"
+            << std::setw(9) << "p50" << std::setw(9) << "p90" << std::setw(9) << "p99"
+            << std::setw(9) << "p99.9" << std::setw(10) << "max" << "\n";
+
+        for (std::size_t state = 0; state < stats::enum_count<StateEnum>; ++state)
+        {
+            for (std::size_t request = 0; request < stats::enum_count<RequestEnum>; ++request)
+            {
+                Histogram::Snapshot snapshot = Handlers<StateEnum, RequestEnum>::snapshot(
+                    static_cast<StateEnum>(state), static_cast<RequestEnum>(request));
+
+                if (snapshot.count() == 0)
+                {
+                    continue;
+                }
+
+                auto ns = [ns_per_tick](std::uint64_t ticks)
+                {
+                    return static_cast<std::uint64_t>(static_cast<double>(ticks) * ns_per_tick);
+                };
+
+                out << std::setw(20) << name(static_cast<StateEnum>(state))
+                    << std::setw(15) << name(static_cast<RequestEnum>(request))
+                    << std::setw(10) << snapshot.count()
+                    << std::setw(9) << ns(snapshot.percentile(0.5))
+                    << std::setw(9) << ns(snapshot.percentile(0.9))
+                    << std::setw(9) << ns(snapshot.percentile(0.99))
+                    << std::setw(9) << ns(snapshot.percentile(0.999))
+                    << std::setw(10) << ns(snapshot.max()) << "\n";
+            }
+        }
+
+        out.flush();
+    }
+}
+
+#endif
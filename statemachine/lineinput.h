@@ -0,0 +1,292 @@
+#ifndef LINEINPUT
+#define LINEINPUT
+
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <system_error>
+
+#include <unistd.h>
+
+namespace input
+{
+    // The states used to read with std::cin >> int followed by ignore, which
+    // runs the locale machinery for every number, and silently left the bot
+    // in the same state on anything it couldn't parse (or spun forever once
+    // std::cin failed). Input is now read in large chunks, split into lines
+    // with memchr (vectorised by the C library) and numbers are parsed with
+    // std::from_chars. Every read returns either a value or an explicit
+    // error, and lines are views into the reader's buffer so nothing is
+    // allocated per line
+
+    enum class Error
+    {
+        none,
+        end_of_input,
+        empty,
+        not_a_number,
+        out_of_range,
+        line_too_long
+    };
+
+    template <typename T>
+    struct Result
+    {
+        T value{};
+        Error error{ Error::none };
+
+        explicit operator bool() const { return error == Error::none; }
+    };
+
+    // Parses a whole line as a decimal integer, surrounding spaces allowed
+    Result<int> parse_int(std::string_view text);
+
+    class LineReader
+    {
+    public:
+
+        // Reads from a file descriptor, chunk_size bytes at a time at most.
+        // A line longer than a chunk is reported as an error and skipped
+        explicit LineReader(int fd, std::size_t chunk_size = 64 * 1024);
+
+        // Serves lines from memory the caller keeps alive, see reset
+        LineReader();
+
+        LineReader(const LineReader&) = delete;
+        LineReader& operator=(const LineReader&) = delete;
+
+        // Replaces the remaining input with text, for readers fed from
+        // memory such as a transcript or a line that arrived on a socket
+        void reset(std::string_view text);
+
+        // Replaces the remaining input with exactly one line, which unlike
+        // with reset may be empty, for sessions fed a line at a time
+        void set_line(std::string_view line);
+
+        // The next line without its terminator. The view is valid until the
+        // next call on the reader
+        Result<std::string_view> next_line();
+
+        // The next line parsed as a number
+        Result<int> next_int();
+
+        // True once every byte of input has been consumed. For a file
+        // descriptor this only looks at what has already been read
+        bool exhausted() const { return begin_ == end_ && !line_pending_ && (fd_ < 0 || eof_); }
+
+    private:
+
+        // Moves the unread bytes to the front of the buffer and reads more
+        // after them, returns false at end of input or on a read error
+        bool refill();
+
+        int fd_{ -1 };
+        bool eof_{ false };
+
+        std::size_t chunk_size_{};
+        std::unique_ptr<char[]> buffer_;
+
+        // The unread part of the input
+        const char* begin_{};
+        const char* end_{};
+
+        // Set after a line that didn't fit in the buffer, until the end of
+        // that line has been skipped
+        bool skipping_{ false };
+
+        // Set by set_line so an empty line isn't taken for the end of input
+        bool line_pending_{ false };
+    };
+
+    // The process's standard input, shared by main and the interactive demos
+    // so that bytes read ahead by one are not lost to the other
+    LineReader& console();
+
+
+    // parse_int
+
+    Result<int> parse_int(std::string_view text)
+    {
+        auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+
+        while (!text.empty() && is_space(text.front()))
+        {
+            text.remove_prefix(1);
+        }
+
+        while (!text.empty() && is_space(text.back()))
+        {
+            text.remove_suffix(1);
+        }
+
+        if (text.empty())
+        {
+            return { 0, Error::empty };
+        }
+
+        Result<int> result{};
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), result.value);
+
+        if (error == std::errc::result_out_of_range)
+        {
+            result.error = Error::out_of_range;
+        }
+        else if (error != std::errc{} || end != text.data() + text.size())
+        {
+            // Trailing characters used to be thrown away by ignore, now a
+            // line is either entirely a number or not a number at all
+            result.error = Error::not_a_number;
+        }
+
+        return result;
+    }
+
+
+    // LineReader
+
+    LineReader::LineReader(int fd, std::size_t chunk_size)
+        : fd_(fd)
+        , chunk_size_(chunk_size)
+        , buffer_(std::make_unique<char[]>(chunk_size))
+    {
+        begin_ = end_ = buffer_.get();
+    }
+
+    LineReader::LineReader()
+    {
+    }
+
+    void LineReader::reset(std::string_view text)
+    {
+        begin_ = text.data();
+        end_ = text.data() + text.size();
+        skipping_ = false;
+        line_pending_ = false;
+    }
+
+    void LineReader::set_line(std::string_view line)
+    {
+        reset(line);
+        line_pending_ = true;
+    }
+
+    Result<std::string_view> LineReader::next_line()
+    {
+        for (;;)
+        {
+            const char* newline = begin_ == end_ ? nullptr
+                : static_cast<const char*>(std::memchr(begin_, '\n', static_cast<std::size_t>(end_ - begin_)));
+
+            if (newline)
+            {
+                std::string_view line{ begin_, static_cast<std::size_t>(newline - begin_) };
+                begin_ = newline + 1;
+                line_pending_ = false;
+
+                if (skipping_)
+                {
+                    // The tail of a line that was already reported as too long
+                    skipping_ = false;
+                    continue;
+                }
+
+                // Input typed on Windows or sent over a network
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.remove_suffix(1);
+                }
+
+                return { line };
+            }
+
+            // No complete line left. Memory input ends with whatever is
+            // left, a file descriptor can be asked for more
+            bool full = fd_ >= 0 && begin_ == buffer_.get() && end_ == buffer_.get() + chunk_size_;
+
+            if (full)
+            {
+                // Drop the line rather than grow the buffer, and keep
+                // dropping until its end has been read
+                begin_ = end_;
+                skipping_ = true;
+                return { {}, Error::line_too_long };
+            }
+
+            if (fd_ < 0 || !refill())
+            {
+                if ((begin_ == end_ && !line_pending_) || skipping_)
+                {
+                    begin_ = end_;
+                    skipping_ = false;
+                    return { {}, Error::end_of_input };
+                }
+
+                // A final line without a terminator
+                std::string_view line{ begin_, static_cast<std::size_t>(end_ - begin_) };
+                begin_ = end_;
+                line_pending_ = false;
+
+                return { line };
+            }
+        }
+    }
+
+    Result<int> LineReader::next_int()
+    {
+        Result<std::string_view> line = next_line();
+
+        if (!line)
+        {
+            return { 0, line.error };
+        }
+
+        return parse_int(line.value);
+    }
+
+    bool LineReader::refill()
+    {
+        if (eof_)
+        {
+            return false;
+        }
+
+        std::size_t unread = static_cast<std::size_t>(end_ - begin_);
+        char* buffer = buffer_.get();
+
+        std::memmove(buffer, begin_, unread);
+
+        for (;;)
+        {
+            // A terminal hands over one line per read, a file or pipe as much
+            // as fits, either way a single syscall per refill
+            ssize_t count = ::read(fd_, buffer + unread, chunk_size_ - unread);
+
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            begin_ = buffer;
+            end_ = buffer + unread + (count > 0 ? count : 0);
+
+            if (count <= 0)
+            {
+                eof_ = true;
+                return false;
+            }
+
+            return true;
+        }
+    }
+
+    LineReader& console()
+    {
+        static LineReader reader{ STDIN_FILENO };
+        return reader;
+    }
+}
+
+#endif
@@ -1,22 +1,132 @@
 #include <iostream>
-#include <limits>
+#include <string>
+#include <string_view>
 
 #include "bookexample.h"
 #include "tcpexample.h"
 #include "chatbot.h"
 #include "nosingleton.h"
+#include "coroutinebot.h"
+#include "replay.h"
+#include "sessionspill.h"
+#include "transitiongraph.h"
+#include "tcpworkload.h"
+#include "lineinput.h"
 
-int main()
+int main(int argc, char* argv[])
 {
+	// Batch modes for benchmarking the state engines, everything else is
+	// the interactive menu below
+	//   --generate <transcript> <sessions>
+	//   --replay <transcript> [chat|nosingleton] [threads]
+	//   --trace-replay <transcript> <trace file> [chat|nosingleton] [threads]
+	//   --count-replay <transcript> [chat|nosingleton] [threads]
+	//   --latency-replay <transcript> [chat|nosingleton] [threads]
+	//   --log-replay <transcript> <output file> [chat|nosingleton] [threads]
+	//   --journal-replay <transcript> <journal directory> [chat|nosingleton]
+	//   --dot <tcp|book|chat> <dot file> [events for tcp and book|transcript for chat]
+	//   --tcp-load <book|tcp> <threads> <events per thread> [connections] [zipf exponent] [abort share]
+	//   --journal-load <journal directory> <events> [connections] [segment MB]
+	//   --store-bench <log> <threads> <saves per thread>
+	//   --footprint <patients>
+	//   --spill-bench <spill file> <sessions> <resident sessions>
+	//   --state-set-bench <sessions>
+	if (argc >= 4 && std::string_view{ argv[1] } == "--generate")
+	{
+		return replay::generate(argv[2], std::stoull(argv[3])) ? 0 : 1;
+	}
+
+	if (argc >= 3 && std::string_view{ argv[1] } == "--replay")
+	{
+		unsigned threads = argc >= 5 ? static_cast<unsigned>(std::stoul(argv[4])) : 1;
+		return replay::run_replay(argv[2], argc >= 4 ? argv[3] : "chat", threads) ? 0 : 1;
+	}
+
+	if (argc >= 4 && std::string_view{ argv[1] } == "--trace-replay")
+	{
+		unsigned threads = argc >= 6 ? static_cast<unsigned>(std::stoul(argv[5])) : 1;
+		return replay::run_traced_replay(argv[2], argv[3], argc >= 5 ? argv[4] : "chat", threads) ? 0 : 1;
+	}
+
+	if (argc >= 3 && std::string_view{ argv[1] } == "--count-replay")
+	{
+		unsigned threads = argc >= 5 ? static_cast<unsigned>(std::stoul(argv[4])) : 1;
+		return replay::run_counted_replay(argv[2], argc >= 4 ? argv[3] : "chat", threads) ? 0 : 1;
+	}
+
+	if (argc >= 3 && std::string_view{ argv[1] } == "--latency-replay")
+	{
+		unsigned threads = argc >= 5 ? static_cast<unsigned>(std::stoul(argv[4])) : 1;
+		return replay::run_timed_replay(argv[2], argc >= 4 ? argv[3] : "chat", threads) ? 0 : 1;
+	}
+
+	if (argc >= 4 && std::string_view{ argv[1] } == "--log-replay")
+	{
+		unsigned threads = argc >= 6 ? static_cast<unsigned>(std::stoul(argv[5])) : 1;
+		return replay::run_logged_replay(argv[2], argv[3], argc >= 5 ? argv[4] : "chat", threads) ? 0 : 1;
+	}
+
+	if (argc >= 4 && std::string_view{ argv[1] } == "--journal-replay")
+	{
+		return replay::run_journaled_replay(argv[2], argv[3], argc >= 5 ? argv[4] : "chat") ? 0 : 1;
+	}
+
+	if (argc >= 4 && std::string_view{ argv[1] } == "--dot")
+	{
+		return graph::run_dot_export(argv[2], argv[3], argc >= 5 ? argv[4] : "") ? 0 : 1;
+	}
+
+	if (argc >= 5 && std::string_view{ argv[1] } == "--tcp-load")
+	{
+		workload::Profile profile{};
+		profile.connections = argc >= 6 ? std::stoull(argv[5]) : profile.connections;
+		profile.zipf_exponent = argc >= 7 ? std::stod(argv[6]) : profile.zipf_exponent;
+		profile.abort_share = argc >= 8 ? std::stod(argv[7]) : profile.abort_share;
+
+		return workload::run_tcp_load(argv[2], static_cast<unsigned>(std::stoul(argv[3])), std::stoull(argv[4]), profile) ? 0 : 1;
+	}
+
+	if (argc >= 4 && std::string_view{ argv[1] } == "--journal-load")
+	{
+		workload::Profile profile{};
+		profile.connections = argc >= 5 ? std::stoull(argv[4]) : profile.connections;
+		std::size_t segment_size = (argc >= 6 ? std::stoull(argv[5]) : 64) << 20;
+
+		return workload::run_journaled_load(argv[2], std::stoull(argv[3]), profile, segment_size) ? 0 : 1;
+	}
+
+	if (argc >= 5 && std::string_view{ argv[1] } == "--store-bench")
+	{
+		store::run_store_benchmark(argv[2], std::stoul(argv[3]), std::stoull(argv[4]));
+		return 0;
+	}
+
+	if (argc >= 3 && std::string_view{ argv[1] } == "--footprint")
+	{
+		compact::run_footprint_report(std::stoull(argv[2]));
+		return 0;
+	}
+
+	if (argc >= 5 && std::string_view{ argv[1] } == "--spill-bench")
+	{
+		spill::run_spill_benchmark(argv[2], std::stoull(argv[3]), std::stoull(argv[4]));
+		return 0;
+	}
+
+	if (argc >= 3 && std::string_view{ argv[1] } == "--state-set-bench")
+	{
+		nosingleton::run_state_set_benchmark(std::stoull(argv[2]));
+		return 0;
+	}
+
 	std::cout << "Choose a demo option\n1. Book Example"
-		"\n2. ChatBot\n3. No Singleton" << std::endl;
+		"\n2. ChatBot\n3. No Singleton\n4. Coroutine ChatBot" << std::endl;
 
-	int option{};
-	std::cin >> option;
-	// Ensure there is no extraneous input left in the buffer including newline
-	std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+	// Read through the same reader the demos use so nothing typed ahead
+	// is lost between the menu and the demo
+	input::Result<int> option = input::console().next_int();
 
-	switch (option)
+	switch (option.value)
 	{
 	case 1:
 	{
@@ -33,7 +143,12 @@ int main()
 		nosingleton::run_nosingleton_demo();
 		break;
 	}
-	/* case 4:
+	case 4:
+	{
+		coro::run_coroutine_demo();
+		break;
+	}
+	/* case 5:
 	{
 		// Work in progress
 		tcp::run_tcp_demo();
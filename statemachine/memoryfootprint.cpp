@@ -0,0 +1,86 @@
+#include <cstddef>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "memoryfootprint.h"
+
+// Reports the bytes each kind of machine takes, inline and on the heap,
+// and what the machines share, averaged over the given number of each.
+// It replaces the global operator new and delete so that every allocation
+// is counted, which is why it is a program of its own rather than a mode
+// of the demo. Built on its own, the same way as the demo
+//   g++ -std=c++20 -O2 memoryfootprint.cpp -o memoryfootprint
+//
+//   memoryfootprint [machines] [spill file]
+//
+// Given a spill file, it also measures sessions spilled to it, and deletes
+// it afterwards
+
+void* operator new(std::size_t size)
+{
+	return footprint::allocate(size, 0);
+}
+
+void* operator new[](std::size_t size)
+{
+	return footprint::allocate(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return footprint::allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return footprint::allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept
+{
+	footprint::release(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	footprint::release(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	footprint::release(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+	footprint::release(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept
+{
+	footprint::release(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t) noexcept
+{
+	footprint::release(memory);
+}
+
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept
+{
+	footprint::release(memory);
+}
+
+void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept
+{
+	footprint::release(memory);
+}
+
+int main(int argc, char* argv[])
+{
+	std::size_t machines = argc >= 2 ? std::stoull(argv[1]) : 10000;
+
+	footprint::run_memory_report(machines, argc >= 3 ? argv[2] : "");
+	return 0;
+}
@@ -0,0 +1,252 @@
+#ifndef MEMORYFOOTPRINT
+#define MEMORYFOOTPRINT
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include "bookexample.h"
+#include "chatbot.h"
+#include "nosingleton.h"
+#include "coroutinebot.h"
+#include "sessionspill.h"
+#include "renderer.h"
+#include "lineinput.h"
+
+namespace footprint
+{
+    // How much memory each kind of machine takes, to size how many
+    // connections or sessions a server can hold. A machine's own object is
+    // its sizeof, and what it keeps on the heap is counted by allocate and
+    // release below. They count what the allocator really hands out,
+    // rounding included, on the thread that allocates, so counting never
+    // touches a shared line.
+    //
+    // Nothing is counted unless the program's global operator new and
+    // delete go through them, which only memoryfootprint.cpp does, so the
+    // demo and the benchmarks allocate as usual
+
+    struct Allocations
+    {
+        // Allocated less freed, by this thread, which can go negative on a
+        // thread that frees what others allocated
+        std::int64_t bytes{};
+        std::uint64_t count{};
+    };
+
+    constinit thread_local Allocations thread_allocations{};
+
+    // What the calling thread has allocated and not freed since the scope
+    // began
+    class Scope
+    {
+    public:
+
+        Scope()
+            : start_(thread_allocations)
+        {
+        }
+
+        std::int64_t bytes() const { return thread_allocations.bytes - start_.bytes; }
+        std::uint64_t allocations() const { return thread_allocations.count - start_.count; }
+
+    private:
+
+        Allocations start_;
+    };
+
+    void* allocate(std::size_t size, std::size_t alignment)
+    {
+        size = size > 0 ? size : 1;
+
+        void* memory = alignment > alignof(std::max_align_t)
+            ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+            : std::malloc(size);
+
+        if (!memory)
+        {
+            throw std::bad_alloc{};
+        }
+
+        thread_allocations.bytes += static_cast<std::int64_t>(::malloc_usable_size(memory));
+        ++thread_allocations.count;
+
+        return memory;
+    }
+
+    void release(void* memory)
+    {
+        if (memory)
+        {
+            thread_allocations.bytes -= static_cast<std::int64_t>(::malloc_usable_size(memory));
+            std::free(memory);
+        }
+    }
+
+
+    // The static state objects every chat::ChatBot in the process shares
+    template <typename... States>
+    constexpr std::size_t shared_state_bytes{ (sizeof(States) + ...) };
+
+    constexpr std::size_t chat_state_bytes{ shared_state_bytes<chat::StartState, chat::MainMenuState,
+        chat::CollectNameState, chat::CollectAddressState, chat::CollectAgeState, chat::CollectHeightState,
+        chat::EditNameState, chat::EditAddressState, chat::EditAgeState, chat::EditHeightState,
+        chat::ConfirmInfoState, chat::EditOptionsState, chat::FinishedState, chat::PatientState,
+        chat::EditingState> };
+
+    // Answers that take a chat bot from its first screen to confirming a
+    // patient, which is when it holds the most
+    constexpr std::string_view patient_lines[]{ "", "1", "Jane Doe", "1 Main Street", "30", "180" };
+
+    void write_row(std::string_view what, std::size_t inline_bytes, double heap_bytes)
+    {
+        std::cout << "  " << std::left << std::setw(34) << what << std::right
+            << std::setw(10) << inline_bytes << std::setw(12) << heap_bytes
+            << std::setw(12) << static_cast<double>(inline_bytes) + heap_bytes << "\n";
+    }
+
+    // Heap per machine, made count times by make and then each given to
+    // use, measured after making and again after using. The machines are
+    // kept alive in a vector reserved beforehand, which isn't counted
+    template <typename Machine, typename Make, typename Use>
+    void measure(std::string_view what, std::string_view used, std::size_t count, Make make, Use use)
+    {
+        std::vector<std::optional<Machine>> machines(count);
+
+        Scope scope{};
+
+        for (std::optional<Machine>& machine : machines)
+        {
+            make(machine);
+        }
+
+        double made = static_cast<double>(scope.bytes()) / static_cast<double>(count);
+
+        for (std::optional<Machine>& machine : machines)
+        {
+            use(*machine);
+        }
+
+        double after = static_cast<double>(scope.bytes()) / static_cast<double>(count);
+
+        write_row(what, sizeof(Machine), made);
+        write_row(used, sizeof(Machine), after);
+    }
+
+    // Bytes per machine for every implementation, averaged over count of
+    // each, and what they share. The spill table is only measured if given
+    // a file to spill to
+    void run_memory_report(std::size_t count, const std::string& spill_path)
+    {
+        count = count > 0 ? count : 1;
+
+        render::NullDisplay display{};
+        input::LineReader input{};
+
+        auto enter_patient = [&input](auto& bot)
+        {
+            for (std::string_view line : patient_lines)
+            {
+                bot.prompt_user();
+                input.set_line(line);
+                bot.process_input();
+            }
+        };
+
+        std::cout << "Bytes per machine, averaged over " << count << " of each\n"
+            << "  " << std::left << std::setw(34) << "" << std::right
+            << std::setw(10) << "inline" << std::setw(12) << "heap" << std::setw(12) << "total" << "\n";
+
+        measure<book::TCPConnection>("book::TCPConnection", "  established", count,
+            [](std::optional<book::TCPConnection>& connection) { connection.emplace(); },
+            [](book::TCPConnection& connection)
+            {
+                connection.passive_open();
+                connection.send();
+            });
+
+        measure<chat::ChatBot>("chat::ChatBot", "  with a patient", count,
+            [&](std::optional<chat::ChatBot>& bot) { bot.emplace(display, input); },
+            enter_patient);
+
+        nosingleton::StateSet state_set{};
+
+        measure<nosingleton::ChatBot>("nosingleton::ChatBot", "  with a patient", count,
+            [&](std::optional<nosingleton::ChatBot>& bot) { bot.emplace(&state_set, display, input); },
+            enter_patient);
+
+        // A session's frame and channel come out of the loop's pools, made
+        // up front for every session it can hold
+        {
+            Scope scope{};
+            std::unique_ptr<coro::EventLoop> loop = std::make_unique<coro::EventLoop>(count, display);
+
+            double reserved = static_cast<double>(scope.bytes()) / static_cast<double>(count);
+
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                loop->open_session();
+            }
+
+            write_row("coro session, reserved", 0, reserved);
+            write_row("  opened", 0, static_cast<double>(scope.bytes()) / static_cast<double>(count));
+
+            if (loop->frame_pool().heap_fallbacks() > 0)
+            {
+                std::cout << "  " << loop->frame_pool().heap_fallbacks() << " frames didn't fit the pool's blocks\n";
+            }
+        }
+
+        // A tenth of the sessions resident, the rest in their spill slots
+        if (!spill_path.empty())
+        {
+            Scope scope{};
+            std::size_t resident = count / 10 > 0 ? count / 10 : 1;
+
+            spill::SessionTable table{ state_set, display, spill_path, count, resident };
+
+            if (table.is_open())
+            {
+                for (std::size_t i = 0; i < count; ++i)
+                {
+                    table.open();
+                }
+
+                write_row("spill session, " + std::to_string(resident) + " resident", 0,
+                    static_cast<double>(scope.bytes()) / static_cast<double>(count));
+
+                std::cout << "  plus a " << spill::SessionTable::slot_size << " byte slot in "
+                    << spill_path << " for each of the " << table.spilled_count() << " spilled\n";
+            }
+        }
+
+        // The spill file is only scratch space for the measurement
+        if (!spill_path.empty())
+        {
+            ::unlink(spill_path.c_str());
+        }
+
+        std::unique_ptr<nosingleton::StateSet> allocated;
+        Scope state_set_scope{};
+        allocated = std::make_unique<nosingleton::StateSet>();
+
+        std::cout << "Shared by every machine\n"
+            << "  book::TCPConnection               none, its state lives in the connection\n"
+            << "  chat singleton states             " << chat_state_bytes << " bytes, static\n"
+            << "  nosingleton::StateSet             " << sizeof(nosingleton::StateSet) << " bytes, "
+            << state_set_scope.bytes() << " on the heap, one per set of sessions" << std::endl;
+    }
+}
+
+#endif
@@ -2,10 +2,29 @@
 #define NOSINGLETON
 
 #include <iostream>
-#include <string>
-#include <limits>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <cassert>
-#include <map>
+#include <memory>
+#include <new>
+#include <span>
+#include <vector>
+
+#include "statemachine.h"
+#include "latency.h"
+#include "unhandled.h"
+#include "asynclog.h"
+#include "renderer.h"
+#include "compactpatient.h"
+#include "prompts.h"
+#include "patientstore.h"
+#include "lineinput.h"
+#include "journal.h"
 
 namespace nosingleton
 {
@@ -27,18 +46,54 @@ namespace nosingleton
         EditHeightState,
         ConfirmInfoState,
         EditOptionsState,
-        FinishedState
+        FinishedState,
+        count
     };
 
-    struct Patient
+    // For traces and anything else that shows a state
+    constexpr std::string_view name(StateName value)
     {
-        // Information learned by the bot
-        std::string name;
-        std::string address;
-        int age;
-        int height;
+        switch (value)
+        {
+        case StateName::StartState: return "StartState";
+        case StateName::MainMenuState: return "MainMenuState";
+        case StateName::CollectNameState: return "CollectNameState";
+        case StateName::CollectAddressState: return "CollectAddressState";
+        case StateName::CollectAgeState: return "CollectAgeState";
+        case StateName::CollectHeightState: return "CollectHeightState";
+        case StateName::EditNameState: return "EditNameState";
+        case StateName::EditAddressState: return "EditAddressState";
+        case StateName::EditAgeState: return "EditAgeState";
+        case StateName::EditHeightState: return "EditHeightState";
+        case StateName::ConfirmInfoState: return "ConfirmInfoState";
+        case StateName::EditOptionsState: return "EditOptionsState";
+        case StateName::FinishedState: return "FinishedState";
+        case StateName::count: break;
+        }
+
+        return "";
+    }
+
+    // The requests a bot passes on to its state
+    enum class Request
+    {
+        prompt_user,
+        process_input,
+        count
     };
 
+    constexpr std::string_view name(Request value)
+    {
+        switch (value)
+        {
+        case Request::prompt_user: return "prompt_user";
+        case Request::process_input: return "process_input";
+        case Request::count: break;
+        }
+
+        return "";
+    }
+
     class ChatBot;
 
     class State
@@ -53,12 +108,40 @@ namespace nosingleton
         // are not. Derived states must use this function instead
         void change_state(ChatBot* bot, StateName name);
 
+        // What the default handlers do, counts the request and reports it,
+        // see unhandled::Pairs
+        void not_handled(ChatBot* bot, Request request);
+
         // Helper functions that give derived states access to the context
-        void set_patient_name(ChatBot* bot, std::string name);
-        void set_patient_address(ChatBot* bot, std::string address);
+        // False, and the patient unchanged, for text a compact::Patient
+        // can't hold
+        bool set_patient_name(ChatBot* bot, std::string_view name);
+        bool set_patient_address(ChatBot* bot, std::string_view address);
         void set_patient_age(ChatBot* bot, int age);
         void set_patient_height(ChatBot* bot, int height);
 
+        // Forgets the current patient and the text it kept in the arena
+        void start_patient(ChatBot* bot);
+
+        // Appends the current patient to the bot's store, if it has one
+        void save_patient(ChatBot* bot);
+
+        // Read the next answer from the session's input
+        input::Result<std::string_view> read_line(ChatBot* bot);
+        input::Result<int> read_int(ChatBot* bot);
+
+        // A number outside [min, max] is reported as out of range
+        input::Result<int> read_int(ChatBot* bot, int min, int max);
+
+        // For input the state can't use. The bot stays in the current state
+        // and the next screen tells the user what was wrong, except at the
+        // end of input which finishes the session
+        void reject_input(ChatBot* bot, input::Error error);
+
+        // Replaces the session's screen, one syscall at most
+        void show(ChatBot* bot, render::Screen screen);
+        void show(ChatBot* bot, std::string_view screen);
+
         virtual ~State() = 0;
     };
 
@@ -70,15 +153,75 @@ namespace nosingleton
     {
     public:
 
-        ChatBot(StateSet* state_set);
+        // Sessions read from the console by default, but any reader can be
+        // supplied so bots can be driven by something other than a terminal
+        ChatBot(StateSet* state_set, render::Display& display, input::LineReader& input = input::console());
 
         bool running() const;
 
-        // Forward requests to the current state
-        void prompt_user() { current_state_->prompt_user(this); };
-        void process_input() { current_state_->process_input(this); };
+        // Forward requests to the current state, returning whether it
+        // handled them
+        unhandled::Status prompt_user()
+        {
+            trace::EventScope scope{ Request::prompt_user };
+            latency::Timer<StateName, Request> timer{ machine_.state(), Request::prompt_user };
+
+            // A finished session ignores requests, so they aren't journaled
+            if (journal_ && running()) [[unlikely]]
+            {
+                journal_.record(journal::Kind::nosingleton, journal::ChatEvent::prompt_user);
+            }
+
+            unhandled_ = false;
+            machine_.dispatch(this, &State::prompt_user);
+
+            return unhandled_ ? unhandled::Status::unhandled : unhandled::Status::handled;
+        }
+
+        unhandled::Status process_input()
+        {
+            trace::EventScope scope{ Request::process_input };
+            latency::Timer<StateName, Request> timer{ machine_.state(), Request::process_input };
+
+            // Write-ahead, the line is read and journaled before the state
+            // can act on it, and the state is handed the same line. Every
+            // state but the finished one reads exactly one
+            if (journal_ && running()) [[unlikely]]
+            {
+                read_ahead_ = input_->next_line();
+                journal::record_input(journal_, journal::Kind::nosingleton, *read_ahead_);
+            }
+
+            unhandled_ = false;
+            machine_.dispatch(this, &State::process_input);
+            read_ahead_.reset();
+
+            return unhandled_ ? unhandled::Status::unhandled : unhandled::Status::handled;
+        }
+
+        compact::PatientView get_patient_info() const { return compact::view(patient_, text_); }
+
+        // Where "Save" puts the patient, saving does nothing without a store
+        void attach_store(store::PatientStore* store) { store_ = store; }
+
+        // Journals every request made of the bot as machine id, with the
+        // line it read, see journal::Journal
+        void attach_journal(journal::Journal* journal, journal::MachineId id) { journal_.attach(journal, id); }
+
+        // Number of times a state has moved the bot to another state
+        std::uint64_t transition_count() const { return machine_.transition_count(); }
+
+        // A session is only its current state and patient, so it can be
+        // saved in a few dozen bytes and restored later into any bot that
+        // shares the same StateSet, for example after being evicted to disk
+        std::size_t saved_size() const;
+
+        // Returns the number of bytes written, or 0 if out is too small
+        std::size_t save(std::span<std::byte> out) const;
 
-        const Patient& get_patient_info() const { return patient_; }
+        // Replaces this bot's session with a saved one, returns false and
+        // leaves the bot unchanged if the bytes aren't a valid session
+        bool restore(std::span<const std::byte> in);
 
     private:
 
@@ -87,18 +230,38 @@ namespace nosingleton
         // be directly altered from the outside
         friend State;
 
-        void change_state(StateName name);
+        // The states come from the bot's StateSet, looked up by name
+        using Machine = fsm::StateMachine<ChatBot, StateName, fsm::TableDispatch<State, StateName>>;
 
-        State* current_state_{};
+        Machine machine_;
 
-        StateSet* state_set_{};
+        compact::Patient patient_{};
 
-        Patient patient_;
+        // Holds the text of the current patient, reused for every patient
+        // the session adds
+        compact::TextArena text_;
+
+        store::PatientStore* store_{};
+
+        // Not owned, both must outlive the bot
+        render::Display* display_{};
+        input::LineReader* input_{};
+
+        // Why the last answer was rejected, shown with the next screen
+        input::Error input_error_{ input::Error::none };
+
+        // Set by a default handler, see State::not_handled
+        bool unhandled_{};
+
+        journal::Tap journal_;
+
+        // The line a journaled bot read for its state, see process_input
+        std::optional<input::Result<std::string_view>> read_ahead_;
     };
 
     // States
 
-    class StartState : public State
+    class StartState final : public State
     {
     public:
 
@@ -106,7 +269,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class MainMenuState : public State
+    class MainMenuState final : public State
     {
     public:
 
@@ -114,7 +277,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectNameState : public State
+    class CollectNameState final : public State
     {
     public:
 
@@ -122,7 +285,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectAddressState : public State
+    class CollectAddressState final : public State
     {
     public:
 
@@ -130,7 +293,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectAgeState : public State
+    class CollectAgeState final : public State
     {
     public:
 
@@ -138,7 +301,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class CollectHeightState : public State
+    class CollectHeightState final : public State
     {
     public:
 
@@ -147,7 +310,7 @@ namespace nosingleton
     };
 
 
-    class EditNameState : public State
+    class EditNameState final : public State
     {
     public:
 
@@ -155,7 +318,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class EditAddressState : public State
+    class EditAddressState final : public State
     {
     public:
 
@@ -163,7 +326,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class EditAgeState : public State
+    class EditAgeState final : public State
     {
     public:
 
@@ -171,7 +334,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class EditHeightState : public State
+    class EditHeightState final : public State
     {
     public:
 
@@ -179,7 +342,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class ConfirmInfoState : public State
+    class ConfirmInfoState final : public State
     {
     public:
 
@@ -187,7 +350,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class EditOptionsState : public State
+    class EditOptionsState final : public State
     {
     public:
 
@@ -195,7 +358,7 @@ namespace nosingleton
         virtual void process_input(ChatBot* bot) override;
     };
 
-    class FinishedState : public State
+    class FinishedState final : public State
     {
     public:
 
@@ -205,50 +368,42 @@ namespace nosingleton
 
 
     // Has to be defined after all of the states to be able to instantiate them
+    //
+    // Bots on any number of threads can share one StateSet without locks,
+    // because nothing in it changes once it is constructed. The table is
+    // filled in by the constructor and only read after that, and the states
+    // have no data members. Keep it that way: session data belongs in the
+    // ChatBot, and states that need mutable data of their own can't be
+    // shared and have to come one StateSet per session from a StateSetPool,
+    // which unlike the StateSet is one per thread
     class StateSet
     {
     public:
 
         StateSet()
         {
-            states_[StateName::StartState] = &start_state_;
-            states_[StateName::MainMenuState] = &main_menu_state_;
-            states_[StateName::CollectNameState] = &collect_name_state_;
-            states_[StateName::CollectAddressState] = &collect_address_state_;
-            states_[StateName::CollectAgeState] = &collect_age_state_;
-            states_[StateName::CollectHeightState] = &collect_height_state_;
-            states_[StateName::EditNameState] = &edit_name_state_;
-            states_[StateName::EditAddressState] = &edit_address_state_;
-            states_[StateName::EditAgeState] = &edit_age_state_;
-            states_[StateName::EditHeightState] = &edit_height_state_;
-            states_[StateName::ConfirmInfoState] = &confirm_info_state_;
-            states_[StateName::EditOptionsState] = &edit_options_state_;
-            states_[StateName::FinishedState] = &finished_state_;
-
-            StartState start_state_{};
-            MainMenuState main_menu_state_{};
-            CollectNameState collect_name_state_{};
-            CollectAddressState collect_address_state_{};
-            CollectAgeState collect_age_state_{};
-            CollectHeightState collect_height_state_{};
-            EditNameState edit_name_state_{};
-            EditAddressState edit_address_state_{};
-            EditAgeState edit_age_state_{};
-            EditHeightState edit_height_state_{};
-            ConfirmInfoState confirm_info_state_{};
-            EditOptionsState edit_options_state_{};
-            FinishedState finished_state_{};
-        }
-
-        State* get_state(StateName name)
-        {
-            auto iter = states_.find(name);
-
-            // Here I want there to never be a state that can't be found
-            // A more sophisticated system might use a default state instead
-            assert(iter != states_.end());
-
-            State* state = iter->second;
+            states_[fsm::index_of(StateName::StartState)] = &start_state_;
+            states_[fsm::index_of(StateName::MainMenuState)] = &main_menu_state_;
+            states_[fsm::index_of(StateName::CollectNameState)] = &collect_name_state_;
+            states_[fsm::index_of(StateName::CollectAddressState)] = &collect_address_state_;
+            states_[fsm::index_of(StateName::CollectAgeState)] = &collect_age_state_;
+            states_[fsm::index_of(StateName::CollectHeightState)] = &collect_height_state_;
+            states_[fsm::index_of(StateName::EditNameState)] = &edit_name_state_;
+            states_[fsm::index_of(StateName::EditAddressState)] = &edit_address_state_;
+            states_[fsm::index_of(StateName::EditAgeState)] = &edit_age_state_;
+            states_[fsm::index_of(StateName::EditHeightState)] = &edit_height_state_;
+            states_[fsm::index_of(StateName::ConfirmInfoState)] = &confirm_info_state_;
+            states_[fsm::index_of(StateName::EditOptionsState)] = &edit_options_state_;
+            states_[fsm::index_of(StateName::FinishedState)] = &finished_state_;
+        }
+
+        // The state set refers to its own members
+        StateSet(const StateSet&) = delete;
+        StateSet& operator=(const StateSet&) = delete;
+
+        State* get_state(StateName name) const
+        {
+            State* state = states_[fsm::index_of(name)];
 
             // Really don't want to users of the state set to have to deal
             // with null pointers
@@ -257,9 +412,13 @@ namespace nosingleton
             return state;
         }
 
+        // What the bots' state machines look states up in, indexed by name
+        // rather than searched for as the std::map used to be
+        const fsm::TableDispatch<State, StateName>::Table& table() const { return states_; }
+
     private:
 
-        std::map<StateName, State*> states_;
+        fsm::TableDispatch<State, StateName>::Table states_{};
 
         StartState start_state_{};
         MainMenuState main_menu_state_{};
@@ -276,25 +435,122 @@ namespace nosingleton
         FinishedState finished_state_{};
     };
 
+    // When the states keep data of their own they can't be shared, and
+    // every session needs a StateSet of its own. A StateSet is already one
+    // object holding all of its states, the pool goes further and carves
+    // every session's StateSet out of a single allocation made up front,
+    // so opening and closing sessions never touches the heap
+    //
+    // Unlike a StateSet, a pool belongs to one thread. acquire and release
+    // change its free list without locks, so every handle has to be taken
+    // and dropped on the thread that owns the pool. A server with worker
+    // threads gives each worker a pool of its own rather than sharing one
+    class StateSetPool
+    {
+    public:
+
+        explicit StateSetPool(std::size_t capacity);
+        ~StateSetPool();
+
+        StateSetPool(const StateSetPool&) = delete;
+        StateSetPool& operator=(const StateSetPool&) = delete;
+
+        struct Releaser
+        {
+            StateSetPool* pool;
+
+            void operator()(StateSet* state_set) const { pool->release(state_set); }
+        };
+
+        // Returns the StateSet to its pool when the session is done with it
+        using Handle = std::unique_ptr<StateSet, Releaser>;
+
+        // A freshly constructed StateSet, or nothing once every slot is taken
+        Handle acquire();
+
+        std::size_t capacity() const { return capacity_; }
+        std::size_t in_use() const { return in_use_; }
+
+    private:
+
+        // A free slot holds the link to the next free slot
+        union Slot
+        {
+            Slot* next;
+            alignas(StateSet) std::byte storage[sizeof(StateSet)];
+        };
+
+        void release(StateSet* state_set);
+
+        std::unique_ptr<Slot[]> slots_;
+        std::size_t capacity_{};
+        std::size_t in_use_{};
+        Slot* free_list_{};
+    };
+
+    StateSetPool::StateSetPool(std::size_t capacity)
+        : slots_(std::make_unique<Slot[]>(capacity))
+        , capacity_(capacity)
+    {
+        // Back to front so slots are handed out in address order
+        for (std::size_t i = capacity_; i > 0; --i)
+        {
+            slots_[i - 1].next = free_list_;
+            free_list_ = &slots_[i - 1];
+        }
+    }
+
+    StateSetPool::~StateSetPool()
+    {
+        // Every handle must have been released, the states would be left
+        // pointing into freed memory otherwise
+        assert(in_use_ == 0);
+    }
 
+    StateSetPool::Handle StateSetPool::acquire()
+    {
+        if (!free_list_)
+        {
+            return Handle{ nullptr, Releaser{ this } };
+        }
+
+        Slot* slot = free_list_;
+        free_list_ = slot->next;
+        ++in_use_;
+
+        return Handle{ ::new (slot->storage) StateSet{}, Releaser{ this } };
+    }
+
+    void StateSetPool::release(StateSet* state_set)
+    {
+        assert(state_set);
+
+        state_set->~StateSet();
+
+        // The StateSet was constructed at the start of its slot
+        Slot* slot = reinterpret_cast<Slot*>(state_set);
+        slot->next = free_list_;
+        free_list_ = slot;
+        --in_use_;
+    }
 
-    // Utility function to "Clear" the console window
-    void clear_screen();
 
     // Start State
     void StartState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Welcome\n\n\n\n\nPress enter to start" << std::endl;
+        show(bot, prompt::start);
     }
 
     void StartState::process_input(ChatBot* bot)
     {
-        std::string line;
-        getline(std::cin, line);
+        // Any line will do, even an empty one
+        auto line = read_line(bot);
 
-        std::cout << "Contents: (" << line << ')' << std::endl;
+        if (!line)
+        {
+            reject_input(bot, line.error);
+            return;
+        }
 
         change_state(bot, StateName::MainMenuState);
     }
@@ -303,23 +559,24 @@ namespace nosingleton
     // MainMenu State
     void MainMenuState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Main Menu\n\n\n\n\n";
-        std::cout << "1. Add Patient\n2. Exit\n\n\n";
-        std::cout << "Type a number according to your selection and press enter\n" << std::endl;
+        show(bot, prompt::main_menu);
     }
 
     void MainMenuState::process_input(ChatBot* bot)
     {
-        int in;
-        std::cin >> in;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        auto choice = read_int(bot);
+
+        if (!choice)
+        {
+            reject_input(bot, choice.error);
+            return;
+        }
 
-        switch (in)
+        switch (choice.value)
         {
         case 1:
         {
+            start_patient(bot);
             change_state(bot, StateName::CollectNameState);
             break;
         }
@@ -330,6 +587,8 @@ namespace nosingleton
         }
         default:
         {
+            // Not one of the options on screen
+            reject_input(bot, input::Error::out_of_range);
             break;
         }
         }
@@ -339,17 +598,25 @@ namespace nosingleton
     // CollectName State
     void CollectNameState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Name\n\n\n\n\n\n";
-        std::cout << "Type your name and press enter\n" << std::endl;
+        show(bot, prompt::collect_name);
     }
 
     void CollectNameState::process_input(ChatBot* bot)
     {
-        std::string name;
-        getline(std::cin, name);
-        set_patient_name(bot, name);
+        auto name = read_line(bot);
+
+        if (!name)
+        {
+            reject_input(bot, name.error);
+            return;
+        }
+
+        if (!set_patient_name(bot, name.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return;
+        }
+
         change_state(bot, StateName::CollectAddressState);
     }
 
@@ -357,17 +624,25 @@ namespace nosingleton
     // CollectAddress State
     void CollectAddressState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Address\n\n\n\n\n\n";
-        std::cout << "Type your address and press enter\n" << std::endl;
+        show(bot, prompt::collect_address);
     }
 
     void CollectAddressState::process_input(ChatBot* bot)
     {
-        std::string address;
-        getline(std::cin, address);
-        set_patient_address(bot, address);
+        auto address = read_line(bot);
+
+        if (!address)
+        {
+            reject_input(bot, address.error);
+            return;
+        }
+
+        if (!set_patient_address(bot, address.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return;
+        }
+
         change_state(bot, StateName::CollectAgeState);
     }
 
@@ -375,18 +650,20 @@ namespace nosingleton
     // CollectAge State
     void CollectAgeState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Age\n\n\n\n\n\n";
-        std::cout << "Type your age and press enter\n" << std::endl;
+        show(bot, prompt::collect_age);
     }
 
     void CollectAgeState::process_input(ChatBot* bot)
     {
-        int age{};
-        std::cin >> age;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_age(bot, age);
+        auto age = read_int(bot, 0, compact::max_age);
+
+        if (!age)
+        {
+            reject_input(bot, age.error);
+            return;
+        }
+
+        set_patient_age(bot, age.value);
         change_state(bot, StateName::CollectHeightState);
     }
 
@@ -394,18 +671,20 @@ namespace nosingleton
     // CollectHeight State
     void CollectHeightState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Add Patient Height\n\n\n\n\n\n";
-        std::cout << "Type your height and press enter\n" << std::endl;
+        show(bot, prompt::collect_height);
     }
 
     void CollectHeightState::process_input(ChatBot* bot)
     {
-        int height{};
-        std::cin >> height;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_height(bot, height);
+        auto height = read_int(bot, 0, compact::max_height);
+
+        if (!height)
+        {
+            reject_input(bot, height.error);
+            return;
+        }
+
+        set_patient_height(bot, height.value);
         change_state(bot, StateName::ConfirmInfoState);
     }
 
@@ -413,17 +692,25 @@ namespace nosingleton
     // EditName State
     void EditNameState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Name\n\n\n\n\n\n";
-        std::cout << "Type your name and press enter\n" << std::endl;
+        show(bot, prompt::edit_name);
     }
 
     void EditNameState::process_input(ChatBot* bot)
     {
-        std::string name;
-        getline(std::cin, name);
-        set_patient_name(bot, name);
+        auto name = read_line(bot);
+
+        if (!name)
+        {
+            reject_input(bot, name.error);
+            return;
+        }
+
+        if (!set_patient_name(bot, name.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return;
+        }
+
         change_state(bot, StateName::EditOptionsState);
     }
 
@@ -431,17 +718,25 @@ namespace nosingleton
     // EditAddress State
     void EditAddressState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Address\n\n\n\n\n\n";
-        std::cout << "Type your address and press enter\n" << std::endl;
+        show(bot, prompt::edit_address);
     }
 
     void EditAddressState::process_input(ChatBot* bot)
     {
-        std::string address;
-        getline(std::cin, address);
-        set_patient_address(bot, address);
+        auto address = read_line(bot);
+
+        if (!address)
+        {
+            reject_input(bot, address.error);
+            return;
+        }
+
+        if (!set_patient_address(bot, address.value))
+        {
+            reject_input(bot, input::Error::line_too_long);
+            return;
+        }
+
         change_state(bot, StateName::EditOptionsState);
     }
 
@@ -449,18 +744,20 @@ namespace nosingleton
     // EditAge State
     void EditAgeState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Age\n\n\n\n\n\n";
-        std::cout << "Type your age and press enter\n" << std::endl;
+        show(bot, prompt::edit_age);
     }
 
     void EditAgeState::process_input(ChatBot* bot)
     {
-        int age{};
-        std::cin >> age;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_age(bot, age);
+        auto age = read_int(bot, 0, compact::max_age);
+
+        if (!age)
+        {
+            reject_input(bot, age.error);
+            return;
+        }
+
+        set_patient_age(bot, age.value);
         change_state(bot, StateName::EditOptionsState);
     }
 
@@ -468,18 +765,20 @@ namespace nosingleton
     // EditHeight State
     void EditHeightState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Height\n\n\n\n\n\n";
-        std::cout << "Type your height and press enter\n" << std::endl;
+        show(bot, prompt::edit_height);
     }
 
     void EditHeightState::process_input(ChatBot* bot)
     {
-        int height{};
-        std::cin >> height;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        set_patient_height(bot, height);
+        auto height = read_int(bot, 0, compact::max_height);
+
+        if (!height)
+        {
+            reject_input(bot, height.error);
+            return;
+        }
+
+        set_patient_height(bot, height.value);
         change_state(bot, StateName::EditOptionsState);
     }
 
@@ -487,26 +786,40 @@ namespace nosingleton
     // ConfirmInfo State
     void ConfirmInfoState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        Patient patient{ bot->get_patient_info() };
-
-        std::cout << "Confirm Info is Correct\n\n\n";
-        std::cout << "Patient Name: " << patient.name << '\n';
-        std::cout << "Patient Address: " << patient.address << '\n';
-        std::cout << "Patient Age: " << patient.age << '\n';
-        std::cout << "Patient Height: " << patient.height << "\n\n\n";
-        std::cout << "1. Edit Patient Info\n2. Save and Return to Menu\n\n\n";
-        std::cout << "Type a number according to your selection and press enter\n" << std::endl;
+        const compact::PatientView patient = bot->get_patient_info();
+
+        // Only the digits of values outside the precomputed table end up here
+        prompt::DecimalBuffer age{};
+        prompt::DecimalBuffer height{};
+
+        // The fixed text is precompiled, the patient fields are slotted in
+        // between so the whole screen goes out in one writev
+        const iovec screen[]{
+            render::segment(prompt::confirm_info::name),
+            render::segment(patient.name),
+            render::segment(prompt::confirm_info::address),
+            render::segment(patient.address),
+            render::segment(prompt::confirm_info::age),
+            render::segment(prompt::decimal(patient.age, age)),
+            render::segment(prompt::confirm_info::height),
+            render::segment(prompt::decimal(patient.height, height)),
+            render::segment(prompt::confirm_info::options)
+        };
+
+        show(bot, screen);
     }
 
     void ConfirmInfoState::process_input(ChatBot* bot)
     {
-        int in;
-        std::cin >> in;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        auto choice = read_int(bot);
+
+        if (!choice)
+        {
+            reject_input(bot, choice.error);
+            return;
+        }
 
-        switch (in)
+        switch (choice.value)
         {
         case 1:
         {
@@ -515,11 +828,14 @@ namespace nosingleton
         }
         case 2:
         {
+            save_patient(bot);
             change_state(bot, StateName::MainMenuState);
             break;
         }
         default:
         {
+            // Not one of the options on screen
+            reject_input(bot, input::Error::out_of_range);
             break;
         }
         }
@@ -529,20 +845,20 @@ namespace nosingleton
     // EditOptions State
     void EditOptionsState::prompt_user(ChatBot* bot)
     {
-        clear_screen();
-
-        std::cout << "Edit Patient Info\n\n\n\n\n";
-        std::cout << "1. Edit Name\n2. Edit Address\n3. Edit Age\n4. Edit Height\n5. Save and Continue\n\n\n";
-        std::cout << "Type a number according to your selection and press enter\n" << std::endl;
+        show(bot, prompt::edit_options);
     }
 
     void EditOptionsState::process_input(ChatBot* bot)
     {
-        int in;
-        std::cin >> in;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        auto choice = read_int(bot);
 
-        switch (in)
+        if (!choice)
+        {
+            reject_input(bot, choice.error);
+            return;
+        }
+
+        switch (choice.value)
         {
         case 1:
         {
@@ -571,6 +887,8 @@ namespace nosingleton
         }
         default:
         {
+            // Not one of the options on screen
+            reject_input(bot, input::Error::out_of_range);
             break;
         }
         }
@@ -595,10 +913,21 @@ namespace nosingleton
         // but used stack to prove it was possible
         // It is also possible to have ChatBot own the
         // StateSet if reuse is not required or the states
-        // themselves maintain state and cannot be shared
+        // themselves maintain state and cannot be shared,
+        // see StateSetPool for doing that for many sessions
         StateSet state_set{};
 
-        ChatBot bot{ &state_set };
+        render::Renderer renderer{};
+
+        // Saved patients outlive the demo
+        store::PatientStore store{ "patients.log" };
+
+        ChatBot bot{ &state_set, renderer };
+
+        if (store.is_open())
+        {
+            bot.attach_store(&store);
+        }
 
         while (bot.running())
         {
@@ -612,46 +941,254 @@ namespace nosingleton
     void State::change_state(ChatBot* bot, StateName name)
     {
         assert(bot);
-        bot->change_state(name);
+        bot->machine_.change_state(name);
+    }
+
+    void State::not_handled(ChatBot* bot, Request request)
+    {
+        assert(bot);
+
+        StateName state = bot->machine_.state();
+
+        stats::Unhandled<StateName, Request>::add(state, request);
+        unhandled::Pairs<StateName, Request>::report(state, request);
+
+        bot->unhandled_ = true;
     }
 
-    void State::set_patient_name(ChatBot* bot, std::string name)
+    bool State::set_patient_name(ChatBot* bot, std::string_view name)
     {
-        bot->patient_.name = name;
+        // The only copy, straight out of the line reader's buffer
+        return compact::replace_name(bot->patient_, bot->text_, name);
     }
 
-    void State::set_patient_address(ChatBot* bot, std::string address)
+    bool State::set_patient_address(ChatBot* bot, std::string_view address)
     {
-        bot->patient_.address = address;
+        return compact::replace_address(bot->patient_, bot->text_, address);
     }
 
     void State::set_patient_age(ChatBot* bot, int age)
     {
-        bot->patient_.age = age;
+        assert(age >= 0 && age <= compact::max_age);
+        bot->patient_.age = static_cast<std::uint8_t>(age);
     }
 
     void State::set_patient_height(ChatBot* bot, int height)
     {
-        bot->patient_.height = height;
+        assert(height >= 0 && height <= compact::max_height);
+        bot->patient_.height = static_cast<std::uint16_t>(height);
     }
 
-    // ChatBot Implementation
-    ChatBot::ChatBot(StateSet* state_set)
-        : state_set_(state_set)
+    void State::start_patient(ChatBot* bot)
     {
-        change_state(StateName::StartState);
+        assert(bot);
+
+        // Keeps the arena's memory, edits reuse it through
+        // compact::replace_name and replace_address
+        bot->patient_ = {};
+        bot->text_.clear();
     }
 
-    void ChatBot::change_state(StateName name)
+    void State::save_patient(ChatBot* bot)
     {
-        current_state_ = state_set_->get_state(name);
-        assert(current_state_);
+        assert(bot);
+
+        if (bot->store_)
+        {
+            const compact::PatientView patient = bot->get_patient_info();
+
+            // Durability is left to the store's group commit, the session
+            // doesn't wait for the disk before moving on
+            if (!bot->store_->append(patient.name, patient.address, patient.age, patient.height))
+            {
+                logging::errors() << "Error: patient store is full, patient was not saved" << std::endl;
+            }
+        }
+    }
+
+    input::Result<std::string_view> State::read_line(ChatBot* bot)
+    {
+        assert(bot);
+
+        if (bot->read_ahead_) [[unlikely]]
+        {
+            return *std::exchange(bot->read_ahead_, std::nullopt);
+        }
+
+        return bot->input_->next_line();
+    }
+
+    input::Result<int> State::read_int(ChatBot* bot)
+    {
+        // Through read_line so a journaled bot's state gets its line
+        input::Result<std::string_view> line = read_line(bot);
+
+        if (!line)
+        {
+            return { 0, line.error };
+        }
+
+        return input::parse_int(line.value);
+    }
+
+    input::Result<int> State::read_int(ChatBot* bot, int min, int max)
+    {
+        input::Result<int> result = read_int(bot);
+
+        if (result && (result.value < min || result.value > max))
+        {
+            result.error = input::Error::out_of_range;
+        }
+
+        return result;
     }
 
+    void State::reject_input(ChatBot* bot, input::Error error)
+    {
+        assert(bot);
+
+        if (error == input::Error::end_of_input)
+        {
+            change_state(bot, StateName::FinishedState);
+            return;
+        }
+
+        bot->input_error_ = error;
+    }
+
+    void State::show(ChatBot* bot, render::Screen screen)
+    {
+        assert(bot);
+
+        if (bot->input_error_ == input::Error::none)
+        {
+            bot->display_->show(screen);
+            return;
+        }
+
+        // Add the reason the last answer was rejected below the screen
+        constexpr std::size_t max_segments{ 16 };
+        assert(screen.size() < max_segments);
+
+        iovec segments[max_segments];
+        std::size_t count{};
+
+        for (const iovec& segment : screen)
+        {
+            segments[count++] = segment;
+        }
+
+        segments[count++] = render::segment(prompt::invalid_input_message(bot->input_error_));
+        bot->input_error_ = input::Error::none;
+
+        bot->display_->show({ segments, count });
+    }
+
+    void State::show(ChatBot* bot, std::string_view screen)
+    {
+        const iovec segment = render::segment(screen);
+        show(bot, { &segment, 1 });
+    }
+
+    // ChatBot Implementation
+    ChatBot::ChatBot(StateSet* state_set, render::Display& display, input::LineReader& input)
+        : machine_(StateName::StartState, state_set->table()), display_(&display), input_(&input)
+    {
+    }
+
+
     bool ChatBot::running() const
     {
-        // Inefficient but thats not important for this demo
-        return current_state_ != state_set_->get_state(StateName::FinishedState);
+        return machine_.state() != StateName::FinishedState;
+    }
+
+    // What save writes, followed by the name and address bytes. Copied
+    // with memcpy so the bytes can be at any alignment
+    struct SavedSession
+    {
+        std::uint64_t transition_count;
+        std::uint16_t name_length;
+        std::uint16_t address_length;
+        std::uint16_t height;
+        std::uint8_t age;
+        std::uint8_t state;
+        std::uint8_t input_error;
+    };
+
+    std::size_t ChatBot::saved_size() const
+    {
+        return sizeof(SavedSession) + patient_.name_length + patient_.address_length;
+    }
+
+    std::size_t ChatBot::save(std::span<std::byte> out) const
+    {
+        std::size_t size = saved_size();
+
+        if (out.size() < size)
+        {
+            return 0;
+        }
+
+        const SavedSession saved{
+            machine_.transition_count(),
+            patient_.name_length,
+            patient_.address_length,
+            patient_.height,
+            patient_.age,
+            static_cast<std::uint8_t>(machine_.state()),
+            static_cast<std::uint8_t>(input_error_)
+        };
+
+        std::byte* next = out.data();
+        std::memcpy(next, &saved, sizeof(saved));
+        next += sizeof(saved);
+
+        // Only the text of the current patient, not whatever earlier edits
+        // left behind in the arena
+        compact::PatientView patient = get_patient_info();
+        std::memcpy(next, patient.name.data(), patient.name.size());
+        next += patient.name.size();
+        std::memcpy(next, patient.address.data(), patient.address.size());
+
+        return size;
+    }
+
+    bool ChatBot::restore(std::span<const std::byte> in)
+    {
+        SavedSession saved{};
+
+        if (in.size() < sizeof(saved))
+        {
+            return false;
+        }
+
+        std::memcpy(&saved, in.data(), sizeof(saved));
+
+        bool valid = saved.state < fsm::state_count<StateName>
+            && saved.input_error <= static_cast<std::uint8_t>(input::Error::line_too_long)
+            && in.size() == sizeof(saved) + saved.name_length + saved.address_length;
+
+        if (!valid)
+        {
+            return false;
+        }
+
+        const char* text = reinterpret_cast<const char*>(in.data() + sizeof(saved));
+
+        // Keeps the arena's memory, so restoring into a bot that has held
+        // a session before doesn't allocate
+        text_.clear();
+        patient_ = {};
+        // The lengths were saved as 16 bits, so the text always fits
+        patient_.set_name(*text_.store({ text, saved.name_length }));
+        patient_.set_address(*text_.store({ text + saved.name_length, saved.address_length }));
+        patient_.age = saved.age;
+        patient_.height = saved.height;
+
+        input_error_ = static_cast<input::Error>(saved.input_error);
+        machine_.reset(static_cast<StateName>(saved.state), saved.transition_count);
+
+        return true;
     }
 
 
@@ -659,24 +1196,61 @@ namespace nosingleton
 
     void State::prompt_user(ChatBot* bot)
     {
-        std::cout << "Error: State does not implement State::prompt_user" << std::endl;
+        not_handled(bot, Request::prompt_user);
     }
 
     void State::process_input(ChatBot* bot)
     {
-        std::cout << "Error: State does not implement State::process_input" << std::endl;
+        not_handled(bot, Request::process_input);
     }
 
-    // Helper to "clear the screen"
-    void clear_screen()
+
+    // Opens and closes sessions that each own a StateSet, as they would
+    // have to with stateful states, keeping a batch of them open at a time.
+    // Compares StateSets from the pool with ones allocated one at a time
+    void run_state_set_benchmark(std::uint64_t session_count)
     {
-        for (int i = 0; i < 100; ++i)
+        constexpr std::size_t batch_size{ 1024 };
+
+        render::NullDisplay display{};
+        input::LineReader input{};
+
+        auto run = [&](auto make_state_set)
         {
-            std::cout << "\n";
-        }
+            using StateSetOwner = decltype(make_state_set());
+
+            std::vector<StateSetOwner> state_sets;
+            std::vector<ChatBot> bots;
+            state_sets.reserve(batch_size);
+            bots.reserve(batch_size);
+
+            auto start = std::chrono::steady_clock::now();
+
+            for (std::uint64_t opened = 0; opened < session_count; opened += batch_size)
+            {
+                for (std::size_t i = 0; i < batch_size; ++i)
+                {
+                    state_sets.push_back(make_state_set());
+                    bots.emplace_back(state_sets.back().get(), display, input);
+                }
+
+                bots.clear();
+                state_sets.clear();
+            }
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return (session_count + batch_size - 1) / batch_size * batch_size / seconds;
+        };
+
+        StateSetPool pool{ batch_size };
+
+        double pooled = run([&pool] { return pool.acquire(); });
+        double allocated = run([] { return std::make_unique<StateSet>(); });
 
-        std::cout << std::endl;
+        std::cout << "StateSet is " << sizeof(StateSet) << " bytes, one per session\n"
+            << "  pooled:    " << pooled << " sessions/s\n"
+            << "  allocated: " << allocated << " sessions/s" << std::endl;
     }
 }
 
-#endif
\ No newline at end of file
+#endif
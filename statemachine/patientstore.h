@@ -0,0 +1,658 @@
+#ifndef PATIENTSTORE
+#define PATIENTSTORE
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace store
+{
+    // "Save and Return to Menu" used to just change state and the patient
+    // was lost as soon as the next one was entered. Saved patients are now
+    // appended to a memory mapped log file.
+    //
+    // Any number of sessions can save at once. A save only reserves space
+    // with an atomic add and copies the record in, no lock is taken. A
+    // background committer flushes everything written since the last commit
+    // with one msync, so the cost of reaching the disk is shared by every
+    // save in the batch (group commit). On restart the log is scanned once
+    // to rebuild the index from record id to position in the file
+
+    using RecordId = std::uint64_t;
+
+    struct PatientRecord
+    {
+        RecordId id{};
+        std::string name;
+        std::string address;
+        int age{};
+        int height{};
+    };
+
+    class PatientStore
+    {
+    public:
+
+        // Opens or creates the log at path. A new log is created sparse with
+        // room for capacity bytes of records, an existing one keeps its size
+        explicit PatientStore(const std::string& path, std::size_t capacity = std::size_t{ 1 } << 30);
+        ~PatientStore();
+
+        PatientStore(const PatientStore&) = delete;
+        PatientStore& operator=(const PatientStore&) = delete;
+
+        bool is_open() const { return base_ != nullptr; }
+
+        // Lock free and safe to call from any number of threads. Returns
+        // nothing if the log is full. The record is durable once a later
+        // commit has covered it, which sync can wait for
+        std::optional<RecordId> append(std::string_view name, std::string_view address, int age, int height);
+
+        // Blocks until the record has been committed to disk
+        void sync(RecordId id);
+
+        std::optional<PatientRecord> get(RecordId id) const;
+
+        // Records in the log, including ones recovered on open
+        std::uint64_t record_count() const { return record_count_.load(std::memory_order_relaxed); }
+
+        std::uint64_t recovered_count() const { return recovered_count_; }
+
+    private:
+
+        // Every record starts with this header followed by the name and
+        // address bytes, padded so the next header is aligned
+        struct RecordHeader
+        {
+            // Written last, a record whose commit word is not set was torn
+            // by a crash or is still being written
+            std::uint32_t commit;
+            std::uint32_t size;
+            RecordId id;
+            std::uint32_t generation;
+            std::uint32_t checksum;
+            std::int32_t age;
+            std::int32_t height;
+            std::uint32_t name_length;
+            std::uint32_t address_length;
+        };
+
+        struct FileHeader
+        {
+            char magic[8];
+            std::uint32_t version;
+
+            // Bumped every time the log is opened so that records left over
+            // from before a crash can't be mistaken for new ones
+            std::uint32_t generation;
+        };
+
+        static constexpr std::uint32_t record_magic{ 0x52544150 };
+        static constexpr char file_magic[8]{ 'P', 'A', 'T', 'L', 'O', 'G', '0', '1' };
+        static constexpr std::size_t record_alignment{ alignof(RecordHeader) };
+
+        // Records start on the second page so the file header can be
+        // flushed on its own
+        static constexpr std::size_t data_offset{ 4096 };
+
+        // The index is split into chunks that are allocated as ids are
+        // handed out rather than sized for the worst case up front
+        static constexpr std::size_t index_chunk_size{ std::size_t{ 1 } << 16 };
+        static constexpr std::size_t index_chunk_count{ std::size_t{ 1 } << 16 };
+
+        static std::uint32_t checksum(const std::byte* record, std::size_t size);
+
+        RecordHeader* header_at(std::uint64_t offset) const;
+        std::atomic<std::uint64_t>& index_slot(RecordId id);
+        const std::atomic<std::uint64_t>* find_slot(RecordId id) const;
+
+        bool map(const std::string& path, std::size_t capacity);
+        void recover();
+        void clear_from(std::uint64_t offset);
+
+        void commit_loop();
+        void commit();
+
+        int fd_{ -1 };
+        std::byte* base_{};
+        std::size_t capacity_{};
+        std::uint32_t generation_{};
+
+        // Where the next record will be written and the id it will get
+        std::atomic<std::uint64_t> tail_{};
+        std::atomic<RecordId> next_id_{};
+        std::atomic<std::uint64_t> record_count_{};
+        std::uint64_t recovered_count_{};
+
+        // Offset + 1 of each record by id, zero if the id is unused
+        std::unique_ptr<std::atomic<std::atomic<std::uint64_t>*>[]> index_;
+
+        // Everything before this offset is on disk
+        std::uint64_t durable_{};
+
+        std::mutex commit_mutex_;
+        std::condition_variable commit_requested_;
+        std::condition_variable committed_;
+        bool sync_waiting_{ false };
+        bool stopping_{ false };
+        std::thread committer_;
+    };
+
+
+    // PatientStore
+
+    PatientStore::PatientStore(const std::string& path, std::size_t capacity)
+        : index_(std::make_unique<std::atomic<std::atomic<std::uint64_t>*>[]>(index_chunk_count))
+    {
+        if (!map(path, capacity))
+        {
+            std::cerr << "Error: could not open patient store " << path << std::endl;
+            return;
+        }
+
+        recover();
+
+        committer_ = std::thread{ [this] { commit_loop(); } };
+    }
+
+    PatientStore::~PatientStore()
+    {
+        if (committer_.joinable())
+        {
+            {
+                std::lock_guard lock{ commit_mutex_ };
+                stopping_ = true;
+            }
+
+            commit_requested_.notify_one();
+            committer_.join();
+        }
+
+        for (std::size_t i = 0; i < index_chunk_count; ++i)
+        {
+            delete[] index_[i].load(std::memory_order_relaxed);
+        }
+
+        if (base_)
+        {
+            ::munmap(base_, capacity_);
+        }
+
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+
+    std::optional<RecordId> PatientStore::append(std::string_view name, std::string_view address, int age, int height)
+    {
+        assert(base_);
+
+        std::size_t size = sizeof(RecordHeader) + name.size() + address.size();
+        size = (size + record_alignment - 1) / record_alignment * record_alignment;
+
+        // Reserving space is the only point of contention between sessions
+        std::uint64_t offset = tail_.fetch_add(size, std::memory_order_relaxed);
+
+        if (offset + size > capacity_)
+        {
+            return std::nullopt;
+        }
+
+        RecordId id = next_id_.fetch_add(1, std::memory_order_relaxed);
+
+        if (id / index_chunk_size >= index_chunk_count)
+        {
+            return std::nullopt;
+        }
+
+        std::byte* record = base_ + offset;
+
+        RecordHeader header{};
+        header.size = static_cast<std::uint32_t>(size);
+        header.id = id;
+        header.generation = generation_;
+        header.age = age;
+        header.height = height;
+        header.name_length = static_cast<std::uint32_t>(name.size());
+        header.address_length = static_cast<std::uint32_t>(address.size());
+
+        // Everything but the commit word, which the committer may be
+        // reading already
+        constexpr std::size_t after_commit{ offsetof(RecordHeader, size) };
+
+        std::memcpy(record + after_commit, reinterpret_cast<const std::byte*>(&header) + after_commit,
+            sizeof(header) - after_commit);
+        std::memcpy(record + sizeof(header), name.data(), name.size());
+        std::memcpy(record + sizeof(header) + name.size(), address.data(), address.size());
+
+        header_at(offset)->checksum = checksum(record, size);
+
+        // Publishing the commit word makes the record visible to the
+        // committer, which only flushes complete records
+        std::atomic_ref<std::uint32_t>{ header_at(offset)->commit }.store(record_magic, std::memory_order_release);
+
+        index_slot(id).store(offset + 1, std::memory_order_release);
+        record_count_.fetch_add(1, std::memory_order_relaxed);
+
+        return id;
+    }
+
+    void PatientStore::sync(RecordId id)
+    {
+        const std::atomic<std::uint64_t>* slot = find_slot(id);
+
+        if (!slot || slot->load(std::memory_order_acquire) == 0)
+        {
+            return;
+        }
+
+        std::uint64_t offset = slot->load(std::memory_order_acquire) - 1;
+        std::uint64_t end = offset + header_at(offset)->size;
+
+        std::unique_lock lock{ commit_mutex_ };
+
+        while (durable_ < end && !stopping_)
+        {
+            sync_waiting_ = true;
+            commit_requested_.notify_one();
+            committed_.wait(lock);
+        }
+    }
+
+    std::optional<PatientRecord> PatientStore::get(RecordId id) const
+    {
+        const std::atomic<std::uint64_t>* slot = find_slot(id);
+        std::uint64_t position = slot ? slot->load(std::memory_order_acquire) : 0;
+
+        if (position == 0)
+        {
+            return std::nullopt;
+        }
+
+        const RecordHeader* header = header_at(position - 1);
+        const char* text = reinterpret_cast<const char*>(header + 1);
+
+        PatientRecord patient{};
+        patient.id = header->id;
+        patient.name.assign(text, header->name_length);
+        patient.address.assign(text + header->name_length, header->address_length);
+        patient.age = header->age;
+        patient.height = header->height;
+
+        return patient;
+    }
+
+    std::uint32_t PatientStore::checksum(const std::byte* record, std::size_t size)
+    {
+        // FNV-1a over everything after the checksum itself
+        std::uint32_t value{ 2166136261u };
+
+        for (std::size_t i = offsetof(RecordHeader, age); i < size; ++i)
+        {
+            value ^= static_cast<std::uint32_t>(record[i]);
+            value *= 16777619u;
+        }
+
+        // Mix in the fields before it as well
+        for (std::size_t i = offsetof(RecordHeader, size); i < offsetof(RecordHeader, checksum); ++i)
+        {
+            value ^= static_cast<std::uint32_t>(record[i]);
+            value *= 16777619u;
+        }
+
+        return value;
+    }
+
+    PatientStore::RecordHeader* PatientStore::header_at(std::uint64_t offset) const
+    {
+        return reinterpret_cast<RecordHeader*>(base_ + offset);
+    }
+
+    std::atomic<std::uint64_t>& PatientStore::index_slot(RecordId id)
+    {
+        std::atomic<std::atomic<std::uint64_t>*>& chunk = index_[id / index_chunk_size];
+        std::atomic<std::uint64_t>* slots = chunk.load(std::memory_order_acquire);
+
+        if (!slots)
+        {
+            // Whoever gets here first for a chunk allocates it, the losers of
+            // the race free their copy and use the winner's
+            auto* fresh = new std::atomic<std::uint64_t>[index_chunk_size]{};
+
+            if (chunk.compare_exchange_strong(slots, fresh, std::memory_order_acq_rel))
+            {
+                slots = fresh;
+            }
+            else
+            {
+                delete[] fresh;
+            }
+        }
+
+        return slots[id % index_chunk_size];
+    }
+
+    const std::atomic<std::uint64_t>* PatientStore::find_slot(RecordId id) const
+    {
+        if (id / index_chunk_size >= index_chunk_count)
+        {
+            return nullptr;
+        }
+
+        const std::atomic<std::uint64_t>* slots = index_[id / index_chunk_size].load(std::memory_order_acquire);
+        return slots ? &slots[id % index_chunk_size] : nullptr;
+    }
+
+    bool PatientStore::map(const std::string& path, std::size_t capacity)
+    {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd_ < 0)
+        {
+            return false;
+        }
+
+        struct stat status{};
+
+        if (::fstat(fd_, &status) != 0)
+        {
+            return false;
+        }
+
+        bool fresh = status.st_size == 0;
+
+        if (fresh)
+        {
+            // Sparse, only pages that records are written to take up space
+            if (::ftruncate(fd_, static_cast<off_t>(capacity)) != 0)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            capacity = static_cast<std::size_t>(status.st_size);
+        }
+
+        if (capacity <= data_offset)
+        {
+            return false;
+        }
+
+        void* base = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+        if (base == MAP_FAILED)
+        {
+            return false;
+        }
+
+        base_ = static_cast<std::byte*>(base);
+        capacity_ = capacity;
+
+        auto* header = reinterpret_cast<FileHeader*>(base_);
+
+        if (fresh)
+        {
+            std::memcpy(header->magic, file_magic, sizeof(file_magic));
+            header->version = 1;
+            header->generation = 0;
+        }
+        else if (std::memcmp(header->magic, file_magic, sizeof(file_magic)) != 0)
+        {
+            ::munmap(base_, capacity_);
+            base_ = nullptr;
+            return false;
+        }
+
+        generation_ = ++header->generation;
+
+        ::msync(base_, data_offset, MS_SYNC);
+
+        return true;
+    }
+
+    void PatientStore::recover()
+    {
+        std::uint64_t offset{ data_offset };
+        std::uint32_t generation{};
+        RecordId next_id{};
+
+        // Records are read back in file order until the first one that is
+        // incomplete. A crash can only tear records after the last commit,
+        // and those were never reported as durable
+        while (offset + sizeof(RecordHeader) <= capacity_)
+        {
+            const RecordHeader* header = header_at(offset);
+
+            bool valid = header->commit == record_magic
+                && header->size >= sizeof(RecordHeader)
+                && header->size % record_alignment == 0
+                && header->size <= capacity_ - offset
+                && sizeof(RecordHeader) + std::uint64_t{ header->name_length } + header->address_length <= header->size
+                && header->generation >= generation
+                && header->generation < generation_
+                && header->id / index_chunk_size < index_chunk_count
+                && header->checksum == checksum(reinterpret_cast<const std::byte*>(header), header->size);
+
+            // Records from an older generation found after newer ones were
+            // left behind by a crash and have since been written over
+            if (!valid)
+            {
+                break;
+            }
+
+            index_slot(header->id).store(offset + 1, std::memory_order_relaxed);
+
+            generation = header->generation;
+            next_id = header->id + 1 > next_id ? header->id + 1 : next_id;
+            ++recovered_count_;
+
+            offset += header->size;
+        }
+
+        // Records a crash left after a torn one can still have their commit
+        // words set, and new records are about to be written over them
+        clear_from(offset);
+
+        tail_.store(offset, std::memory_order_relaxed);
+        next_id_.store(next_id, std::memory_order_relaxed);
+        record_count_.store(recovered_count_, std::memory_order_relaxed);
+        durable_ = offset;
+    }
+
+    void PatientStore::clear_from(std::uint64_t offset)
+    {
+        std::uint64_t page = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+        std::uint64_t next_page = std::min<std::uint64_t>((offset + page - 1) / page * page, capacity_);
+
+        std::memset(base_ + offset, 0, next_page - offset);
+
+        if (offset < next_page)
+        {
+            ::msync(base_ + offset / page * page, page, MS_SYNC);
+        }
+
+        if (next_page == capacity_)
+        {
+            return;
+        }
+
+        // Punching a hole gives the blocks back, and the file reads as
+        // zeros there, without writing the rest of a mostly sparse log
+        if (::fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(next_page),
+            static_cast<off_t>(capacity_ - next_page)) == 0)
+        {
+            ::fsync(fd_);
+            return;
+        }
+
+        std::cerr << "Error: could not punch a hole in the patient store, clearing it instead" << std::endl;
+
+        std::memset(base_ + next_page, 0, capacity_ - next_page);
+        ::msync(base_ + next_page, capacity_ - next_page, MS_SYNC);
+    }
+
+    void PatientStore::commit_loop()
+    {
+        // Commits happen on a short timer, or straight away when someone is
+        // waiting in sync. Either way every record written in the meantime
+        // goes to disk in the same msync
+        constexpr auto commit_interval = std::chrono::milliseconds{ 2 };
+
+        std::unique_lock lock{ commit_mutex_ };
+
+        while (!stopping_)
+        {
+            commit_requested_.wait_for(lock, commit_interval, [this] { return sync_waiting_ || stopping_; });
+            sync_waiting_ = false;
+
+            lock.unlock();
+            commit();
+            lock.lock();
+        }
+
+        lock.unlock();
+        commit();
+    }
+
+    void PatientStore::commit()
+    {
+        std::uint64_t start{};
+
+        {
+            std::lock_guard lock{ commit_mutex_ };
+            start = durable_;
+        }
+
+        // Only a contiguous run of complete records can be committed, a
+        // record still being written holds back everything after it
+        std::uint64_t end{ start };
+        std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+
+        while (end < tail && end + sizeof(RecordHeader) <= capacity_)
+        {
+            RecordHeader* header = header_at(end);
+
+            if (std::atomic_ref<std::uint32_t>{ header->commit }.load(std::memory_order_acquire) != record_magic
+                || header->generation != generation_)
+            {
+                break;
+            }
+
+            end += header->size;
+        }
+
+        if (end > start)
+        {
+            // msync works on whole pages
+            std::uint64_t page = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+            std::uint64_t first = start / page * page;
+
+            ::msync(base_ + first, end - first, MS_SYNC);
+        }
+
+        {
+            std::lock_guard lock{ commit_mutex_ };
+            durable_ = end;
+        }
+
+        committed_.notify_all();
+    }
+
+
+    // Measures saves per second from several threads at once, then how long
+    // it takes to open the resulting log again. Any existing log at path is
+    // deleted first so every run starts from an empty store
+    void run_store_benchmark(const std::string& path, unsigned thread_count, std::uint64_t saves_per_thread)
+    {
+        ::unlink(path.c_str());
+
+        std::uint64_t saved{};
+        double save_seconds{};
+
+        {
+            PatientStore store{ path };
+
+            if (!store.is_open())
+            {
+                return;
+            }
+
+            std::atomic<std::uint64_t> failed{};
+            std::vector<std::thread> threads;
+
+            auto start = std::chrono::steady_clock::now();
+
+            for (unsigned t = 0; t < thread_count; ++t)
+            {
+                threads.emplace_back([&store, &failed, t, saves_per_thread]
+                {
+                    std::optional<RecordId> last;
+
+                    for (std::uint64_t i = 0; i < saves_per_thread; ++i)
+                    {
+                        auto id = store.append("Jane Doe", "1 Main Street", 20 + static_cast<int>(i % 60), 150 + static_cast<int>(t));
+
+                        if (!id)
+                        {
+                            failed.fetch_add(1, std::memory_order_relaxed);
+                            break;
+                        }
+
+                        last = id;
+                    }
+
+                    // Only wait for the disk once, at the end of the session
+                    if (last)
+                    {
+                        store.sync(*last);
+                    }
+                });
+            }
+
+            for (std::thread& thread : threads)
+            {
+                thread.join();
+            }
+
+            save_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            saved = store.record_count();
+
+            if (failed.load() > 0)
+            {
+                std::cout << "Store filled up after " << saved << " saves" << std::endl;
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        PatientStore reopened{ path };
+
+        double recover_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "Saved " << saved << " patients from " << thread_count << " threads in "
+            << save_seconds << "s (" << saved / save_seconds << " saves/s)\n"
+            << "Recovered " << reopened.recovered_count() << " patients in " << recover_seconds << 's' << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef PERFCOUNTERS
+#define PERFCOUNTERS
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace perf
+{
+    // Hardware counters around a benchmark region, read with perf_event_open.
+    // Plenty of machines don't have them, VMs and containers often hide the
+    // PMU and perf_event_paranoid can forbid it, so any counter that can't
+    // be opened just reads as missing and the benchmark carries on.
+    //
+    // Each counter is opened on its own rather than as a group, so one the
+    // CPU doesn't have doesn't take the others with it. When there are
+    // more counters than the PMU has registers the kernel takes turns
+    // between them, and each count is scaled up by how long it was
+    // actually counting
+
+    enum class Counter
+    {
+        cycles,
+        instructions,
+        l1d_misses,
+        llc_misses,
+        branch_misses,
+        count
+    };
+
+    constexpr std::size_t counter_count{ static_cast<std::size_t>(Counter::count) };
+
+    constexpr std::string_view name(Counter counter)
+    {
+        switch (counter)
+        {
+        case Counter::cycles: return "cycles";
+        case Counter::instructions: return "instructions";
+        case Counter::l1d_misses: return "L1d misses";
+        case Counter::llc_misses: return "LLC misses";
+        case Counter::branch_misses: return "branch misses";
+        case Counter::count: break;
+        }
+
+        return "";
+    }
+
+    struct Counts
+    {
+        std::array<std::optional<std::uint64_t>, counter_count> values{};
+
+        const std::optional<std::uint64_t>& operator[](Counter counter) const
+        {
+            return values[static_cast<std::size_t>(counter)];
+        }
+
+        // Instructions per cycle, if both were counted
+        std::optional<double> ipc() const
+        {
+            const std::optional<std::uint64_t>& cycles = (*this)[Counter::cycles];
+            const std::optional<std::uint64_t>& instructions = (*this)[Counter::instructions];
+
+            if (!cycles || !instructions || *cycles == 0)
+            {
+                return std::nullopt;
+            }
+
+            return static_cast<double>(*instructions) / static_cast<double>(*cycles);
+        }
+    };
+
+    // Counts this thread in user space only, which is all that
+    // perf_event_paranoid 2 allows
+    class Counters
+    {
+    public:
+
+        Counters();
+        ~Counters();
+
+        Counters(const Counters&) = delete;
+        Counters& operator=(const Counters&) = delete;
+
+        bool available() const;
+
+        // Zeroes the counters and starts them
+        void start();
+
+        // Stops the counters and returns what they counted since start
+        Counts stop();
+
+    private:
+
+        std::array<int, counter_count> fds_{};
+    };
+
+
+    // Counters
+
+    Counters::Counters()
+    {
+        for (std::size_t i = 0; i < counter_count; ++i)
+        {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // Read misses of a cache, in the generic cache event encoding
+            auto read_misses = [](std::uint64_t cache)
+            {
+                return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            };
+
+            switch (static_cast<Counter>(i))
+            {
+            case Counter::cycles:
+            {
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            }
+            case Counter::instructions:
+            {
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            }
+            case Counter::l1d_misses:
+            {
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = read_misses(PERF_COUNT_HW_CACHE_L1D);
+                break;
+            }
+            case Counter::llc_misses:
+            {
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = read_misses(PERF_COUNT_HW_CACHE_LL);
+                break;
+            }
+            case Counter::branch_misses:
+            {
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            }
+            case Counter::count: break;
+            }
+
+            fds_[i] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+    }
+
+    Counters::~Counters()
+    {
+        for (int fd : fds_)
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+    }
+
+    bool Counters::available() const
+    {
+        for (int fd : fds_)
+        {
+            if (fd >= 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Counters::start()
+    {
+        for (int fd : fds_)
+        {
+            if (fd >= 0)
+            {
+                ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    Counts Counters::stop()
+    {
+        Counts counts{};
+
+        for (std::size_t i = 0; i < counter_count; ++i)
+        {
+            if (fds_[i] < 0)
+            {
+                continue;
+            }
+
+            ::ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            struct
+            {
+                std::uint64_t value{};
+                std::uint64_t enabled{};
+                std::uint64_t running{};
+            } reading;
+
+            // A counter that never got a turn on the PMU counted nothing
+            if (::read(fds_[i], &reading, sizeof(reading)) == sizeof(reading) && reading.running > 0)
+            {
+                counts.values[i] = reading.running == reading.enabled ? reading.value
+                    : static_cast<std::uint64_t>(static_cast<double>(reading.value)
+                        * static_cast<double>(reading.enabled) / static_cast<double>(reading.running));
+            }
+        }
+
+        return counts;
+    }
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef PROMPTS
+#define PROMPTS
+
+#include <array>
+#include <cstddef>
+#include <charconv>
+#include <string_view>
+
+#include "lineinput.h"
+
+namespace prompt
+{
+    // Every screen except ConfirmInfo is fixed text, so there is no reason
+    // to assemble it with operator<< each time it is shown. The screens are
+    // concatenated from their shared pieces at compile time and a prompt
+    // is just a pointer and a length handed to the display
+
+    template <std::size_t N>
+    struct Blob
+    {
+        std::array<char, N> bytes{};
+
+        constexpr std::string_view view() const { return { bytes.data(), N }; }
+        constexpr operator std::string_view() const { return view(); }
+    };
+
+    // Screens are built from string literals and other blobs
+    template <typename Part>
+    struct PartSize;
+
+    template <std::size_t N>
+    struct PartSize<char[N]>
+    {
+        // Without the terminator
+        static constexpr std::size_t value{ N - 1 };
+    };
+
+    template <std::size_t N>
+    struct PartSize<Blob<N>>
+    {
+        static constexpr std::size_t value{ N };
+    };
+
+    constexpr const char* part_data(const char* part) { return part; }
+
+    template <std::size_t N>
+    constexpr const char* part_data(const Blob<N>& part) { return part.bytes.data(); }
+
+    // Joins the parts into a single blob
+    template <typename... Parts>
+    constexpr auto concat(const Parts&... parts)
+    {
+        Blob<(PartSize<Parts>::value + ...)> blob{};
+        std::size_t offset{};
+
+        auto append = [&](const char* part, std::size_t size)
+        {
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                blob.bytes[offset++] = part[i];
+            }
+        };
+
+        (append(part_data(parts), PartSize<Parts>::value), ...);
+
+        return blob;
+    }
+
+    // Shared by every screen with a numbered menu
+    constexpr auto select = concat("Type a number according to your selection and press enter\n\n");
+
+    // The same text each state used to print, including the blank line
+    // std::endl used to add after the last line
+    constexpr auto start = concat("Welcome\n\n\n\n\nPress enter to start\n");
+
+    constexpr auto main_menu = concat(
+        "Main Menu\n\n\n\n\n",
+        "1. Add Patient\n2. Exit\n\n\n",
+        select);
+
+    constexpr auto collect_name = concat("Add Patient Name\n\n\n\n\n\n", "Type your name and press enter\n\n");
+    constexpr auto collect_address = concat("Add Patient Address\n\n\n\n\n\n", "Type your address and press enter\n\n");
+    constexpr auto collect_age = concat("Add Patient Age\n\n\n\n\n\n", "Type your age and press enter\n\n");
+    constexpr auto collect_height = concat("Add Patient Height\n\n\n\n\n\n", "Type your height and press enter\n\n");
+
+    constexpr auto edit_name = concat("Edit Patient Name\n\n\n\n\n\n", "Type your name and press enter\n\n");
+    constexpr auto edit_address = concat("Edit Patient Address\n\n\n\n\n\n", "Type your address and press enter\n\n");
+    constexpr auto edit_age = concat("Edit Patient Age\n\n\n\n\n\n", "Type your age and press enter\n\n");
+    constexpr auto edit_height = concat("Edit Patient Height\n\n\n\n\n\n", "Type your height and press enter\n\n");
+
+    constexpr auto edit_options = concat(
+        "Edit Patient Info\n\n\n\n\n",
+        "1. Edit Name\n2. Edit Address\n3. Edit Age\n4. Edit Height\n5. Save and Continue\n\n\n",
+        select);
+
+    // ConfirmInfo is the only screen that shows patient data. The fixed text
+    // around each field is precompiled and the fields are slotted in between
+    // when the screen is shown
+    namespace confirm_info
+    {
+        constexpr auto name = concat("Confirm Info is Correct\n\n\n", "Patient Name: ");
+        constexpr auto address = concat("\nPatient Address: ");
+        constexpr auto age = concat("\nPatient Age: ");
+        constexpr auto height = concat("\nPatient Height: ");
+        constexpr auto options = concat(
+            "\n\n\n",
+            "1. Edit Patient Info\n2. Save and Return to Menu\n\n\n",
+            select);
+    }
+
+
+    // Shown below the screen after an answer the state couldn't use
+    namespace invalid_input
+    {
+        constexpr auto empty = concat("Please type an answer and press enter\n");
+        constexpr auto not_a_number = concat("That is not a number, please try again\n");
+        constexpr auto out_of_range = concat("That number is not one of the choices or is out of range, please try again\n");
+        constexpr auto line_too_long = concat("That answer is too long, please try again\n");
+    }
+
+    constexpr std::string_view invalid_input_message(input::Error error)
+    {
+        switch (error)
+        {
+        case input::Error::empty:
+            return invalid_input::empty;
+        case input::Error::not_a_number:
+            return invalid_input::not_a_number;
+        case input::Error::out_of_range:
+            return invalid_input::out_of_range;
+        case input::Error::line_too_long:
+            return invalid_input::line_too_long;
+        default:
+            return {};
+        }
+    }
+
+
+    // Ages and heights are small, so their decimal text is precomputed too
+    // rather than formatted every time ConfirmInfo is shown
+    constexpr int decimal_count{ 1000 };
+
+    struct Decimal
+    {
+        char digits[4]{};
+        unsigned char length{};
+    };
+
+    constexpr std::array<Decimal, decimal_count> make_decimals()
+    {
+        std::array<Decimal, decimal_count> table{};
+
+        for (int value = 0; value < decimal_count; ++value)
+        {
+            Decimal& decimal = table[value];
+
+            int divisor = value >= 100 ? 100 : value >= 10 ? 10 : 1;
+
+            for (int remainder = value; divisor > 0; divisor /= 10)
+            {
+                decimal.digits[decimal.length++] = static_cast<char>('0' + remainder / divisor);
+                remainder %= divisor;
+            }
+        }
+
+        return table;
+    }
+
+    constexpr std::array<Decimal, decimal_count> decimals = make_decimals();
+
+    // Buffer for the rare value outside of the table, large enough for any int
+    using DecimalBuffer = std::array<char, 12>;
+
+    // The text of value, either from the table or written to buffer
+    std::string_view decimal(int value, DecimalBuffer& buffer)
+    {
+        if (value >= 0 && value < decimal_count)
+        {
+            const Decimal& decimal = decimals[value];
+            return { decimal.digits, decimal.length };
+        }
+
+        auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+        return { buffer.data(), static_cast<std::size_t>(result.ptr - buffer.data()) };
+    }
+}
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef RENDERER
+#define RENDERER
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <climits>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace render
+{
+    // Clearing the console by printing 100 newlines and then flushing after
+    // every line of a prompt costs several write syscalls and kilobytes of
+    // output per turn, which is very noticeable over a slow SSH or serial
+    // link. Instead, each prompt hands its whole screen to a display and
+    // the renderer sends only the lines that differ from the previous
+    // screen, using ANSI cursor control, in a single writev
+
+    // A screen is a list of byte ranges, mostly precompiled prompt text with
+    // the occasional runtime field in between, so nothing has to be copied
+    // or formatted to show one
+    using Screen = std::span<const iovec>;
+
+    inline iovec segment(std::string_view text)
+    {
+        return { const_cast<char*>(text.data()), text.size() };
+    }
+
+    // Where a session's screens go
+    class Display
+    {
+    public:
+
+        // Replaces whatever was shown before with the new screen
+        virtual void show(Screen screen) = 0;
+
+        virtual ~Display() = default;
+    };
+
+    // For sessions nobody is watching
+    class NullDisplay : public Display
+    {
+    public:
+
+        virtual void show(Screen) override {}
+    };
+
+
+    class Renderer : public Display
+    {
+    public:
+
+        explicit Renderer(int fd = STDOUT_FILENO);
+
+        Renderer(const Renderer&) = delete;
+        Renderer& operator=(const Renderer&) = delete;
+
+        // Sends the difference between this screen and the screen that was
+        // last shown to the terminal in a single writev
+        virtual void show(Screen screen) override;
+
+        // Forces the next screen to be redrawn completely, for example if
+        // something else has written to the terminal in the meantime
+        void invalidate() { full_redraw_ = true; }
+
+    private:
+
+        void end_line(std::size_t row);
+        void move_to_row(std::size_t row);
+        void add(std::string_view text);
+        void write_all();
+
+        int fd_{};
+
+        // Only a hash of each shown line is kept, which is enough to tell
+        // whether a line has to be sent again
+        std::vector<std::uint64_t> previous_;
+
+        // The pieces of the line currently being split out of the screen,
+        // a line can span several segments
+        std::vector<std::string_view> line_;
+        std::uint64_t line_hash_{};
+
+        // Everything one show sends, reused every turn
+        std::vector<iovec> out_;
+
+        bool full_redraw_{ true };
+    };
+
+
+    // The escape sequences the renderer needs are precomputed as well, so
+    // moving the cursor to a row is a table lookup rather than formatting
+    namespace ansi
+    {
+        constexpr std::string_view clear_screen{ "\x1b[H\x1b[2J" };
+        constexpr std::string_view erase_line{ "\x1b[K" };
+        constexpr std::string_view erase_below{ "\x1b[J" };
+
+        // Comfortably more rows than any terminal has
+        constexpr std::size_t row_count{ 256 };
+
+        struct MoveToRow
+        {
+            char bytes[12]{};
+            std::size_t length{};
+        };
+
+        constexpr std::array<MoveToRow, row_count> make_move_to_row()
+        {
+            std::array<MoveToRow, row_count> table{};
+
+            for (std::size_t row = 0; row < row_count; ++row)
+            {
+                MoveToRow& move = table[row];
+
+                move.bytes[move.length++] = '\x1b';
+                move.bytes[move.length++] = '[';
+
+                // ANSI rows are 1 based
+                std::size_t number = row + 1;
+                std::size_t divisor = number >= 100 ? 100 : number >= 10 ? 10 : 1;
+
+                for (; divisor > 0; divisor /= 10)
+                {
+                    move.bytes[move.length++] = static_cast<char>('0' + number / divisor % 10);
+                }
+
+                move.bytes[move.length++] = ';';
+                move.bytes[move.length++] = '1';
+                move.bytes[move.length++] = 'H';
+            }
+
+            return table;
+        }
+
+        constexpr std::array<MoveToRow, row_count> move_to_row = make_move_to_row();
+    }
+
+
+    // Renderer
+
+    // FNV-1a, lines are short so anything fancier isn't worth it
+    constexpr std::uint64_t hash_seed{ 14695981039346656037ull };
+
+    constexpr std::uint64_t hash(std::uint64_t value, std::string_view text)
+    {
+        for (char c : text)
+        {
+            value ^= static_cast<unsigned char>(c);
+            value *= 1099511628211ull;
+        }
+
+        return value;
+    }
+
+    Renderer::Renderer(int fd)
+        : fd_(fd)
+    {
+    }
+
+    void Renderer::show(Screen screen)
+    {
+        out_.clear();
+
+        if (full_redraw_)
+        {
+            add(ansi::clear_screen);
+        }
+
+        std::size_t row{};
+
+        line_.clear();
+        line_hash_ = hash_seed;
+
+        for (const iovec& piece : screen)
+        {
+            std::string_view text{ static_cast<const char*>(piece.iov_base), piece.iov_len };
+
+            while (!text.empty())
+            {
+                std::size_t end = text.find('\n');
+
+                if (end == std::string_view::npos)
+                {
+                    // The line continues in the next segment
+                    line_.push_back(text);
+                    line_hash_ = hash(line_hash_, text);
+                    break;
+                }
+
+                line_.push_back(text.substr(0, end));
+                line_hash_ = hash(line_hash_, text.substr(0, end));
+                text.remove_prefix(end + 1);
+
+                end_line(row++);
+            }
+        }
+
+        // A final line without a newline
+        if (!line_.empty())
+        {
+            end_line(row++);
+        }
+
+        previous_.resize(row);
+
+        // Leave the cursor below the screen for the user's answer and erase
+        // anything the previous screen had further down
+        move_to_row(row < ansi::row_count ? row : ansi::row_count - 1);
+        add(ansi::erase_below);
+
+        full_redraw_ = false;
+
+        write_all();
+    }
+
+    void Renderer::end_line(std::size_t row)
+    {
+        // Rows past the end of the previous screen include the one the user
+        // typed their last answer on, so they are always redrawn. Rows below
+        // the bottom of any real terminal are never drawn at all
+        bool changed = full_redraw_ || row >= previous_.size() || previous_[row] != line_hash_;
+
+        if (changed && row < ansi::row_count)
+        {
+            move_to_row(row);
+
+            for (std::string_view piece : line_)
+            {
+                add(piece);
+            }
+
+            // Erase whatever remains of a longer previous line
+            add(ansi::erase_line);
+        }
+
+        if (row < previous_.size())
+        {
+            previous_[row] = line_hash_;
+        }
+        else
+        {
+            previous_.push_back(line_hash_);
+        }
+
+        line_.clear();
+        line_hash_ = hash_seed;
+    }
+
+    void Renderer::move_to_row(std::size_t row)
+    {
+        const ansi::MoveToRow& move = ansi::move_to_row[row];
+        add({ move.bytes, move.length });
+    }
+
+    void Renderer::add(std::string_view text)
+    {
+        if (!text.empty())
+        {
+            out_.push_back(segment(text));
+        }
+    }
+
+    void Renderer::write_all()
+    {
+        iovec* pending = out_.data();
+        std::size_t count = out_.size();
+
+        // One syscall in practice, the loop only matters for partial writes
+        // to pipes and sockets, signals interrupting the write, or screens
+        // with more pieces than writev accepts at once
+        while (count > 0)
+        {
+            int batch = static_cast<int>(count < IOV_MAX ? count : IOV_MAX);
+            ssize_t written = ::writev(fd_, pending, batch);
+
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                // Nothing sensible to do if the terminal went away, the next
+                // screen is drawn from scratch in case it comes back
+                full_redraw_ = true;
+                return;
+            }
+
+            // Skip what was fully written and trim the piece that was not
+            std::size_t remaining = static_cast<std::size_t>(written);
+
+            while (count > 0 && remaining >= pending->iov_len)
+            {
+                remaining -= pending->iov_len;
+                ++pending;
+                --count;
+            }
+
+            if (count > 0)
+            {
+                pending->iov_base = static_cast<char*>(pending->iov_base) + remaining;
+                pending->iov_len -= remaining;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,672 @@
+#ifndef REPLAY
+#define REPLAY
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "renderer.h"
+#include "lineinput.h"
+#include "chatbot.h"
+#include "nosingleton.h"
+#include "trace.h"
+#include "transitionstats.h"
+#include "latency.h"
+#include "asynclog.h"
+#include "journal.h"
+
+namespace replay
+{
+    // Replays a transcript of scripted sessions through the chat bots as
+    // fast as they will go, as a regression benchmark for the state engine.
+    //
+    // A transcript is just the lines a user would have typed. Sessions are
+    // separated by a line containing only the separator below, and a session
+    // ends either when the bot finishes or when its lines run out
+    constexpr std::string_view separator{ "---" };
+
+    struct Result
+    {
+        std::uint64_t sessions{};
+        std::uint64_t turns{};
+        std::uint64_t transitions{};
+
+        // Hash of every screen shown, identical runs produce identical hashes
+        std::uint64_t output_hash{};
+
+        double seconds{};
+    };
+
+    // Hashes the screens so a change in output shows up, and otherwise
+    // discards them unless there's a display to pass them on to
+    class HashDisplay : public render::Display
+    {
+    public:
+
+        explicit HashDisplay(render::Display* forward = nullptr)
+            : forward_(forward)
+        {
+        }
+
+        virtual void show(render::Screen screen) override
+        {
+            for (const iovec& piece : screen)
+            {
+                hash_ = render::hash(hash_, { static_cast<const char*>(piece.iov_base), piece.iov_len });
+            }
+
+            if (forward_)
+            {
+                forward_->show(screen);
+            }
+        }
+
+        std::uint64_t hash() const { return hash_; }
+
+    private:
+
+        render::Display* forward_{};
+        std::uint64_t hash_{ render::hash_seed };
+    };
+
+    // Splits off the next session, keeping its newlines
+    std::string_view next_session(std::string_view& transcript)
+    {
+        std::size_t line{};
+
+        while (line < transcript.size())
+        {
+            std::size_t end = transcript.find('\n', line);
+
+            if (end == std::string_view::npos)
+            {
+                end = transcript.size();
+            }
+
+            if (transcript.substr(line, end - line) == separator)
+            {
+                std::string_view session = transcript.substr(0, line);
+                transcript.remove_prefix(end < transcript.size() ? end + 1 : end);
+                return session;
+            }
+
+            line = end + 1;
+        }
+
+        // The last session has no separator after it
+        return std::exchange(transcript, {});
+    }
+
+    // Runs one bot per session, Factory creates a bot given the display and
+    // input stream and is where the engine being measured is chosen. The
+    // screens are also shown on forward if there is one
+    template <typename Factory>
+    Result run(std::string_view transcript, Factory make_bot, render::Display* forward = nullptr)
+    {
+        Result result{};
+
+        HashDisplay display{ forward };
+        input::LineReader input{};
+
+        auto start = std::chrono::steady_clock::now();
+
+        while (!transcript.empty())
+        {
+            // The bot reads its lines straight out of the transcript and
+            // finishes by itself when they run out
+            input.reset(next_session(transcript));
+
+            auto bot = make_bot(display, input);
+
+            while (bot.running())
+            {
+                bot.prompt_user();
+                bot.process_input();
+                ++result.turns;
+            }
+
+            result.transitions += bot.transition_count();
+            ++result.sessions;
+        }
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.output_hash = display.hash();
+
+        return result;
+    }
+
+
+    // Replays the whole transcript on every one of thread_count threads at
+    // once, with all of their bots sharing the same states. Each thread's
+    // output has to come out identical to the others', a state that wasn't
+    // safe to share would show up as a differing hash (or as a race when
+    // built with -fsanitize=thread). Returns false if the hashes differ
+    template <typename Factory>
+    bool run_concurrent(std::string_view transcript, unsigned thread_count, Factory make_bot, Result& total,
+        render::Display* forward = nullptr)
+    {
+        std::vector<Result> results(thread_count);
+        std::vector<std::thread> threads;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (unsigned t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&results, t, transcript, &make_bot, forward]
+            {
+                results[t] = run(transcript, make_bot, forward);
+            });
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        total = {};
+        total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        total.output_hash = results.empty() ? 0 : results.front().output_hash;
+
+        bool identical{ true };
+
+        for (const Result& result : results)
+        {
+            total.sessions += result.sessions;
+            total.turns += result.turns;
+            total.transitions += result.transitions;
+            identical = identical && result.output_hash == total.output_hash;
+        }
+
+        return identical;
+    }
+
+
+    // Writes a transcript of the given number of sessions, cycling through
+    // a few different paths through the chat flow
+    void write_transcript(std::ostream& stream, std::uint64_t session_count)
+    {
+        for (std::uint64_t i = 0; i < session_count; ++i)
+        {
+            // Start, then add a patient
+            stream << "\n1\nPatient " << i << '\n' << i << " Main Street\n"
+                << 20 + i % 60 << '\n' << 150 + i % 50 << '\n';
+
+            switch (i % 4)
+            {
+            case 1:
+            {
+                // Edit every field before saving
+                stream << "1\n1\nEdited " << i << "\n2\n" << i << " Side Street\n"
+                    "3\n" << 30 + i % 50 << "\n4\n" << 160 + i % 40 << "\n5\n";
+                break;
+            }
+            case 2:
+            {
+                // Look at the edit menu without changing anything
+                stream << "1\n5\n";
+                break;
+            }
+            case 3:
+            {
+                // Save, then add a second patient
+                stream << "2\n1\nSecond " << i << "\nElsewhere\n50\n175\n";
+                break;
+            }
+            default:
+            {
+                break;
+            }
+            }
+
+            // Save, exit
+            stream << "2\n2\n";
+
+            if (i + 1 < session_count)
+            {
+                stream << separator << '\n';
+            }
+        }
+    }
+
+    bool generate(const std::string& path, std::uint64_t session_count)
+    {
+        std::ofstream file{ path, std::ios::binary };
+
+        if (!file)
+        {
+            std::cerr << "Error: could not write transcript " << path << std::endl;
+            return false;
+        }
+
+        write_transcript(file, session_count);
+        return true;
+    }
+
+    bool load(const std::string& path, std::string& transcript)
+    {
+        std::ifstream file{ path, std::ios::binary };
+
+        if (!file)
+        {
+            return false;
+        }
+
+        // One big read rather than a line at a time
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        transcript = std::move(contents).str();
+
+        return true;
+    }
+
+    void report(std::string_view engine, const Result& result)
+    {
+        std::cout << engine << ": " << result.sessions << " sessions, "
+            << result.turns << " turns, " << result.transitions << " transitions in "
+            << result.seconds << "s\n"
+            << "  " << result.sessions / result.seconds << " sessions/s, "
+            << result.transitions / result.seconds << " transitions/s\n"
+            << "  output hash: " << std::hex << result.output_hash << std::dec << std::endl;
+    }
+
+    // Replays the transcript through the requested engine, on more than
+    // one thread at once if asked to. Returns false if the transcript can't
+    // be read, the engine isn't known or the threads' output differed.
+    // forward, if given, is shown every screen and has to be safe to share
+    // between the threads
+    bool run_replay(const std::string& path, std::string_view engine, unsigned thread_count = 1,
+        render::Display* forward = nullptr)
+    {
+        std::string transcript;
+
+        if (!load(path, transcript))
+        {
+            std::cerr << "Error: could not read transcript " << path << std::endl;
+            return false;
+        }
+
+        auto replay = [&](auto make_bot)
+        {
+            if (thread_count <= 1)
+            {
+                report(engine, run(transcript, make_bot, forward));
+                return true;
+            }
+
+            Result total{};
+            bool identical = run_concurrent(transcript, thread_count, make_bot, total, forward);
+
+            report(engine, total);
+            std::cout << "  " << thread_count << " threads, output "
+                << (identical ? "identical on every thread" : "DIFFERS between threads") << std::endl;
+
+            return identical;
+        };
+
+        if (engine == "chat")
+        {
+            // The singletons are shared by every bot on every thread
+            return replay([](render::Display& display, input::LineReader& input)
+            {
+                return chat::ChatBot{ display, input };
+            });
+        }
+        else if (engine == "nosingleton")
+        {
+            // All sessions share one set of states, as they would in a server
+            nosingleton::StateSet state_set{};
+
+            return replay([&state_set](render::Display& display, input::LineReader& input)
+            {
+                return nosingleton::ChatBot{ &state_set, display, input };
+            });
+        }
+
+        std::cerr << "Error: unknown engine " << engine << std::endl;
+        return false;
+    }
+
+    // Replays the transcript once as usual and once with every transition
+    // traced to trace_path, so the cost of tracing shows in the rates
+    bool run_traced_replay(const std::string& path, const std::string& trace_path, std::string_view engine,
+        unsigned thread_count = 1)
+    {
+        if (!run_replay(path, engine, thread_count))
+        {
+            return false;
+        }
+
+        trace::Exporter exporter{ trace_path };
+
+        if (!exporter.is_open())
+        {
+            return false;
+        }
+
+        std::cout << "traced:" << std::endl;
+        bool replayed = run_replay(path, engine, thread_count);
+
+        exporter.stop();
+
+        std::cout << "  " << exporter.written() << " transitions written to " << trace_path << ", "
+            << exporter.dropped() << " dropped" << std::endl;
+
+        return replayed;
+    }
+
+    template <typename StateEnum, typename RequestEnum>
+    bool run_counted_replay(const std::string& path, std::string_view engine, unsigned thread_count,
+        StateEnum initial, std::span<const StateEnum> parents)
+    {
+        // Snapshots taken while the replay runs, as a monitoring thread in
+        // a server would, to show they neither stop nor slow the bots
+        std::atomic<bool> done{};
+        std::uint64_t snapshots{};
+        std::uint64_t last_total{};
+
+        std::thread monitor{ [&]
+        {
+            while (!done.load(std::memory_order_relaxed))
+            {
+                last_total = stats::Transitions<StateEnum>::snapshot().total();
+                ++snapshots;
+                std::this_thread::sleep_for(std::chrono::milliseconds{ 5 });
+            }
+        } };
+
+        bool replayed = run_replay(path, engine, thread_count);
+
+        done.store(true, std::memory_order_relaxed);
+        monitor.join();
+
+        std::cout << "  " << snapshots << " snapshots taken during the replay, the last counted "
+            << last_total << " transitions\n" << std::endl;
+
+        stats::write_transitions<StateEnum>(std::cout, initial, parents);
+        std::cout << std::endl;
+        stats::write_unhandled<StateEnum, RequestEnum>(std::cout);
+
+        return replayed;
+    }
+
+    // Replays the transcript with every handler timed, then shows the
+    // latency of each state and request pair
+    bool run_timed_replay(const std::string& path, std::string_view engine, unsigned thread_count = 1)
+    {
+        latency::enable(true);
+        bool replayed = run_replay(path, engine, thread_count);
+        latency::enable(false);
+
+        std::cout << std::endl;
+
+        if (engine == "chat")
+        {
+            latency::write_latencies<chat::StateName, chat::Request>(std::cout);
+        }
+        else if (engine == "nosingleton")
+        {
+            latency::write_latencies<nosingleton::StateName, nosingleton::Request>(std::cout);
+        }
+
+        return replayed;
+    }
+
+    // Writes every screen the moment it is shown, with a writev of its own
+    // on the thread showing it, which is what a session pays for its output
+    // without a Logger
+    class DirectDisplay : public render::Display
+    {
+    public:
+
+        explicit DirectDisplay(int fd)
+            : fd_(fd)
+        {
+        }
+
+        virtual void show(render::Screen screen) override
+        {
+            if (::writev(fd_, screen.data(), static_cast<int>(screen.size())) < 0)
+            {
+                failed_.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        bool failed() const { return failed_.load(std::memory_order_relaxed); }
+
+    private:
+
+        int fd_{};
+        std::atomic<bool> failed_{};
+    };
+
+    // Replays the transcript twice with every screen written to output_path,
+    // once straight from the bots' threads and once through a Logger, so
+    // the rates show what moving the writes off those threads saves. The
+    // hashes show the bots said the same both times
+    bool run_logged_replay(const std::string& path, const std::string& output_path, std::string_view engine,
+        unsigned thread_count = 1)
+    {
+        int fd = ::open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+        if (fd < 0)
+        {
+            std::cerr << "Error: could not create output file " << output_path << std::endl;
+            return false;
+        }
+
+        std::cout << "writing each screen from the bot's thread:" << std::endl;
+
+        DirectDisplay direct{ fd };
+        bool replayed = run_replay(path, engine, thread_count, &direct);
+
+        if (direct.failed())
+        {
+            std::cerr << "Error: could not write to " << output_path << std::endl;
+        }
+
+        if (replayed && ::ftruncate(fd, 0) == 0)
+        {
+            std::cout << "\nthrough a Logger:" << std::endl;
+
+            logging::Logger logger{};
+            logging::LogDisplay display{ logger, fd };
+
+            replayed = run_replay(path, engine, thread_count, &display);
+
+            auto start = std::chrono::steady_clock::now();
+            logger.stop();
+
+            std::cout << "  " << logger.messages() << " screens, " << logger.bytes() << " bytes in "
+                << logger.syscalls() << " writes, " << logger.dropped() << " written directly when the queue was full\n"
+                << "  writer finished " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                << "s after the last screen was queued" << std::endl;
+        }
+
+        ::close(fd);
+        return replayed;
+    }
+
+    // Makes each journaled request of a chat bot again. Bots are made by
+    // make_bot the first time their id comes up and forgotten once they
+    // finish. A line too long to read can't be made again, the bot only
+    // stayed where it was and said so on its next screen
+    template <typename Factory>
+    std::optional<journal::Recovery> rebuild(const std::string& directory, journal::Kind kind, render::Display& display,
+        Factory make_bot, std::uint64_t& sessions)
+    {
+        using Bot = decltype(make_bot(display, std::declval<input::LineReader&>()));
+
+        input::LineReader input{};
+        std::unordered_map<journal::MachineId, std::unique_ptr<Bot>> bots;
+
+        return journal::read(directory, [&](const journal::Entry& entry)
+        {
+            if (entry.kind != kind)
+            {
+                return;
+            }
+
+            std::unique_ptr<Bot>& bot = bots[entry.machine];
+
+            if (!bot || entry.event == journal::fresh_machine)
+            {
+                bot = std::make_unique<Bot>(make_bot(display, input));
+                ++sessions;
+            }
+
+            switch (static_cast<journal::ChatEvent>(entry.event))
+            {
+            case journal::ChatEvent::prompt_user:
+            {
+                bot->prompt_user();
+                break;
+            }
+            case journal::ChatEvent::process_input:
+            {
+                input.set_line(entry.payload);
+                bot->process_input();
+                break;
+            }
+            case journal::ChatEvent::end_of_input:
+            {
+                input.reset({});
+                bot->process_input();
+                break;
+            }
+            case journal::ChatEvent::line_too_long:
+            {
+                break;
+            }
+            }
+
+            if (!bot->running())
+            {
+                bots.erase(entry.machine);
+            }
+        });
+    }
+
+    // Replays the transcript once as usual and once with every request
+    // journaled to directory, so the cost of journaling shows in the rates,
+    // then rebuilds every session from the journal alone. The rebuilt bots
+    // have to show exactly the screens the journaled ones did
+    bool run_journaled_replay(const std::string& path, const std::string& directory, std::string_view engine)
+    {
+        if (engine != "chat" && engine != "nosingleton")
+        {
+            std::cerr << "Error: unknown engine " << engine << std::endl;
+            return false;
+        }
+
+        std::string transcript;
+
+        if (!load(path, transcript) || !run_replay(path, engine))
+        {
+            return false;
+        }
+
+        nosingleton::StateSet state_set{};
+
+        auto journaled = [&](auto make_bot, journal::Kind kind)
+        {
+            journal::remove(directory);
+
+            Result result{};
+
+            {
+                journal::Journal journal{ directory };
+
+                if (!journal.is_open())
+                {
+                    return false;
+                }
+
+                journal::MachineId next_id{};
+
+                result = run(transcript, [&](render::Display& display, input::LineReader& input)
+                {
+                    auto bot = make_bot(display, input);
+                    bot.attach_journal(&journal, next_id++);
+                    return bot;
+                });
+
+                journal.sync();
+
+                std::cout << "journaled:" << std::endl;
+                report(engine, result);
+                std::cout << "  " << journal.committed() << " records in " << journal.commits() << " commits, "
+                    << journal.committed() / result.seconds << " records/s, " << journal.lost() << " lost" << std::endl;
+            }
+
+            HashDisplay display{};
+            std::uint64_t sessions{};
+
+            auto start = std::chrono::steady_clock::now();
+            std::optional<journal::Recovery> recovery = rebuild(directory, kind, display, make_bot, sessions);
+
+            if (!recovery)
+            {
+                return false;
+            }
+
+            bool identical = display.hash() == result.output_hash;
+
+            std::cout << "rebuilt " << sessions << " sessions from " << recovery->records << " records in "
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s\n"
+                << "  output hash: " << std::hex << display.hash() << std::dec
+                << (identical ? ", identical" : ", DIFFERS from the journaled run") << std::endl;
+
+            return identical;
+        };
+
+        if (engine == "chat")
+        {
+            return journaled([](render::Display& display, input::LineReader& input)
+            {
+                return chat::ChatBot{ display, input };
+            }, journal::Kind::chat);
+        }
+
+        return journaled([&state_set](render::Display& display, input::LineReader& input)
+        {
+            return nosingleton::ChatBot{ &state_set, display, input };
+        }, journal::Kind::nosingleton);
+    }
+
+    // Replays the transcript and then lists how often each transition was
+    // made and each request went unhandled
+    bool run_counted_replay(const std::string& path, std::string_view engine, unsigned thread_count = 1)
+    {
+        if (engine == "chat")
+        {
+            return run_counted_replay<chat::StateName, chat::Request>(path, engine, thread_count,
+                chat::StateName::StartState, chat::state_parents);
+        }
+        else if (engine == "nosingleton")
+        {
+            return run_counted_replay<nosingleton::StateName, nosingleton::Request>(path, engine, thread_count,
+                nosingleton::StateName::StartState, {});
+        }
+
+        std::cerr << "Error: unknown engine " << engine << std::endl;
+        return false;
+    }
+}
+
+#endif
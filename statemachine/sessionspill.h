@@ -0,0 +1,393 @@
+#ifndef SESSIONSPILL
+#define SESSIONSPILL
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cassert>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "renderer.h"
+#include "lineinput.h"
+#include "nosingleton.h"
+
+namespace spill
+{
+    // A server keeps a bot per connected user, but most of them are sitting
+    // on a prompt at any given moment. Only a bounded number of sessions
+    // are kept as live bots here, the rest are saved to a memory mapped
+    // spill file and restored when their next line arrives. Restoring is a
+    // memcpy out of the page cache into a bot that is already constructed,
+    // so it stays in the microseconds as long as the file's pages are hot.
+    //
+    // Uses the nosingleton bots since every session shares one StateSet,
+    // which is also what makes a saved session restorable into any bot
+
+    using SessionId = std::uint32_t;
+
+    class SessionTable
+    {
+    public:
+
+        // The spill file is scratch space, it is truncated on open and has
+        // a fixed size slot for every session that can be opened
+        SessionTable(nosingleton::StateSet& state_set, render::Display& display, const std::string& spill_path,
+            std::size_t max_sessions, std::size_t max_resident);
+        ~SessionTable();
+
+        SessionTable(const SessionTable&) = delete;
+        SessionTable& operator=(const SessionTable&) = delete;
+
+        bool is_open() const { return base_ != nullptr; }
+
+        // Starts a session and shows its first screen, returns nothing once
+        // max_sessions have been opened
+        std::optional<SessionId> open();
+
+        // Runs one turn of the session with line as the user's answer,
+        // restoring the session first if it was evicted. Returns false once
+        // the session has finished
+        bool deliver(SessionId id, std::string_view line);
+
+        std::size_t resident_count() const { return resident_count_; }
+        std::size_t spilled_count() const { return spilled_count_; }
+
+        std::uint64_t restore_count() const { return restore_count_; }
+        std::uint64_t eviction_count() const { return eviction_count_; }
+
+        // Times every resident session was too big for a spill slot or in
+        // use, so a bot had to be kept over the limit
+        std::uint64_t overflow_count() const { return overflow_count_; }
+
+        // Holds a saved session, bigger ones are never evicted
+        static constexpr std::size_t slot_size{ 256 };
+
+    private:
+
+        enum class Where : std::uint8_t
+        {
+            resident,
+            spilled,
+            finished
+        };
+
+        struct Session
+        {
+            // Index into residents_ when resident, else the size of the
+            // saved session in the spill slot
+            std::uint32_t slot{};
+            Where where{ Where::finished };
+        };
+
+        struct Resident
+        {
+            std::optional<nosingleton::ChatBot> bot;
+            SessionId session{};
+
+            // Set on every turn and cleared as the clock hand passes, so
+            // only sessions that have been idle for a whole sweep go
+            bool referenced{};
+            bool in_use{};
+        };
+
+        std::span<std::byte> spill_slot(SessionId id)
+        {
+            return { base_ + std::size_t{ id } * slot_size, slot_size };
+        }
+
+        // Returns a free resident slot, evicting a session if there is none
+        std::uint32_t take_slot();
+        bool evict(std::uint32_t slot);
+        std::uint32_t restore(SessionId id);
+
+        nosingleton::StateSet& state_set_;
+        render::Display& display_;
+
+        // Every resident bot reads from this, it is handed each turn's line
+        input::LineReader input_{};
+
+        std::vector<Session> sessions_;
+        std::vector<Resident> residents_;
+        std::vector<std::uint32_t> free_slots_;
+        std::size_t max_resident_{};
+        std::size_t clock_hand_{};
+
+        std::size_t resident_count_{};
+        std::size_t spilled_count_{};
+        std::uint64_t restore_count_{};
+        std::uint64_t eviction_count_{};
+        std::uint64_t overflow_count_{};
+
+        int fd_{ -1 };
+        std::byte* base_{};
+        std::size_t capacity_{};
+    };
+
+
+    // SessionTable
+
+    SessionTable::SessionTable(nosingleton::StateSet& state_set, render::Display& display, const std::string& spill_path,
+        std::size_t max_sessions, std::size_t max_resident)
+        : state_set_(state_set)
+        , display_(display)
+        , max_resident_(max_resident > 0 ? max_resident : 1)
+    {
+        sessions_.reserve(max_sessions);
+        residents_.reserve(max_resident_);
+
+        fd_ = ::open(spill_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        capacity_ = max_sessions * slot_size;
+
+        // Sparse, only the slots of sessions that get evicted take up space
+        if (fd_ < 0 || capacity_ == 0 || ::ftruncate(fd_, static_cast<off_t>(capacity_)) != 0)
+        {
+            std::cerr << "Error: could not create spill file " << spill_path << std::endl;
+            return;
+        }
+
+        void* base = ::mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+        if (base == MAP_FAILED)
+        {
+            std::cerr << "Error: could not map spill file " << spill_path << std::endl;
+            return;
+        }
+
+        base_ = static_cast<std::byte*>(base);
+    }
+
+    SessionTable::~SessionTable()
+    {
+        // Nothing is flushed, the file is only valid while the table exists
+        if (base_)
+        {
+            ::munmap(base_, capacity_);
+        }
+
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+
+    std::optional<SessionId> SessionTable::open()
+    {
+        assert(base_);
+
+        // Every session has its spill slot from the start
+        if ((sessions_.size() + 1) * slot_size > capacity_)
+        {
+            return std::nullopt;
+        }
+
+        SessionId id = static_cast<SessionId>(sessions_.size());
+        sessions_.push_back({});
+
+        std::uint32_t slot = take_slot();
+        Resident& resident = residents_[slot];
+
+        // Replaces whatever session the slot held before
+        resident.bot.emplace(&state_set_, display_, input_);
+        resident.session = id;
+        resident.referenced = true;
+
+        sessions_[id] = { slot, Where::resident };
+
+        resident.bot->prompt_user();
+
+        return id;
+    }
+
+    bool SessionTable::deliver(SessionId id, std::string_view line)
+    {
+        assert(id < sessions_.size());
+        Session& session = sessions_[id];
+
+        if (session.where == Where::finished)
+        {
+            return false;
+        }
+
+        std::uint32_t slot = session.where == Where::spilled ? restore(id) : session.slot;
+
+        Resident& resident = residents_[slot];
+        resident.referenced = true;
+
+        nosingleton::ChatBot& bot = *resident.bot;
+
+        input_.set_line(line);
+        bot.process_input();
+
+        if (!bot.running())
+        {
+            // The bot itself is kept for the next session to reuse
+            resident.in_use = false;
+            free_slots_.push_back(slot);
+            --resident_count_;
+
+            session.where = Where::finished;
+            return false;
+        }
+
+        bot.prompt_user();
+        return true;
+    }
+
+    std::uint32_t SessionTable::take_slot()
+    {
+        if (!free_slots_.empty())
+        {
+            std::uint32_t slot = free_slots_.back();
+            free_slots_.pop_back();
+
+            residents_[slot].in_use = true;
+            ++resident_count_;
+            return slot;
+        }
+
+        if (residents_.size() < max_resident_)
+        {
+            residents_.emplace_back();
+            residents_.back().in_use = true;
+            ++resident_count_;
+            return static_cast<std::uint32_t>(residents_.size() - 1);
+        }
+
+        // Second chance clock. Two sweeps are enough to find any session
+        // that can be evicted, the first only clears referenced bits
+        for (std::size_t step = 0; step < 2 * residents_.size(); ++step)
+        {
+            std::uint32_t slot = static_cast<std::uint32_t>(clock_hand_);
+            clock_hand_ = (clock_hand_ + 1) % residents_.size();
+
+            Resident& resident = residents_[slot];
+
+            if (resident.referenced)
+            {
+                resident.referenced = false;
+                continue;
+            }
+
+            if (evict(slot))
+            {
+                resident.in_use = true;
+                ++resident_count_;
+                return slot;
+            }
+        }
+
+        // Nothing could be evicted, go over the limit rather than fail
+        ++overflow_count_;
+        residents_.emplace_back();
+        residents_.back().in_use = true;
+        ++resident_count_;
+        return static_cast<std::uint32_t>(residents_.size() - 1);
+    }
+
+    bool SessionTable::evict(std::uint32_t slot)
+    {
+        Resident& resident = residents_[slot];
+        assert(resident.in_use && resident.bot);
+
+        std::size_t size = resident.bot->save(spill_slot(resident.session));
+
+        if (size == 0)
+        {
+            return false;
+        }
+
+        sessions_[resident.session] = { static_cast<std::uint32_t>(size), Where::spilled };
+
+        resident.in_use = false;
+        --resident_count_;
+        ++spilled_count_;
+        ++eviction_count_;
+
+        return true;
+    }
+
+    std::uint32_t SessionTable::restore(SessionId id)
+    {
+        Session& session = sessions_[id];
+        assert(session.where == Where::spilled);
+
+        std::uint32_t slot = take_slot();
+        Resident& resident = residents_[slot];
+
+        if (!resident.bot)
+        {
+            resident.bot.emplace(&state_set_, display_, input_);
+        }
+
+        bool restored = resident.bot->restore(spill_slot(id).first(session.slot));
+        assert(restored);
+
+        resident.session = id;
+        session = { slot, Where::resident };
+
+        --spilled_count_;
+        ++restore_count_;
+
+        return slot;
+    }
+
+
+    // Opens sessions sessions, at most resident of them live at a time,
+    // and walks them all through the chat flow one turn each in turn, so
+    // nearly every turn has to restore a session and evict another
+    void run_spill_benchmark(const std::string& path, std::size_t session_count, std::size_t resident)
+    {
+        constexpr std::string_view script[]{ "", "1", "Jane Doe", "1 Main Street", "30", "180", "2", "2" };
+
+        nosingleton::StateSet state_set{};
+        render::NullDisplay display{};
+
+        SessionTable table{ state_set, display, path, session_count, resident };
+
+        if (!table.is_open())
+        {
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (std::size_t i = 0; i < session_count; ++i)
+        {
+            table.open();
+        }
+
+        std::size_t peak_spilled = table.spilled_count();
+        std::uint64_t turns{};
+
+        for (std::string_view line : script)
+        {
+            for (std::size_t i = 0; i < session_count; ++i)
+            {
+                table.deliver(static_cast<SessionId>(i), line);
+                ++turns;
+            }
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // Each turn here is a restore, an eviction and a turn of the bot
+        std::cout << session_count << " sessions, " << resident << " resident, "
+            << turns << " turns in " << seconds << "s\n"
+            << "  " << table.restore_count() << " restores, " << table.eviction_count() << " evictions, "
+            << table.overflow_count() << " over the limit, " << peak_spilled << " spilled at peak\n"
+            << "  " << seconds * 1e6 / turns << " us per turn" << std::endl;
+
+        ::unlink(path.c_str());
+    }
+}
+
+#endif
@@ -0,0 +1,534 @@
+#ifndef STATEMACHINE
+#define STATEMACHINE
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "trace.h"
+#include "transitionstats.h"
+
+namespace fsm
+{
+    // The book, chat and nosingleton examples each used to hand write the
+    // same plumbing: a context holding the current state, a private
+    // change_state that only the states may call, and forwarding functions
+    // that pass each request on to the current state. StateMachine is that
+    // plumbing written once. The states are named by an enum, which must
+    // end with a count entry, and how an enum value becomes the object
+    // that handles requests is left to one of the dispatch back ends below:
+    //
+    //   SingletonDispatch  one shared instance of each state for the whole
+    //                      process, the book's approach
+    //   TableDispatch      an array of states indexed by the enum, so a set
+    //                      of states can be shared by some machines and not
+    //                      others, the nosingleton approach
+    //   VariantDispatch    every machine holds its current state by value
+    //                      and requests are dispatched with a switch rather
+    //                      than a virtual call
+    //
+    // All three give a transition the same cost, storing a pointer or
+    // constructing a (usually empty) state object, and none of them
+    // allocates.
+    //
+    // States can optionally be nested in superstates, see Hierarchy, and
+    // requests can be queued so handlers can raise more of them, see
+    // RunToCompletion. Every transition is counted, see stats::Transitions,
+    // and can be traced, see trace::Exporter, for both of which the state
+    // enum needs a name function next to it
+
+    template <typename StateEnum>
+    constexpr std::size_t state_count{ static_cast<std::size_t>(StateEnum::count) };
+
+    template <typename StateEnum>
+    constexpr std::size_t index_of(StateEnum state)
+    {
+        return static_cast<std::size_t>(state);
+    }
+
+
+    // A machine without superstates or entry and exit actions
+    struct Flat
+    {
+    };
+
+    // The superstates that a transition leaves and enters, in the order
+    // their exit and entry actions run
+    template <typename StateEnum, std::size_t MaxDepth>
+    struct TransitionPath
+    {
+        std::uint8_t exit_count{};
+        std::uint8_t enter_count{};
+        std::array<StateEnum, MaxDepth> exits{};
+        std::array<StateEnum, MaxDepth> enters{};
+    };
+
+    // Parents gives the superstate of every state, or StateEnum::count for
+    // states at the top level. Superstates are states like any other as
+    // far as the enum and the dispatch back end are concerned, but a
+    // machine is only ever in a leaf state and never transitions to a
+    // superstate directly.
+    //
+    // Superstates have entry and exit actions, leaf states do their work
+    // in their handlers. A transition exits the superstates of the current
+    // state up to, but not including, the nearest one it shares with the
+    // target, then enters the target's superstates from there down. Those
+    // paths are worked out for every pair of states at compile time, so at
+    // runtime a transition between states in the same superstate costs
+    // exactly what a flat one does, and any other only adds its actions
+    template <typename StateEnum, const std::array<StateEnum, state_count<StateEnum>>& Parents, std::size_t MaxDepth = 4>
+    class Hierarchy
+    {
+    public:
+
+        using Path = TransitionPath<StateEnum, MaxDepth>;
+
+        static constexpr std::size_t count{ state_count<StateEnum> };
+
+        static constexpr bool is_superstate(StateEnum state)
+        {
+            for (StateEnum parent : Parents)
+            {
+                if (parent == state)
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        static constexpr const Path& path(StateEnum from, StateEnum to)
+        {
+            return paths_[index_of(from)][index_of(to)];
+        }
+
+    private:
+
+        // A state followed by its superstates, innermost first
+        struct Chain
+        {
+            std::array<StateEnum, MaxDepth> states{};
+            std::size_t length{};
+        };
+
+        static constexpr Chain chain(StateEnum state)
+        {
+            Chain result{};
+
+            while (state != StateEnum::count)
+            {
+                // Nested deeper than MaxDepth, or a cycle in Parents, stops
+                // compilation here
+                assert(result.length < MaxDepth);
+
+                result.states[result.length++] = state;
+                state = Parents[index_of(state)];
+            }
+
+            return result;
+        }
+
+        static constexpr Path make_path(StateEnum from, StateEnum to)
+        {
+            Chain leaving = chain(Parents[index_of(from)]);
+            Chain entering = chain(Parents[index_of(to)]);
+
+            // Index in each chain of the nearest common superstate
+            std::size_t leave_end{ leaving.length };
+            std::size_t enter_end{ entering.length };
+
+            for (std::size_t i = 0; i < leaving.length && leave_end == leaving.length; ++i)
+            {
+                for (std::size_t j = 0; j < entering.length; ++j)
+                {
+                    if (leaving.states[i] == entering.states[j])
+                    {
+                        leave_end = i;
+                        enter_end = j;
+                        break;
+                    }
+                }
+            }
+
+            Path path{};
+
+            for (std::size_t i = 0; i < leave_end; ++i)
+            {
+                path.exits[path.exit_count++] = leaving.states[i];
+            }
+
+            // Outermost first
+            for (std::size_t j = enter_end; j > 0; --j)
+            {
+                path.enters[path.enter_count++] = entering.states[j - 1];
+            }
+
+            return path;
+        }
+
+        static constexpr std::array<std::array<Path, count>, count> make_paths()
+        {
+            std::array<std::array<Path, count>, count> paths{};
+
+            for (std::size_t from = 0; from < count; ++from)
+            {
+                for (std::size_t to = 0; to < count; ++to)
+                {
+                    paths[from][to] = make_path(static_cast<StateEnum>(from), static_cast<StateEnum>(to));
+                }
+            }
+
+            return paths;
+        }
+
+        static constexpr std::array<std::array<Path, count>, count> paths_{ make_paths() };
+    };
+
+
+    template <typename Context, typename StateEnum, typename Dispatch, typename Nesting = Flat>
+    class StateMachine
+    {
+    public:
+
+        // Enters the initial state, which doesn't count as a transition and
+        // doesn't run entry actions. Any further arguments are passed on to
+        // the back end
+        template <typename... Args>
+        explicit StateMachine(StateEnum initial, Args&&... args)
+            : dispatch_(std::forward<Args>(args)...)
+            , state_(initial)
+        {
+            dispatch_.enter(initial);
+        }
+
+        StateEnum state() const { return state_; }
+
+        // Passes a request on to the current state. The handler is usually
+        // a pointer to a member function of the states, which is called
+        // with the context and any further arguments
+        template <typename Handler, typename... Args>
+        void dispatch(Context* context, Handler&& handler, Args&&... args)
+        {
+            assert(context);
+
+            dispatch_.visit([&](auto& state)
+            {
+                std::invoke(handler, state, context, std::forward<Args>(args)...);
+            });
+        }
+
+        void change_state(StateEnum next)
+        {
+            static_assert(std::is_same_v<Nesting, Flat>, "Entry and exit actions need the context");
+
+            assert(index_of(next) < state_count<StateEnum>);
+
+            record_transition(next);
+
+            ++transition_count_;
+            state_ = next;
+            dispatch_.enter(next);
+        }
+
+        // Runs the exit actions of the superstates being left and the entry
+        // actions of the superstates being entered, as on_exit and on_enter
+        // members of the states called with the context
+        void change_state(Context* context, StateEnum next)
+        {
+            assert(index_of(next) < state_count<StateEnum>);
+
+            if constexpr (std::is_same_v<Nesting, Flat>)
+            {
+                change_state(next);
+            }
+            else
+            {
+                assert(!Nesting::is_superstate(next));
+
+                const auto& path = Nesting::path(state_, next);
+
+                for (std::size_t i = 0; i < path.exit_count; ++i)
+                {
+                    dispatch_.visit_state(path.exits[i], [context](auto& state) { state.on_exit(context); });
+                }
+
+                record_transition(next);
+
+                ++transition_count_;
+                state_ = next;
+                dispatch_.enter(next);
+
+                for (std::size_t i = 0; i < path.enter_count; ++i)
+                {
+                    dispatch_.visit_state(path.enters[i], [context](auto& state) { state.on_enter(context); });
+                }
+            }
+        }
+
+        // Puts the machine in a state without it counting as a transition,
+        // for restoring a machine that was saved
+        void reset(StateEnum state, std::uint64_t transition_count = 0)
+        {
+            assert(index_of(state) < state_count<StateEnum>);
+
+            transition_count_ = transition_count;
+            state_ = state;
+            dispatch_.enter(state);
+        }
+
+        // Number of times a state has moved the machine to another state
+        std::uint64_t transition_count() const { return transition_count_; }
+
+    private:
+
+        void record_transition(StateEnum next) const
+        {
+            stats::Transitions<StateEnum>::add(state_, next);
+
+            // All that tracing costs while it is off
+            if (trace::enabled()) [[unlikely]]
+            {
+                trace::record(this, &trace::enum_name<StateEnum>,
+                    static_cast<std::uint16_t>(index_of(state_)), static_cast<std::uint16_t>(index_of(next)));
+            }
+        }
+
+        Dispatch dispatch_;
+        StateEnum state_{};
+        std::uint64_t transition_count_{};
+    };
+
+
+    // Each state is a singleton that instance returns
+    template <typename Base, typename StateEnum, Base* (*instance)(StateEnum)>
+    class SingletonDispatch
+    {
+    public:
+
+        void enter(StateEnum next)
+        {
+            current_ = instance(next);
+            assert(current_);
+        }
+
+        template <typename Visitor>
+        void visit(Visitor&& visitor) { visitor(*current_); }
+
+        // Any state, for superstates' entry and exit actions
+        template <typename Visitor>
+        void visit_state(StateEnum state, Visitor&& visitor) { visitor(*instance(state)); }
+
+    private:
+
+        Base* current_{};
+    };
+
+
+    // The states live in a table owned by something else, which has to
+    // outlive the machine
+    template <typename Base, typename StateEnum>
+    class TableDispatch
+    {
+    public:
+
+        using Table = std::array<Base*, state_count<StateEnum>>;
+
+        explicit TableDispatch(const Table& table)
+            : table_(&table)
+        {
+        }
+
+        void enter(StateEnum next)
+        {
+            current_ = (*table_)[index_of(next)];
+            assert(current_);
+        }
+
+        template <typename Visitor>
+        void visit(Visitor&& visitor) { visitor(*current_); }
+
+        template <typename Visitor>
+        void visit_state(StateEnum state, Visitor&& visitor) { visitor(*(*table_)[index_of(state)]); }
+
+    private:
+
+        const Table* table_{};
+        Base* current_{};
+    };
+
+
+    // States are listed in the same order as the enum. Entering a state
+    // constructs it afresh, so a state can keep data for as long as the
+    // machine stays in it. The states need not share a base class, but if
+    // they do and are declared final, requests reach them without a
+    // virtual call. Only the current state exists, so superstates with
+    // entry and exit actions can't be used with this back end
+    template <typename StateEnum, typename... States>
+    class VariantDispatch
+    {
+    public:
+
+        static_assert(sizeof...(States) == state_count<StateEnum>, "One state type per enum value");
+
+        void enter(StateEnum next)
+        {
+            if (visiting_)
+            {
+                // The handler that asked for the transition is still
+                // running on the current state object, so replacing it
+                // waits until the handler has returned
+                pending_ = next;
+                has_pending_ = true;
+                return;
+            }
+
+            emplace_state[index_of(next)](states_);
+        }
+
+        template <typename Visitor>
+        void visit(Visitor&& visitor)
+        {
+            visiting_ = true;
+            std::visit(visitor, states_);
+            visiting_ = false;
+
+            if (has_pending_)
+            {
+                has_pending_ = false;
+                emplace_state[index_of(pending_)](states_);
+            }
+        }
+
+    private:
+
+        using Variant = std::variant<States...>;
+        using Emplace = void (*)(Variant&);
+
+        template <std::size_t Index>
+        static void emplace(Variant& states)
+        {
+            states.template emplace<Index>();
+        }
+
+        // Turns the runtime enum into the compile time index emplace needs
+        template <std::size_t... Indices>
+        static constexpr std::array<Emplace, sizeof...(States)> make_emplace_table(std::index_sequence<Indices...>)
+        {
+            return { &emplace<Indices>... };
+        }
+
+        static constexpr std::array<Emplace, sizeof...(States)> emplace_state{
+            make_emplace_table(std::index_sequence_for<States...>{}) };
+
+        Variant states_;
+        StateEnum pending_{};
+        bool has_pending_{ false };
+        bool visiting_{ false };
+    };
+
+
+    // Fixed capacity ring buffer stored inline, so a machine that owns one
+    // never allocates for its events
+    template <typename Event, std::size_t Capacity>
+    class EventQueue
+    {
+    public:
+
+        static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+        // Returns false and drops the event if the queue is full
+        bool push(const Event& event)
+        {
+            if (size_ == Capacity)
+            {
+                ++dropped_;
+                return false;
+            }
+
+            events_[(head_ + size_) & (Capacity - 1)] = event;
+            ++size_;
+            return true;
+        }
+
+        bool pop(Event& event)
+        {
+            if (size_ == 0)
+            {
+                return false;
+            }
+
+            event = events_[head_];
+            head_ = (head_ + 1) & (Capacity - 1);
+            --size_;
+            return true;
+        }
+
+        bool empty() const { return size_ == 0; }
+        std::size_t size() const { return size_; }
+
+        // Events lost to a full queue since the queue was created
+        std::uint64_t dropped() const { return dropped_; }
+
+    private:
+
+        std::array<Event, Capacity> events_{};
+        std::size_t head_{};
+        std::size_t size_{};
+        std::uint64_t dropped_{};
+    };
+
+
+    // Run to completion: an event posted while the machine is already
+    // handling one is queued rather than handled there and then, and the
+    // queue is drained before the outermost post returns. Handlers can
+    // raise follow up events without re-entering the machine, and every
+    // event sees the state the previous one left behind
+    template <typename Event, std::size_t Capacity>
+    class RunToCompletion
+    {
+    public:
+
+        // Handles event, and everything raised while handling it, with
+        // handle. Returns false if the queue was full and the event dropped
+        template <typename Handle>
+        bool post(const Event& event, Handle&& handle)
+        {
+            if (!queue_.push(event))
+            {
+                return false;
+            }
+
+            if (running_)
+            {
+                return true;
+            }
+
+            running_ = true;
+
+            Event next{};
+
+            while (queue_.pop(next))
+            {
+                handle(next);
+            }
+
+            running_ = false;
+            return true;
+        }
+
+        std::uint64_t dropped() const { return queue_.dropped(); }
+
+    private:
+
+        EventQueue<Event, Capacity> queue_;
+        bool running_{ false };
+    };
+}
+
+#endif
@@ -0,0 +1,516 @@
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iterator>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <time.h>
+
+#include "bookexample.h"
+#include "chatbot.h"
+#include "nosingleton.h"
+#include "renderer.h"
+#include "lineinput.h"
+#include "perfcounters.h"
+#include "trace.h"
+#include "unhandled.h"
+
+// Times each state engine on its own, ns per transition and transitions
+// per second, for a scripted and a random stream of events spread over
+// 1, 1K and 1M machines. The scripted stream walks every machine through
+// the same loop of its states in lockstep, the random one sends a random
+// event to a random machine, which is where the branch predictor and the
+// cache stop helping. Built on its own, the same way as the demo
+//   g++ -std=c++20 -O2 statemachine_bench.cpp -o statemachine_bench
+//
+//   statemachine_bench [events per run] [trace file]
+//
+// Given a trace file, it also times the book's scripted stream with
+// tracing on against the same stream with it off.
+//
+// It then times chat's transitions with each state a function-local
+// static, the way instance() used to find them, against the constinit
+// states it uses now.
+//
+// Where the hardware counters can be read, each run also shows its
+// instructions per cycle and, per transition, cycles, instructions, L1d
+// and last level cache read misses and branch misses, which say why one
+// dispatch back end beats another at a given number of machines, not
+// just that it does
+
+namespace bench
+{
+	// Swallows whatever it is given, for output nobody needs to see
+	class NullBuffer : public std::streambuf
+	{
+	protected:
+
+		virtual int overflow(int c) override { return c; }
+		virtual std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+	};
+
+	struct Step
+	{
+		std::uint32_t machine{};
+		std::uint32_t event{};
+	};
+
+	// Every machine gets the script's events in order, one machine after
+	// the other, starting the script over when it runs out
+	std::vector<Step> scripted_stream(const std::vector<std::uint32_t>& script, std::size_t machines, std::size_t events)
+	{
+		std::vector<Step> stream;
+		stream.reserve(events);
+
+		for (std::size_t i = 0; i < events; ++i)
+		{
+			stream.push_back({ static_cast<std::uint32_t>(i % machines),
+				script[(i / machines) % script.size()] });
+		}
+
+		return stream;
+	}
+
+	std::vector<Step> random_stream(std::uint32_t alphabet, std::size_t machines, std::size_t events)
+	{
+		// Fixed seed, every run sees the same events
+		std::mt19937_64 random{ 42 };
+		std::uniform_int_distribution<std::uint32_t> machine(0, static_cast<std::uint32_t>(machines - 1));
+		std::uniform_int_distribution<std::uint32_t> event(0, alphabet - 1);
+
+		std::vector<Step> stream;
+		stream.reserve(events);
+
+		for (std::size_t i = 0; i < events; ++i)
+		{
+			std::uint32_t to = machine(random);
+			stream.push_back({ to, event(random) });
+		}
+
+		return stream;
+	}
+
+
+	// book::TCPConnection, the variant back end behind a run to completion
+	// event queue
+	class BookEngine
+	{
+	public:
+
+		explicit BookEngine(std::size_t machines)
+			: connections_(machines)
+		{
+			// The script loops through the states from Listen
+			for (book::TCPConnection& connection : connections_)
+			{
+				connection.passive_open();
+			}
+		}
+
+		static std::uint32_t alphabet() { return 7; }
+
+		// send, transmit, close, which goes through FinWait back to Listen
+		static std::vector<std::uint32_t> script() { return { 6, 0, 3 }; }
+
+		void step(Step step)
+		{
+			book::TCPConnection& connection = connections_[step.machine];
+
+			switch (step.event)
+			{
+			case 0: connection.transmit(null_stream_); break;
+			case 1: connection.active_open(); break;
+			case 2: connection.passive_open(); break;
+			case 3: connection.close(); break;
+			case 4: connection.synchronize(); break;
+			case 5: connection.acknowledge(); break;
+			default: connection.send(); break;
+			}
+		}
+
+		std::uint64_t transitions() const
+		{
+			std::uint64_t total{};
+
+			for (const book::TCPConnection& connection : connections_)
+			{
+				total += connection.transition_count();
+			}
+
+			return total;
+		}
+
+	private:
+
+		std::vector<book::TCPConnection> connections_;
+
+		NullBuffer null_buffer_{};
+		std::ostream null_stream_{ &null_buffer_ };
+	};
+
+
+	// The answers the chat bots are given, the script is a patient being
+	// added and saved from the main menu over and over
+	constexpr std::string_view chat_lines[]{ "", "1", "2", "Jane Doe", "1 Main Street", "30", "180", "x" };
+
+	// Drives either of the chat bots, every bot shows its screens to the
+	// same NullDisplay and reads from the same reader like SessionTable's.
+	// A bot that finishes is replaced by a new one, as a new session
+	template <typename Bot, typename MakeBot>
+	class ChatEngine
+	{
+	public:
+
+		ChatEngine(std::size_t machines, MakeBot make_bot)
+			: bots_(machines)
+			, make_bot_(make_bot)
+		{
+			for (std::optional<Bot>& bot : bots_)
+			{
+				make_bot_(bot, display_, input_);
+				bot->prompt_user();
+
+				// Past the welcome screen to the main menu
+				input_.set_line(chat_lines[0]);
+				bot->process_input();
+				bot->prompt_user();
+			}
+		}
+
+		static std::uint32_t alphabet() { return static_cast<std::uint32_t>(std::size(chat_lines)); }
+
+		static std::vector<std::uint32_t> script() { return { 1, 3, 4, 5, 6, 2 }; }
+
+		void step(Step step)
+		{
+			std::optional<Bot>& bot = bots_[step.machine];
+
+			input_.set_line(chat_lines[step.event]);
+			bot->process_input();
+
+			if (!bot->running())
+			{
+				finished_transitions_ += bot->transition_count();
+				make_bot_(bot, display_, input_);
+			}
+
+			bot->prompt_user();
+		}
+
+		std::uint64_t transitions() const
+		{
+			std::uint64_t total{ finished_transitions_ };
+
+			for (const std::optional<Bot>& bot : bots_)
+			{
+				total += bot->transition_count();
+			}
+
+			return total;
+		}
+
+	private:
+
+		render::NullDisplay display_{};
+		input::LineReader input_{};
+
+		std::vector<std::optional<Bot>> bots_;
+		MakeBot make_bot_;
+
+		std::uint64_t finished_transitions_{};
+	};
+
+	auto make_chat_engine(std::size_t machines)
+	{
+		auto make_bot = [](std::optional<chat::ChatBot>& bot, render::Display& display, input::LineReader& input)
+		{
+			bot.emplace(display, input);
+		};
+
+		return ChatEngine<chat::ChatBot, decltype(make_bot)>{ machines, make_bot };
+	}
+
+	auto make_nosingleton_engine(std::size_t machines, nosingleton::StateSet& state_set)
+	{
+		// Every bot shares the one StateSet
+		auto make_bot = [&state_set](std::optional<nosingleton::ChatBot>& bot, render::Display& display, input::LineReader& input)
+		{
+			bot.emplace(&state_set, display, input);
+		};
+
+		return ChatEngine<nosingleton::ChatBot, decltype(make_bot)>{ machines, make_bot };
+	}
+
+
+	// CPU time of the thread running the machines, so a background thread
+	// like the trace exporter doesn't count against them when it has to
+	// share a core
+	double thread_seconds()
+	{
+		timespec now{};
+		::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+		return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) * 1e-9;
+	}
+
+	void print_per_transition(const std::optional<std::uint64_t>& count, std::uint64_t transitions)
+	{
+		if (count && transitions > 0)
+		{
+			std::cout << std::setw(9) << static_cast<double>(*count) / static_cast<double>(transitions);
+		}
+		else
+		{
+			std::cout << std::setw(9) << "n/a";
+		}
+	}
+
+	template <typename Engine>
+	void run(std::string_view engine_name, std::string_view stream_name, Engine& engine,
+		const std::vector<Step>& stream, std::size_t machines, perf::Counters& counters)
+	{
+		std::uint64_t before = engine.transitions();
+
+		counters.start();
+		double start = thread_seconds();
+
+		for (const Step& step : stream)
+		{
+			engine.step(step);
+		}
+
+		double seconds = thread_seconds() - start;
+		perf::Counts counts = counters.stop();
+
+		std::uint64_t transitions = engine.transitions() - before;
+		double per_transition = transitions > 0 ? seconds * 1e9 / static_cast<double>(transitions) : 0.0;
+
+		std::cout << std::left << std::setw(22) << engine_name << std::setw(10) << stream_name
+			<< std::right << std::setw(9) << machines
+			<< std::setw(12) << transitions
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(10) << per_transition
+			<< std::setw(10) << (seconds > 0 ? static_cast<double>(transitions) / seconds / 1e6 : 0.0)
+			<< std::setw(10) << seconds * 1e9 / static_cast<double>(stream.size())
+			<< std::setprecision(2);
+
+		if (std::optional<double> ipc = counts.ipc())
+		{
+			std::cout << std::setw(7) << *ipc;
+		}
+		else
+		{
+			std::cout << std::setw(7) << "n/a";
+		}
+
+		std::cout << std::setprecision(1);
+		print_per_transition(counts[perf::Counter::cycles], transitions);
+		print_per_transition(counts[perf::Counter::instructions], transitions);
+
+		std::cout << std::setprecision(3);
+		print_per_transition(counts[perf::Counter::l1d_misses], transitions);
+		print_per_transition(counts[perf::Counter::llc_misses], transitions);
+		print_per_transition(counts[perf::Counter::branch_misses], transitions);
+
+		std::cout << std::defaultfloat << std::endl;
+	}
+
+	// The scripted book stream is the cheapest transition there is here, so
+	// it shows tracing's cost more plainly than any other
+	void run_trace_overhead(const std::string& trace_path, std::size_t events, perf::Counters& counters)
+	{
+		constexpr std::size_t machines{ 1000 };
+
+		{
+			BookEngine engine{ machines };
+			run("book untraced", "scripted", engine, scripted_stream(engine.script(), machines, events), machines, counters);
+		}
+
+		trace::Exporter exporter{ trace_path };
+
+		if (!exporter.is_open())
+		{
+			return;
+		}
+
+		{
+			BookEngine engine{ machines };
+			run("book traced", "scripted", engine, scripted_stream(engine.script(), machines, events), machines, counters);
+		}
+
+		exporter.stop();
+
+		std::cout << exporter.written() << " transitions written to " << trace_path << ", "
+			<< exporter.dropped() << " dropped when the exporter fell behind" << std::endl;
+	}
+
+	// The way chat's instance() used to find its state, a static inside a
+	// function, which checks an initialization guard on every call because
+	// the state's destructor has to be registered
+	template <typename ConcreteState>
+	chat::State* guarded_instance()
+	{
+		static ConcreteState state;
+		return &state;
+	}
+
+	chat::State* guarded_get_state(chat::StateName name)
+	{
+		using chat::StateName;
+
+		switch (name)
+		{
+		case StateName::StartState: return guarded_instance<chat::StartState>();
+		case StateName::MainMenuState: return guarded_instance<chat::MainMenuState>();
+		case StateName::CollectNameState: return guarded_instance<chat::CollectNameState>();
+		case StateName::CollectAddressState: return guarded_instance<chat::CollectAddressState>();
+		case StateName::CollectAgeState: return guarded_instance<chat::CollectAgeState>();
+		case StateName::CollectHeightState: return guarded_instance<chat::CollectHeightState>();
+		case StateName::EditNameState: return guarded_instance<chat::EditNameState>();
+		case StateName::EditAddressState: return guarded_instance<chat::EditAddressState>();
+		case StateName::EditAgeState: return guarded_instance<chat::EditAgeState>();
+		case StateName::EditHeightState: return guarded_instance<chat::EditHeightState>();
+		case StateName::ConfirmInfoState: return guarded_instance<chat::ConfirmInfoState>();
+		case StateName::EditOptionsState: return guarded_instance<chat::EditOptionsState>();
+		case StateName::FinishedState: return guarded_instance<chat::FinishedState>();
+		case StateName::PatientState: return guarded_instance<chat::PatientState>();
+		case StateName::EditingState: return guarded_instance<chat::EditingState>();
+		case StateName::count: break;
+		}
+
+		return nullptr;
+	}
+
+	// Only the transitions are timed, no handler is ever called
+	struct TransitionOnly
+	{
+	};
+
+	template <chat::State* (*Lookup)(chat::StateName)>
+	using LookupMachine = fsm::StateMachine<TransitionOnly, chat::StateName,
+		fsm::SingletonDispatch<chat::State, chat::StateName, Lookup>>;
+
+	// A session adding a patient and editing it, leaf states only
+	constexpr chat::StateName session_path[]{ chat::StateName::MainMenuState, chat::StateName::CollectNameState,
+		chat::StateName::CollectAddressState, chat::StateName::CollectAgeState, chat::StateName::CollectHeightState,
+		chat::StateName::ConfirmInfoState, chat::StateName::EditOptionsState, chat::StateName::EditNameState };
+
+	// Each change_state counts the transition, checks whether tracing is
+	// on and looks the next state up, as a session's transitions do
+	template <chat::State* (*Lookup)(chat::StateName)>
+	double time_change_state(std::size_t transitions)
+	{
+		LookupMachine<Lookup> machine{ chat::StateName::StartState };
+
+		// Read through a volatile so the path can't be folded into the loop
+		const chat::StateName* volatile path = session_path;
+
+		double start = thread_seconds();
+
+		for (std::size_t i = 0; i < transitions; ++i)
+		{
+			machine.change_state(path[i % std::size(session_path)]);
+		}
+
+		double seconds = thread_seconds() - start;
+
+		// Keeps the machine alive without printing it
+		volatile std::uint64_t sink = machine.transition_count();
+		(void)sink;
+
+		return seconds * 1e9 / static_cast<double>(transitions);
+	}
+
+	void run_singleton_lookup(std::size_t transitions)
+	{
+		double guarded_ns = time_change_state<&guarded_get_state>(transitions);
+		double constant_ns = time_change_state<&chat::get_state>(transitions);
+
+		std::cout << std::fixed << std::setprecision(2)
+			<< "chat change_state, " << transitions << " transitions\n"
+			<< "  static in instance(): " << guarded_ns << " ns/transition\n"
+			<< "  constinit state:      " << constant_ns << " ns/transition\n"
+			<< "  guard overhead:       " << guarded_ns - constant_ns << " ns/transition"
+			<< std::defaultfloat << std::endl;
+	}
+
+	// Builds a fresh set of machines for each stream so both start from
+	// the same place
+	template <typename MakeEngine>
+	void run_engine(std::string_view engine_name, MakeEngine make_engine, std::size_t events, perf::Counters& counters)
+	{
+		for (std::size_t machines : { std::size_t{ 1 }, std::size_t{ 1000 }, std::size_t{ 1000000 } })
+		{
+			{
+				auto engine = make_engine(machines);
+				run(engine_name, "scripted", engine, scripted_stream(engine.script(), machines, events), machines, counters);
+			}
+
+			{
+				auto engine = make_engine(machines);
+				run(engine_name, "random", engine, random_stream(engine.alphabet(), machines, events), machines, counters);
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::size_t events = argc >= 2 ? std::stoull(argv[1]) : 4000000;
+
+	// The random streams send the book plenty of requests its states don't
+	// handle, the first few of each are reported on std::cerr from the
+	// reporter's thread and the rest summed up when the bench is done
+	unhandled::Reporter reporter{ std::chrono::hours{ 1 } };
+
+	perf::Counters counters{};
+
+	std::cout << events << " events per run, hardware counters "
+		<< (counters.available() ? "available" : "not available") << "\n\n"
+		<< std::left << std::setw(22) << "engine" << std::setw(10) << "stream"
+		<< std::right << std::setw(9) << "machines" << std::setw(12) << "transitions"
+		<< std::setw(10) << "ns/trans" << std::setw(10) << "Mtrans/s" << std::setw(10) << "ns/event"
+		<< std::setw(7) << "IPC" << std::setw(9) << "cyc/tr" << std::setw(9) << "inst/tr"
+		<< std::setw(9) << "L1d/tr" << std::setw(9) << "LLC/tr" << std::setw(9) << "br/tr" << std::endl;
+
+	bench::run_engine("book (variant)", [](std::size_t machines)
+	{
+		return bench::BookEngine{ machines };
+	}, events, counters);
+
+	bench::run_engine("chat (singleton)", [](std::size_t machines)
+	{
+		return bench::make_chat_engine(machines);
+	}, events, counters);
+
+	nosingleton::StateSet state_set{};
+
+	bench::run_engine("nosingleton (table)", [&state_set](std::size_t machines)
+	{
+		return bench::make_nosingleton_engine(machines, state_set);
+	}, events, counters);
+
+	if (argc >= 3)
+	{
+		std::cout << std::endl;
+		bench::run_trace_overhead(argv[2], events, counters);
+	}
+
+	std::cout << std::endl;
+	bench::run_singleton_lookup(events);
+
+	// Summed over every run above, the random streams are what reach the
+	// unhandled requests
+	std::cout << "\nbook::TCPConnection\n";
+	stats::write_transitions<book::TCPStateName>(std::cout, book::TCPStateName::Closed);
+	std::cout << std::endl;
+	stats::write_unhandled<book::TCPStateName, book::TCPRequest>(std::cout);
+
+	return 0;
+}
@@ -2,12 +2,87 @@
 #define TCPEXAMPLE
 
 #include <iostream>
+#include <string_view>
 #include <cassert>
 
+#include "statemachine.h"
+#include "transitionstats.h"
+#include "unhandled.h"
+
 namespace tcp
 {
 	class TCPConnection;
 
+	// Names of the states, each of which is a singleton. The connection's
+	// state machine maps a name to its state with get_state
+	enum class TCPStateName
+	{
+		Established,
+		Listen,
+		Closed,
+		SynSent,
+		SynRecieved,
+		FinWait1,
+		FinWait2,
+		CloseWait,
+		Closing,
+		LastAck,
+		TimeWait,
+		count
+	};
+
+	// For traces and anything else that shows a state
+	constexpr std::string_view name(TCPStateName value)
+	{
+		switch (value)
+		{
+		case TCPStateName::Established: return "Established";
+		case TCPStateName::Listen: return "Listen";
+		case TCPStateName::Closed: return "Closed";
+		case TCPStateName::SynSent: return "SynSent";
+		case TCPStateName::SynRecieved: return "SynRecieved";
+		case TCPStateName::FinWait1: return "FinWait1";
+		case TCPStateName::FinWait2: return "FinWait2";
+		case TCPStateName::CloseWait: return "CloseWait";
+		case TCPStateName::Closing: return "Closing";
+		case TCPStateName::LastAck: return "LastAck";
+		case TCPStateName::TimeWait: return "TimeWait";
+		case TCPStateName::count: break;
+		}
+
+		return "";
+	}
+
+	// The requests a connection passes on to its state
+	enum class TCPRequest
+	{
+		transmit,
+		active_open,
+		passive_open,
+		close,
+		synchronize,
+		acknowledge,
+		send,
+		count
+	};
+
+	constexpr std::string_view name(TCPRequest value)
+	{
+		switch (value)
+		{
+		case TCPRequest::transmit: return "transmit";
+		case TCPRequest::active_open: return "active_open";
+		case TCPRequest::passive_open: return "passive_open";
+		case TCPRequest::close: return "close";
+		case TCPRequest::synchronize: return "synchronize";
+		case TCPRequest::acknowledge: return "acknowledge";
+		case TCPRequest::send: return "send";
+		case TCPRequest::count: break;
+		}
+
+		return "";
+	}
+
 	// Abstract base class of all states
 	class TCPState
 	{
@@ -36,7 +111,13 @@ namespace tcp
 
 	protected:
 
-		void change_state(TCPConnection* context, TCPState* state);
+		void change_state(TCPConnection* context, TCPStateName name);
+
+	private:
+
+		// What every default handler does, counts the request and reports
+		// it, see unhandled::Pairs
+		void not_handled(TCPConnection* context, TCPRequest request);
 	};
 
 	// The state destructor doesn't do anything in this case, but is required to
@@ -44,6 +125,8 @@ namespace tcp
 	TCPState::~TCPState() = default;
 
 
+	TCPState* get_state(TCPStateName name);
+
 	// The context which provides an interface for clients
 	class TCPConnection
 	{
@@ -52,42 +135,75 @@ namespace tcp
 		TCPConnection(bool is_server);
 
 		// The public interface that specifies the requests that can be made
-		// It does not implement requests, but forwards them to the active state
-		void transmit(std::ostream& stream) { current_state_->transmit(this, stream); };
-		void active_open() { current_state_->active_open(this); };
-		void passive_open() { current_state_->passive_open(this); };
-		void close() { current_state_->close(this); };
-		void synchronize() { current_state_->synchronize(this); };
-		void acknowledge() { current_state_->acknowledge(this); };
-		void send() { current_state_->send(this); };
+		// It does not implement requests, but forwards them to the active state.
+		// Each returns whether the state handled the request
+		unhandled::Status transmit(std::ostream& stream) { return request(&TCPState::transmit, stream); };
+		unhandled::Status active_open() { return request(&TCPState::active_open); };
+		unhandled::Status passive_open() { return request(&TCPState::passive_open); };
+		unhandled::Status close() { return request(&TCPState::close); };
+		unhandled::Status synchronize() { return request(&TCPState::synchronize); };
+		unhandled::Status acknowledge() { return request(&TCPState::acknowledge); };
+		unhandled::Status send() { return request(&TCPState::send); };
 
 		bool is_server() { return is_server_; };
 
+		// Number of times a state has moved the connection to another state
+		std::uint64_t transition_count() const { return machine_.transition_count(); }
+
+		// Puts the connection in a state without it counting as a
+		// transition, see graph::probe_tcp
+		void restore(TCPStateName state) { machine_.reset(state); }
+
+		TCPStateName state() const { return machine_.state(); }
+
 	private:
 
 		// To allow only states to access the change_state function
 		friend TCPState;
 
-		void change_state(TCPState* state)
+		// Counted and traced like every fsm::StateMachine transition
+		void change_state(TCPStateName name) { machine_.change_state(name); }
+
+		template <typename Handler, typename... Args>
+		unhandled::Status request(Handler handler, Args&... args)
 		{
-			assert(state);
+			unhandled_ = false;
+			machine_.dispatch(this, handler, args...);
 
-			current_state_ = state;
+			return unhandled_ ? unhandled::Status::unhandled : unhandled::Status::handled;
 		}
 
-		// This pointer does not maintain ownership of the state (no new/delete)
-		// it is only used to have a changeable reference to the current state
-		TCPState* current_state_{};
+		// The machine does not own the states (no new/delete), it only keeps
+		// a pointer to the current singleton
+		using Machine = fsm::StateMachine<TCPConnection, TCPStateName, fsm::SingletonDispatch<TCPState, TCPStateName, &get_state>>;
+
+		// Start in the closed state
+		Machine machine_{ TCPStateName::Closed };
 
 		bool is_server_{ false };
+
+		// Set by a default handler, see TCPState::not_handled
+		bool unhandled_{};
 	};
 
 	// Normally would define this in implementation file to avoid cyclic dependence
-	void TCPState::change_state(TCPConnection* context, TCPState* state)
+	void TCPState::change_state(TCPConnection* context, TCPStateName name)
 	{
 		assert(context);
 
-		context->change_state(state);
+		context->change_state(name);
+	}
+
+	void TCPState::not_handled(TCPConnection* context, TCPRequest request)
+	{
+		assert(context);
+
+		TCPStateName state = context->machine_.state();
+
+		stats::Unhandled<TCPStateName, TCPRequest>::add(state, request);
+		unhandled::Pairs<TCPStateName, TCPRequest>::report(state, request);
+
+		context->unhandled_ = true;
 	}
 
 
@@ -225,12 +341,12 @@ namespace tcp
 		assert(context);
 
 		// The example in the book simply transitions directly to Listen
-		//change_state(context, TCPListen::instance());
+		//change_state(context, TCPStateName::Listen);
 
 		// In a real connection there are several intermediate steps as mentioned
 		// "send FIN, recieve ACK of FIN"
 
-		change_state(context, TCPListen::instance());
+		change_state(context, TCPStateName::Listen);
 	}
 
 	// Listen
@@ -239,12 +355,12 @@ namespace tcp
 		assert(context);
 
 		// The example in the book simply transitions directly to Established
-		change_state(context, TCPEstablished::instance());
+		//change_state(context, TCPStateName::Established);
 
 		// In a real connection there are several intermediate steps as mentioned
 		// "send SYN, recieve SYN, ACK, etc."
 
-		change_state(context, TCPEstablished::instance());
+		change_state(context, TCPStateName::Established);
 	}
 
 	// Closed
@@ -253,12 +369,12 @@ namespace tcp
 		assert(context);
 
 		// The example in the book simply transitions directly to Established
-		change_state(context, TCPEstablished::instance());
+		//change_state(context, TCPStateName::Established);
 
 		// In a real connection there are several intermediate steps as mentioned
 		// "send SYN, recieve SYN, ACK, etc."
 
-		change_state(context, TCPEstablished::instance());
+		change_state(context, TCPStateName::Established);
 	}
 
 	void TCPClosed::passive_open(TCPConnection* context)
@@ -266,7 +382,7 @@ namespace tcp
 		assert(context);
 
 		// Transition to the listen state to prepare for establishing a connection
-		change_state(context, TCPListen::instance());
+		change_state(context, TCPStateName::Listen);
 	}
 
 
@@ -280,78 +396,100 @@ namespace tcp
 	TCPConnection::TCPConnection(bool is_server)
 		: is_server_(is_server)
 	{
-		// Start in the closed state
-		change_state(TCPClosed::instance());
 	}
 
 	// The static instance functions could be defined in the header
 	// or implementation files without causing cyclic dependency
 	// so the choice comes down to conventions
 
+	// Constant initialized at namespace scope, a static inside instance()
+	// would have a thread safe initialization guard to check on every call
+	constinit TCPEstablished established_state{};
+	constinit TCPListen listen_state{};
+	constinit TCPClosed closed_state{};
+	constinit TCPSynSent syn_sent_state{};
+	constinit TCPSynRecieved syn_recieved_state{};
+	constinit TCPFinWait1 fin_wait1_state{};
+	constinit TCPFinWait2 fin_wait2_state{};
+	constinit TCPCloseWait close_wait_state{};
+	constinit TCPClosing closing_state{};
+	constinit TCPLastAck last_ack_state{};
+	constinit TCPTimeWait time_wait_state{};
+
 	TCPState* TCPEstablished::instance()
 	{
-		static TCPEstablished state{};
-		return &state;
+		return &established_state;
 	}
 
 	TCPState* TCPListen::instance()
 	{
-		static TCPListen state{};
-		return &state;
+		return &listen_state;
 	}
 
 	TCPState* TCPClosed::instance()
 	{
-		static TCPClosed state{};
-		return &state;
+		return &closed_state;
 	}
 
 	TCPState* TCPSynSent::instance()
 	{
-		static TCPSynSent state{};
-		return &state;
+		return &syn_sent_state;
 	}
 
 	TCPState* TCPSynRecieved::instance()
 	{
-		static TCPSynRecieved state{};
-		return &state;
+		return &syn_recieved_state;
 	}
 
 	TCPState* TCPFinWait1::instance()
 	{
-		static TCPFinWait1 state{};
-		return &state;
+		return &fin_wait1_state;
 	}
 
 	TCPState* TCPFinWait2::instance()
 	{
-		static TCPFinWait2 state{};
-		return &state;
+		return &fin_wait2_state;
 	}
 
 	TCPState* TCPCloseWait::instance()
 	{
-		static TCPCloseWait state{};
-		return &state;
+		return &close_wait_state;
 	}
 
 	TCPState* TCPClosing::instance()
 	{
-		static TCPClosing state{};
-		return &state;
+		return &closing_state;
 	}
 
 	TCPState* TCPLastAck::instance()
 	{
-		static TCPLastAck state{};
-		return &state;
+		return &last_ack_state;
 	}
 
 	TCPState* TCPTimeWait::instance()
 	{
-		static TCPTimeWait state{};
-		return &state;
+		return &time_wait_state;
+	}
+
+	TCPState* get_state(TCPStateName name)
+	{
+		switch (name)
+		{
+		case TCPStateName::Established: return TCPEstablished::instance();
+		case TCPStateName::Listen: return TCPListen::instance();
+		case TCPStateName::Closed: return TCPClosed::instance();
+		case TCPStateName::SynSent: return TCPSynSent::instance();
+		case TCPStateName::SynRecieved: return TCPSynRecieved::instance();
+		case TCPStateName::FinWait1: return TCPFinWait1::instance();
+		case TCPStateName::FinWait2: return TCPFinWait2::instance();
+		case TCPStateName::CloseWait: return TCPCloseWait::instance();
+		case TCPStateName::Closing: return TCPClosing::instance();
+		case TCPStateName::LastAck: return TCPLastAck::instance();
+		case TCPStateName::TimeWait: return TCPTimeWait::instance();
+		case TCPStateName::count: break;
+		}
+
+		return nullptr;
 	}
 
 
@@ -359,37 +497,37 @@ namespace tcp
 
 	void TCPState::transmit(TCPConnection* context, std::ostream& stream)
 	{
-		std::cerr << "Error: current state does not implement TCPState::transmit" << std::endl;
+		not_handled(context, TCPRequest::transmit);
 	};
 
 	void TCPState::active_open(TCPConnection* context)
 	{
-		std::cerr << "Error: current state does not implement TCPState::active_open" << std::endl;
+		not_handled(context, TCPRequest::active_open);
 	};
 
 	void TCPState::passive_open(TCPConnection* context)
 	{
-		std::cerr << "Error: current state does not implement TCPState::passive_open" << std::endl;
+		not_handled(context, TCPRequest::passive_open);
 	};
 
 	void TCPState::close(TCPConnection* context)
 	{
-		std::cerr << "Error: current state does not implement TCPState::close" << std::endl;
+		not_handled(context, TCPRequest::close);
 	};
 
 	void TCPState::synchronize(TCPConnection* context)
 	{
-		std::cerr << "Error: current state does not implement TCPState::synchronize" << std::endl;
+		not_handled(context, TCPRequest::synchronize);
 	};
 
 	void TCPState::acknowledge(TCPConnection* context)
 	{
-		std::cerr << "Error: current state does not implement TCPState::acknowledge" << std::endl;
+		not_handled(context, TCPRequest::acknowledge);
 	};
 
 	void TCPState::send(TCPConnection* context)
 	{
-		std::cerr << "Error: current state does not implement TCPState::send" << std::endl;
+		not_handled(context, TCPRequest::send);
 	};
 }
 
@@ -0,0 +1,516 @@
+#ifndef TCPWORKLOAD
+#define TCPWORKLOAD
+
+#include <algorithm>
+#include <barrier>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "bookexample.h"
+#include "tcpexample.h"
+#include "transitionstats.h"
+#include "journal.h"
+
+namespace workload
+{
+    // Synthetic traffic for the TCP connections, for loading the engines
+    // roughly the way a server's connections would rather than with the
+    // bench's lockstep script or uniform noise. Each connection goes round
+    // its lifecycle: it is opened, actively or passively, transmits for a
+    // while once established, and then either closes, back to listening,
+    // or is aborted and replaced by a fresh connection. Which connection
+    // the next event goes to follows a Zipf distribution, so a few are
+    // busy and most are idle, and the busy ones are scattered rather than
+    // next to each other in memory.
+    //
+    // A Generator only ever sends a connection requests its current state
+    // handles, so nothing goes unhandled. Every thread has its own
+    // generator and its own connections, nothing is shared between them
+
+    struct Profile
+    {
+        // Connections on each thread
+        std::size_t connections{ 10000 };
+
+        // Skew of the popularity of connections, 0 for uniform and around
+        // 1 for the usual few busy and many idle
+        double zipf_exponent{ 1.0 };
+
+        // How many transmits a connection makes on average each time it is
+        // established
+        double mean_lifetime{ 20.0 };
+
+        // Share of opens that are active rather than passive
+        double active_open_share{ 0.5 };
+
+        // Share of lifetimes that end in an abort rather than a close
+        double abort_share{ 0.05 };
+    };
+
+    enum class Action : std::uint8_t
+    {
+        transmit,
+        active_open,
+        passive_open,
+        close,
+        send,
+
+        // The connection is dropped and a new one takes its place
+        abort
+    };
+
+    struct Step
+    {
+        std::uint32_t connection{};
+        Action action{};
+    };
+
+    // Ranks from 0, the most popular, to count - 1, by inverting the
+    // cumulative distribution with a binary search
+    class Zipf
+    {
+    public:
+
+        Zipf(std::size_t count, double exponent)
+            : cumulative_(count)
+        {
+            double total{};
+
+            for (std::size_t rank = 0; rank < count; ++rank)
+            {
+                total += 1.0 / std::pow(static_cast<double>(rank + 1), exponent);
+                cumulative_[rank] = total;
+            }
+
+            for (double& value : cumulative_)
+            {
+                value /= total;
+            }
+        }
+
+        std::size_t operator()(std::mt19937_64& random)
+        {
+            double u = std::uniform_real_distribution<double>{}(random);
+            auto rank = std::upper_bound(cumulative_.begin(), cumulative_.end(), u);
+
+            return std::min(static_cast<std::size_t>(rank - cumulative_.begin()), cumulative_.size() - 1);
+        }
+
+    private:
+
+        std::vector<double> cumulative_;
+    };
+
+    class Generator
+    {
+    public:
+
+        Generator(const Profile& profile, std::uint64_t seed);
+
+        Step next();
+
+        std::vector<Step> generate(std::size_t events)
+        {
+            std::vector<Step> steps;
+            steps.reserve(events);
+
+            for (std::size_t i = 0; i < events; ++i)
+            {
+                steps.push_back(next());
+            }
+
+            return steps;
+        }
+
+    private:
+
+        // Where the generator has taken each connection
+        enum class Phase : std::uint8_t
+        {
+            closed,
+            listening,
+            established
+        };
+
+        double uniform() { return std::uniform_real_distribution<double>{}(random_); }
+
+        Profile profile_;
+        std::mt19937_64 random_;
+        Zipf popularity_;
+
+        // The connection at each rank of popularity
+        std::vector<std::uint32_t> ranked_;
+        std::vector<Phase> phases_;
+    };
+
+    Generator::Generator(const Profile& profile, std::uint64_t seed)
+        : profile_(profile)
+        , random_(seed)
+        , popularity_(profile.connections, profile.zipf_exponent)
+        , ranked_(profile.connections)
+        , phases_(profile.connections, Phase::closed)
+    {
+        std::iota(ranked_.begin(), ranked_.end(), std::uint32_t{ 0 });
+        std::shuffle(ranked_.begin(), ranked_.end(), random_);
+    }
+
+    Step Generator::next()
+    {
+        std::uint32_t connection = ranked_[popularity_(random_)];
+        Phase& phase = phases_[connection];
+
+        switch (phase)
+        {
+        case Phase::closed:
+        {
+            if (uniform() < profile_.active_open_share)
+            {
+                phase = Phase::established;
+                return { connection, Action::active_open };
+            }
+
+            phase = Phase::listening;
+            return { connection, Action::passive_open };
+        }
+        case Phase::listening:
+        {
+            // The book's Listen goes to Established on send
+            phase = Phase::established;
+            return { connection, Action::send };
+        }
+        case Phase::established:
+        {
+            if (uniform() * profile_.mean_lifetime >= 1.0)
+            {
+                return { connection, Action::transmit };
+            }
+
+            if (uniform() < profile_.abort_share)
+            {
+                phase = Phase::closed;
+                return { connection, Action::abort };
+            }
+
+            // Closing goes back to listening on both engines
+            phase = Phase::listening;
+            return { connection, Action::close };
+        }
+        }
+
+        return { connection, Action::transmit };
+    }
+
+
+    // Applies steps to a thread's connections. Connection is any of the TCP
+    // connections with the book's requests, Make makes a fresh one
+    template <typename Connection, typename Make>
+    class Driver
+    {
+    public:
+
+        Driver(std::size_t connections, Make make)
+            : make_(make)
+        {
+            connections_.reserve(connections);
+
+            for (std::size_t i = 0; i < connections; ++i)
+            {
+                connections_.push_back(make_());
+            }
+        }
+
+        void step(Step step)
+        {
+            Connection& connection = connections_[step.connection];
+
+            switch (step.action)
+            {
+            case Action::transmit: connection.transmit(discard_); break;
+            case Action::active_open: connection.active_open(); break;
+            case Action::passive_open: connection.passive_open(); break;
+            case Action::close: connection.close(); break;
+            case Action::send: connection.send(); break;
+            case Action::abort:
+            {
+                connection = make_();
+
+                if (journal_)
+                {
+                    attach(step.connection);
+                    journal_->append(step.connection, journal::Kind::tcp, journal::fresh_machine);
+                }
+
+                break;
+            }
+            }
+        }
+
+        // Journals the requests made of every connection, each under its
+        // index, only the book's connections can be journaled
+        void attach_journal(journal::Journal* journal)
+        {
+            journal_ = journal;
+
+            for (std::size_t i = 0; i < connections_.size(); ++i)
+            {
+                attach(static_cast<journal::MachineId>(i));
+            }
+        }
+
+        const std::vector<Connection>& connections() const { return connections_; }
+
+    private:
+
+        void attach(journal::MachineId id)
+        {
+            if constexpr (requires { connections_[id].attach_journal(journal_, id); })
+            {
+                connections_[id].attach_journal(journal_, id);
+            }
+        }
+
+        Make make_;
+        std::vector<Connection> connections_;
+        journal::Journal* journal_{};
+
+        // Whatever is transmitted goes nowhere
+        std::ostream discard_{ nullptr };
+    };
+
+    auto make_book_driver(std::size_t connections)
+    {
+        auto make = [] { return book::TCPConnection{}; };
+        return Driver<book::TCPConnection, decltype(make)>{ connections, make };
+    }
+
+    auto make_tcp_driver(std::size_t connections)
+    {
+        auto make = [] { return tcp::TCPConnection{ true }; };
+        return Driver<tcp::TCPConnection, decltype(make)>{ connections, make };
+    }
+
+
+    // Each thread generates its own events and then, once every thread
+    // has, drives its own connections with them as fast as it can. The
+    // connections' states are named by StateEnum
+    template <typename StateEnum, typename MakeDriver>
+    void run_load(std::string_view engine, unsigned thread_count, std::size_t events, const Profile& profile,
+        MakeDriver make_driver)
+    {
+        std::uint64_t transitions_before = stats::Transitions<StateEnum>::snapshot().total();
+
+        std::vector<double> seconds(thread_count);
+        std::vector<std::thread> threads;
+        std::barrier ready{ static_cast<std::ptrdiff_t>(thread_count) };
+
+        for (unsigned t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&, t]
+            {
+                // A different but fixed seed on each thread
+                Generator generator{ profile, 42 + t };
+                std::vector<Step> steps = generator.generate(events);
+                auto driver = make_driver(profile.connections);
+
+                ready.arrive_and_wait();
+
+                auto start = std::chrono::steady_clock::now();
+
+                for (const Step& step : steps)
+                {
+                    driver.step(step);
+                }
+
+                seconds[t] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            });
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        double slowest = *std::max_element(seconds.begin(), seconds.end());
+        double total_events = static_cast<double>(events) * thread_count;
+
+        std::cout << engine << ": " << thread_count << " threads x " << events << " events, "
+            << profile.connections << " connections each, zipf " << profile.zipf_exponent
+            << ", lifetime " << profile.mean_lifetime << ", active opens " << profile.active_open_share
+            << ", aborts " << profile.abort_share << "\n";
+
+        for (unsigned t = 0; t < thread_count; ++t)
+        {
+            std::cout << "  thread " << t + 1 << ": " << static_cast<double>(events) / seconds[t] / 1e6 << " Mops/s\n";
+        }
+
+        std::cout << "  all threads: " << total_events / slowest / 1e6 << " Mops/s";
+
+        std::uint64_t transitions = stats::Transitions<StateEnum>::snapshot().total() - transitions_before;
+
+        std::cout << ", " << transitions << " transitions" << std::endl;
+    }
+
+    // Drives one thread's book connections with every request journaled to
+    // directory, then rebuilds the connections from the journal alone and
+    // checks they ended up in the same states. Every checkpoint_interval
+    // events each connection's state is journaled as a snapshot, and once
+    // that is durable the segments before it are truncated, so the journal
+    // stays a few segments long however long the run
+    bool run_journaled_load(const std::string& directory, std::size_t events, const Profile& profile,
+        std::size_t segment_size, std::size_t checkpoint_interval = 1 << 22)
+    {
+        journal::remove(directory);
+
+        Generator generator{ profile, 42 };
+        std::vector<Step> steps = generator.generate(events);
+        auto driver = make_book_driver(profile.connections);
+
+        std::uint64_t snapshots{};
+        std::size_t truncated{};
+        double seconds{};
+
+        {
+            journal::Journal journal{ directory, segment_size };
+
+            if (!journal.is_open())
+            {
+                return false;
+            }
+
+            driver.attach_journal(&journal);
+
+            auto start = std::chrono::steady_clock::now();
+
+            for (std::size_t i = 0; i < steps.size(); ++i)
+            {
+                driver.step(steps[i]);
+
+                if ((i + 1) % checkpoint_interval == 0)
+                {
+                    std::uint64_t segment = journal.segment();
+                    const std::vector<book::TCPConnection>& connections = driver.connections();
+
+                    for (std::size_t c = 0; c < connections.size(); ++c)
+                    {
+                        char state = static_cast<char>(connections[c].state());
+                        journal.append(static_cast<journal::MachineId>(c), journal::Kind::tcp, journal::snapshot, { &state, 1 });
+                    }
+
+                    snapshots += connections.size();
+
+                    // Everything before the snapshots has to stay until
+                    // they are on disk themselves
+                    journal.sync();
+                    truncated += journal.truncate(segment);
+                }
+            }
+
+            journal.sync();
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::cout << "book, journaled to " << directory << ": " << events << " events, "
+                << profile.connections << " connections, zipf " << profile.zipf_exponent << "\n"
+                << "  " << static_cast<double>(events) / seconds / 1e6 << " M events/s journaled and durable\n"
+                << "  " << journal.committed() << " records in " << journal.commits() << " commits, "
+                << journal.rotations() << " segments filled, " << truncated << " truncated, "
+                << snapshots << " snapshot records, " << journal.lost() << " lost" << std::endl;
+        }
+
+        // Rebuilt from the journal alone, as after a crash
+        std::vector<book::TCPConnection> rebuilt(profile.connections);
+        std::ostream discard{ nullptr };
+
+        // The oldest segment kept starts partway through the connections'
+        // histories, what it has before their snapshots is made of the
+        // wrong state and then overwritten, so isn't worth reporting
+        unhandled::Quiet quiet{};
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::optional<journal::Recovery> recovery = journal::read(directory, [&](const journal::Entry& entry)
+        {
+            if (entry.kind != journal::Kind::tcp || entry.machine >= rebuilt.size())
+            {
+                return;
+            }
+
+            book::TCPConnection& connection = rebuilt[entry.machine];
+
+            switch (entry.event)
+            {
+            case journal::fresh_machine: connection = book::TCPConnection{}; break;
+            case journal::snapshot: connection.restore(static_cast<book::TCPStateName>(entry.payload.at(0))); break;
+            case static_cast<std::uint8_t>(book::TCPRequest::transmit): connection.transmit(discard); break;
+            case static_cast<std::uint8_t>(book::TCPRequest::active_open): connection.active_open(); break;
+            case static_cast<std::uint8_t>(book::TCPRequest::passive_open): connection.passive_open(); break;
+            case static_cast<std::uint8_t>(book::TCPRequest::close): connection.close(); break;
+            case static_cast<std::uint8_t>(book::TCPRequest::synchronize): connection.synchronize(); break;
+            case static_cast<std::uint8_t>(book::TCPRequest::acknowledge): connection.acknowledge(); break;
+            case static_cast<std::uint8_t>(book::TCPRequest::send): connection.send(); break;
+            }
+        });
+
+        if (!recovery)
+        {
+            return false;
+        }
+
+        double rebuild_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::size_t differing{};
+
+        for (std::size_t c = 0; c < rebuilt.size(); ++c)
+        {
+            differing += rebuilt[c].state() != driver.connections()[c].state();
+        }
+
+        std::cout << "  rebuilt " << rebuilt.size() << " connections from " << recovery->records << " records in "
+            << recovery->segments << " segments in " << rebuild_seconds << "s, "
+            << (differing == 0 ? "all in the same state" : std::to_string(differing) + " in a different state")
+            << std::endl;
+
+        return differing == 0;
+    }
+
+    // The book's connection, holding its state by value, or the original
+    // tcp:: connection with a singleton per state. Both count their
+    // transitions the same way
+    bool run_tcp_load(std::string_view engine, unsigned thread_count, std::size_t events, const Profile& profile)
+    {
+        thread_count = std::max(thread_count, 1u);
+
+        if (engine == "book")
+        {
+            run_load<book::TCPStateName>(engine, thread_count, events, profile, [](std::size_t connections)
+            {
+                return make_book_driver(connections);
+            });
+        }
+        else if (engine == "tcp")
+        {
+            run_load<tcp::TCPStateName>(engine, thread_count, events, profile, [](std::size_t connections)
+            {
+                return make_tcp_driver(connections);
+            });
+        }
+        else
+        {
+            std::cerr << "Error: unknown engine " << engine << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,413 @@
+#ifndef TRACE
+#define TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace trace
+{
+    // Optional tracing of every transition a StateMachine makes, for seeing
+    // what the machines are doing under load. While it is off a transition
+    // pays for one load and a branch that is never taken. While it is on
+    // each transition copies a record into a ring that belongs to the
+    // thread making it, no locks and no allocation, and an Exporter thread
+    // empties the rings into a Chrome trace JSON file, which Perfetto's UI
+    // and chrome://tracing both open.
+    //
+    // The states and events a record holds are stored as small integers
+    // and only turned into names when the trace is written, by the name
+    // function declared next to each enum, e.g. chat::name(StateName)
+
+    using NameFn = std::string_view (*)(std::uint16_t);
+
+    template <typename Enum>
+    std::string_view enum_name(std::uint16_t value)
+    {
+        return name(static_cast<Enum>(value));
+    }
+
+    struct Record
+    {
+        std::uint64_t ticks{};
+        const void* machine{};
+        NameFn state_names{};
+        NameFn event_names{};
+        std::uint16_t from{};
+        std::uint16_t to{};
+        std::uint16_t event{};
+    };
+
+    // The request the thread is handling, so a transition can say what
+    // caused it. Set by the contexts, see EventScope
+    struct Event
+    {
+        NameFn names{};
+        std::uint16_t code{};
+    };
+
+    constinit thread_local Event current_event{};
+
+    bool enabled();
+
+    // Marks the request the thread is handling until the scope ends, only
+    // while tracing is on. Off, the thread local is never touched, the scope
+    // costs the same load and untaken branch as a transition and the exit
+    // only tests a flag of its own
+    template <typename Enum>
+    class EventScope
+    {
+    public:
+
+        explicit EventScope(Enum event)
+        {
+            if (enabled()) [[unlikely]]
+            {
+                previous_ = current_event;
+                current_event = { &enum_name<Enum>, static_cast<std::uint16_t>(event) };
+                marked_ = true;
+            }
+        }
+
+        ~EventScope()
+        {
+            if (marked_) [[unlikely]]
+            {
+                current_event = previous_;
+            }
+        }
+
+        EventScope(const EventScope&) = delete;
+        EventScope& operator=(const EventScope&) = delete;
+
+    private:
+
+        Event previous_{};
+        bool marked_{};
+    };
+
+
+    // Single producer, single consumer. The thread that owns the ring
+    // pushes and only the exporter drains, so neither ever waits for the
+    // other. A full ring drops the record rather than block the machine
+    class Ring
+    {
+    public:
+
+        static constexpr std::size_t capacity{ std::size_t{ 1 } << 15 };
+
+        explicit Ring(std::uint32_t thread)
+            : thread_(thread)
+        {
+        }
+
+        // Only from the thread that owns the ring. Returns the slot for the
+        // next record, or nothing if the ring is full, in which case the
+        // record is dropped without even reading the clock
+        Record* claim()
+        {
+            std::uint64_t head = head_.load(std::memory_order_relaxed);
+
+            if (head - tail_.load(std::memory_order_acquire) == capacity)
+            {
+                dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            return &records_[head & (capacity - 1)];
+        }
+
+        // Hands the claimed slot over to the exporter
+        void publish()
+        {
+            head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // Only from the exporter, hands every record pushed so far to visit
+        template <typename Visitor>
+        std::size_t drain(Visitor&& visit)
+        {
+            std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+            std::uint64_t head = head_.load(std::memory_order_acquire);
+
+            for (std::uint64_t i = tail; i != head; ++i)
+            {
+                visit(records_[i & (capacity - 1)]);
+            }
+
+            tail_.store(head, std::memory_order_release);
+
+            return static_cast<std::size_t>(head - tail);
+        }
+
+        std::uint32_t thread() const { return thread_; }
+        std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    private:
+
+        // Each index on its own cache line so the two threads don't fight
+        // over one
+        alignas(64) std::atomic<std::uint64_t> head_{};
+        alignas(64) std::atomic<std::uint64_t> tail_{};
+        alignas(64) std::atomic<std::uint64_t> dropped_{};
+
+        std::unique_ptr<Record[]> records_{ new Record[capacity] };
+        std::uint32_t thread_{};
+    };
+
+    // Every ring ever made, so the exporter can find them. A thread's ring
+    // is kept after the thread exits, which is fine for the long lived
+    // worker threads a server has
+    class Registry
+    {
+    public:
+
+        Ring* add()
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+
+            rings_.push_back(std::make_shared<Ring>(static_cast<std::uint32_t>(rings_.size() + 1)));
+            return rings_.back().get();
+        }
+
+        std::vector<std::shared_ptr<Ring>> rings()
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            return rings_;
+        }
+
+    private:
+
+        std::mutex mutex_;
+        std::vector<std::shared_ptr<Ring>> rings_;
+    };
+
+    Registry& registry()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    constinit std::atomic<bool> enabled_flag{};
+    constinit thread_local Ring* thread_ring{};
+
+    bool enabled()
+    {
+        return enabled_flag.load(std::memory_order_relaxed);
+    }
+
+    // Cheap and monotonic, converted to time when the trace is written
+    std::uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    // Times a few milliseconds of ticks against the steady clock the first
+    // time it is asked, not for anything on a hot path
+    double ns_per_tick()
+    {
+        static const double ns = []
+        {
+            auto clock_start = std::chrono::steady_clock::now();
+            std::uint64_t tick_start = ticks();
+
+            while (std::chrono::steady_clock::now() - clock_start < std::chrono::milliseconds{ 10 })
+            {
+            }
+
+            double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - clock_start).count();
+            return elapsed / static_cast<double>(ticks() - tick_start);
+        }();
+
+        return ns;
+    }
+
+    // Kept out of line so the machines only carry the call
+    [[gnu::noinline]] void record(const void* machine, NameFn state_names, std::uint16_t from, std::uint16_t to)
+    {
+        Ring* ring = thread_ring;
+
+        // The first transition the thread traces makes its ring
+        if (!ring)
+        {
+            ring = thread_ring = registry().add();
+        }
+
+        if (Record* slot = ring->claim())
+        {
+            *slot = { ticks(), machine, state_names, current_event.names, from, to, current_event.code };
+            ring->publish();
+        }
+    }
+
+
+    // Turns tracing on for as long as it exists, writing what is traced to
+    // a file as it goes. Only one at a time
+    class Exporter
+    {
+    public:
+
+        explicit Exporter(const std::string& path,
+            std::chrono::milliseconds interval = std::chrono::milliseconds{ 20 });
+        ~Exporter();
+
+        Exporter(const Exporter&) = delete;
+        Exporter& operator=(const Exporter&) = delete;
+
+        bool is_open() const { return out_.is_open(); }
+
+        // Turns tracing off and finishes the file, the destructor does the
+        // same if it hasn't been done
+        void stop();
+
+        // Final once stopped
+        std::uint64_t written() const { return written_; }
+
+        // Records lost to full rings, summed over every thread
+        std::uint64_t dropped() const;
+
+    private:
+
+        void run();
+        void drain();
+        void write(const Ring& ring, const Record& record);
+
+        std::ofstream out_;
+        std::chrono::milliseconds interval_{};
+
+        // For turning ticks into microseconds since the trace started
+        std::uint64_t start_ticks_{};
+        double us_per_tick_{};
+
+        std::vector<bool> named_threads_;
+        std::uint64_t written_{};
+
+        std::atomic<bool> stopping_{};
+        std::thread thread_;
+    };
+
+
+    // Exporter
+
+    Exporter::Exporter(const std::string& path, std::chrono::milliseconds interval)
+        : out_(path, std::ios::trunc)
+        , interval_(interval)
+    {
+        if (!out_)
+        {
+            std::cerr << "Error: could not create trace file " << path << std::endl;
+            return;
+        }
+
+        assert(!enabled());
+
+        us_per_tick_ = ns_per_tick() / 1000.0;
+        start_ticks_ = ticks();
+
+        out_ << std::fixed << std::setprecision(3)
+            << "{\"traceEvents\":[\n"
+            << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"statemachine\"}}";
+
+        enabled_flag.store(true, std::memory_order_relaxed);
+        thread_ = std::thread{ [this] { run(); } };
+    }
+
+    Exporter::~Exporter()
+    {
+        stop();
+    }
+
+    void Exporter::stop()
+    {
+        if (!thread_.joinable())
+        {
+            return;
+        }
+
+        enabled_flag.store(false, std::memory_order_relaxed);
+        stopping_.store(true, std::memory_order_relaxed);
+        thread_.join();
+
+        // Whatever was pushed before tracing stopped
+        drain();
+
+        out_ << "\n]}\n";
+    }
+
+    std::uint64_t Exporter::dropped() const
+    {
+        std::uint64_t total{};
+
+        for (const std::shared_ptr<Ring>& ring : registry().rings())
+        {
+            total += ring->dropped();
+        }
+
+        return total;
+    }
+
+    void Exporter::run()
+    {
+        while (!stopping_.load(std::memory_order_relaxed))
+        {
+            drain();
+            std::this_thread::sleep_for(interval_);
+        }
+    }
+
+    void Exporter::drain()
+    {
+        for (const std::shared_ptr<Ring>& ring : registry().rings())
+        {
+            written_ += ring->drain([this, &ring](const Record& record) { write(*ring, record); });
+        }
+
+        out_.flush();
+    }
+
+    void Exporter::write(const Ring& ring, const Record& record)
+    {
+        if (ring.thread() >= named_threads_.size() || !named_threads_[ring.thread()])
+        {
+            named_threads_.resize(std::max<std::size_t>(named_threads_.size(), ring.thread() + 1));
+            named_threads_[ring.thread()] = true;
+
+            out_ << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring.thread()
+                << ",\"args\":{\"name\":\"thread " << ring.thread() << "\"}}";
+        }
+
+        std::string_view from = record.state_names(record.from);
+        std::string_view to = record.state_names(record.to);
+
+        // A record from before tracing started can be a little early
+        double us = record.ticks > start_ticks_ ? static_cast<double>(record.ticks - start_ticks_) * us_per_tick_ : 0.0;
+
+        out_ << ",\n{\"name\":\"" << from << " -> " << to << "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << us
+            << ",\"pid\":1,\"tid\":" << ring.thread()
+            << ",\"args\":{\"machine\":\"" << record.machine << "\",\"from\":\"" << from << "\",\"to\":\"" << to
+            << "\",\"event\":\"" << (record.event_names ? record.event_names(record.event) : std::string_view{ "none" })
+            << "\"}}";
+    }
+}
+
+#endif
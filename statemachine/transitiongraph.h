@@ -0,0 +1,621 @@
+#ifndef TRANSITIONGRAPH
+#define TRANSITIONGRAPH
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bookexample.h"
+#include "tcpexample.h"
+#include "chatbot.h"
+#include "renderer.h"
+#include "lineinput.h"
+#include "replay.h"
+#include "tcpworkload.h"
+#include "transitionstats.h"
+#include "latency.h"
+#include "unhandled.h"
+
+namespace graph
+{
+    // Draws a machine's transition graph in Graphviz's DOT language, for
+    //   dot -Tsvg chat.dot -o chat.svg
+    //
+    // The edges aren't written down anywhere to go out of date. They are
+    // found by putting a throwaway machine in each state, sending it each
+    // request and seeing where the handler the dispatch back end picks
+    // takes it, so a state or handler that is added or filled in shows up
+    // the next time the graph is drawn. Probing counts into a Capture of
+    // its own and keeps quiet about unhandled requests, so the counts and
+    // reports of the machines that are really running aren't touched.
+    //
+    // Over that go what the running machines have done: edges are drawn
+    // thicker the more often they were taken, see stats::Transitions, and
+    // from green to red by how slow the handlers that take them are, see
+    // latency::Handlers, if latency was being timed. Once anything has run,
+    // edges nobody took are dashed red and states nothing entered are
+    // outlined red. States no edge reaches from the initial state are
+    // greyed out as unreachable
+
+    template <typename StateEnum, typename RequestEnum>
+    class Graph
+    {
+    public:
+
+        static_assert(stats::enum_count<RequestEnum> < 32, "A bit per request");
+
+        struct Edge
+        {
+            StateEnum from{};
+            StateEnum to{};
+
+            // A bit for every request that takes the edge
+            std::uint32_t requests{};
+
+            // What sends the machine along the edge, the request and the
+            // input that went with it
+            std::vector<std::string> labels;
+        };
+
+        void add(StateEnum from, StateEnum to, RequestEnum request, const std::string& label)
+        {
+            Edge* edge = find(from, to);
+
+            if (!edge)
+            {
+                edges_.push_back({ from, to });
+                edge = &edges_.back();
+            }
+
+            edge->requests |= std::uint32_t{ 1 } << static_cast<unsigned>(request);
+
+            if (!label.empty() && std::find(edge->labels.begin(), edge->labels.end(), label) == edge->labels.end())
+            {
+                edge->labels.push_back(label);
+            }
+        }
+
+        const Edge* find(StateEnum from, StateEnum to) const
+        {
+            for (const Edge& edge : edges_)
+            {
+                if (edge.from == from && edge.to == to)
+                {
+                    return &edge;
+                }
+            }
+
+            return nullptr;
+        }
+
+        Edge* find(StateEnum from, StateEnum to)
+        {
+            return const_cast<Edge*>(static_cast<const Graph*>(this)->find(from, to));
+        }
+
+        const std::vector<Edge>& edges() const { return edges_; }
+
+    private:
+
+        std::vector<Edge> edges_;
+    };
+
+    // Runs send, which makes one request of a machine it has put in from,
+    // and returns the states the request took the machine to from there.
+    // Anything raised and handled after the first transition is found by
+    // probing the state that handled it
+    template <typename StateEnum, typename RequestEnum, typename Send>
+    std::vector<StateEnum> probe(StateEnum from, Send&& send)
+    {
+        typename stats::Transitions<StateEnum>::Capture transitions{};
+        typename stats::Unhandled<StateEnum, RequestEnum>::Capture unhandled{};
+        unhandled::Quiet quiet{};
+
+        send();
+
+        typename stats::Transitions<StateEnum>::Snapshot snapshot = transitions.snapshot();
+        std::vector<StateEnum> targets;
+
+        for (std::size_t to = 0; to < stats::enum_count<StateEnum>; ++to)
+        {
+            if (snapshot.at(from, static_cast<StateEnum>(to)) > 0)
+            {
+                targets.push_back(static_cast<StateEnum>(to));
+            }
+        }
+
+        return targets;
+    }
+
+    template <typename StateEnum>
+    bool is_superstate(std::span<const StateEnum> parents, StateEnum state)
+    {
+        return std::find(parents.begin(), parents.end(), state) != parents.end();
+    }
+
+
+    // tcp::TCPConnection and book::TCPConnection take the same requests,
+    // every state is sent every one
+    template <typename Connection, typename RequestEnum>
+    void send(Connection& connection, RequestEnum request, std::ostream& stream)
+    {
+        switch (request)
+        {
+        case RequestEnum::transmit: connection.transmit(stream); break;
+        case RequestEnum::active_open: connection.active_open(); break;
+        case RequestEnum::passive_open: connection.passive_open(); break;
+        case RequestEnum::close: connection.close(); break;
+        case RequestEnum::synchronize: connection.synchronize(); break;
+        case RequestEnum::acknowledge: connection.acknowledge(); break;
+        case RequestEnum::send: connection.send(); break;
+        case RequestEnum::count: break;
+        }
+    }
+
+    // make makes a fresh connection to put in each state
+    template <typename StateEnum, typename RequestEnum, typename Make>
+    Graph<StateEnum, RequestEnum> probe_connection(Make make)
+    {
+        Graph<StateEnum, RequestEnum> graph{};
+
+        // Anything transmitted goes nowhere
+        std::ostream discard{ nullptr };
+
+        for (std::size_t from = 0; from < stats::enum_count<StateEnum>; ++from)
+        {
+            StateEnum state = static_cast<StateEnum>(from);
+
+            for (std::size_t r = 0; r < stats::enum_count<RequestEnum>; ++r)
+            {
+                RequestEnum request = static_cast<RequestEnum>(r);
+
+                std::vector<StateEnum> targets = probe<StateEnum, RequestEnum>(state, [&]
+                {
+                    auto connection = make();
+                    connection.restore(state);
+                    send(connection, request, discard);
+                });
+
+                for (StateEnum to : targets)
+                {
+                    graph.add(state, to, request, std::string{ name(request) });
+                }
+            }
+        }
+
+        return graph;
+    }
+
+    // The full set of TCP states, most of which have no handlers yet, so
+    // they show up unreachable until they are filled in
+    Graph<tcp::TCPStateName, tcp::TCPRequest> probe_tcp()
+    {
+        return probe_connection<tcp::TCPStateName, tcp::TCPRequest>([] { return tcp::TCPConnection{ true }; });
+    }
+
+    // The book's states, with FinWait, on the variant back end
+    Graph<book::TCPStateName, book::TCPRequest> probe_book()
+    {
+        return probe_connection<book::TCPStateName, book::TCPRequest>([] { return book::TCPConnection{}; });
+    }
+
+
+    // What a chat state's process_input is probed with, a bit of
+    // everything the states ask for, and the end of the input
+    constexpr std::string_view chat_inputs[]{ "", "0", "1", "2", "3", "4", "5", "6", "x", "Jane Doe", "30", "180", "999" };
+
+    Graph<chat::StateName, chat::Request> probe_chat()
+    {
+        using chat::StateName;
+        using chat::Request;
+
+        Graph<StateName, Request> graph{};
+
+        render::NullDisplay display{};
+        input::LineReader input{};
+
+        auto probe_bot = [&](StateName state, Request request)
+        {
+            return probe<StateName, Request>(state, [&]
+            {
+                chat::ChatBot bot{ display, input };
+                bot.restore(state);
+
+                if (request == Request::prompt_user)
+                {
+                    bot.prompt_user();
+                }
+                else
+                {
+                    bot.process_input();
+                }
+            });
+        };
+
+        for (std::size_t from = 0; from < stats::enum_count<StateName>; ++from)
+        {
+            StateName state = static_cast<StateName>(from);
+
+            // The bot is never in a superstate itself
+            if (is_superstate<StateName>(chat::state_parents, state))
+            {
+                continue;
+            }
+
+            for (StateName to : probe_bot(state, Request::prompt_user))
+            {
+                graph.add(state, to, Request::prompt_user, "prompt_user");
+            }
+
+            // Which of the lines lead to each state, named together so an
+            // edge any line takes doesn't list them all
+            std::vector<std::vector<std::string_view>> lines(stats::enum_count<StateName>);
+
+            for (std::string_view line : chat_inputs)
+            {
+                input.set_line(line);
+
+                for (StateName to : probe_bot(state, Request::process_input))
+                {
+                    lines[fsm::index_of(to)].push_back(line);
+                }
+            }
+
+            for (std::size_t to = 0; to < lines.size(); ++to)
+            {
+                if (lines[to].empty())
+                {
+                    continue;
+                }
+
+                std::string label{ "process_input" };
+
+                if (lines[to].size() == std::size(chat_inputs))
+                {
+                    label += " any line";
+                }
+                else
+                {
+                    for (std::string_view line : lines[to])
+                    {
+                        label += " \"";
+                        label += line;
+                        label += "\"";
+                    }
+                }
+
+                graph.add(state, static_cast<StateName>(to), Request::process_input, label);
+            }
+
+            input.reset({});
+
+            for (StateName to : probe_bot(state, Request::process_input))
+            {
+                graph.add(state, to, Request::process_input, "end of input");
+            }
+        }
+
+        return graph;
+    }
+
+
+    std::string escape(std::string_view text)
+    {
+        std::string escaped;
+
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+            }
+
+            escaped += c;
+        }
+
+        return escaped;
+    }
+
+    template <typename StateEnum>
+    void write_state(std::ostream& out, StateEnum state, std::string_view indent, bool reachable, bool entered)
+    {
+        out << indent << '"' << name(state) << '"';
+
+        if (!reachable)
+        {
+            out << " [style=\"rounded,filled\", fillcolor=grey85, fontcolor=grey40, xlabel=\"unreachable\"]";
+        }
+        else if (!entered)
+        {
+            out << " [color=red, penwidth=2]";
+        }
+
+        out << ";\n";
+    }
+
+    // Writes the states nested in superstate as a cluster inside it, and
+    // inside those the clusters of any superstates nested in it
+    template <typename StateEnum, typename WriteState>
+    void write_cluster(std::ostream& out, std::span<const StateEnum> parents, StateEnum superstate,
+        const std::string& indent, WriteState& write)
+    {
+        for (std::size_t i = 0; i < parents.size(); ++i)
+        {
+            if (parents[i] != superstate)
+            {
+                continue;
+            }
+
+            StateEnum state = static_cast<StateEnum>(i);
+
+            if (is_superstate(parents, state))
+            {
+                out << indent << "subgraph \"cluster_" << name(state) << "\" {\n"
+                    << indent << "    label=\"" << name(state) << "\";\n"
+                    << indent << "    style=rounded;\n";
+
+                write_cluster(out, parents, state, indent + "    ", write);
+
+                out << indent << "}\n";
+            }
+            else
+            {
+                write(state, indent);
+            }
+        }
+    }
+
+    // parents gives the superstate of each state like fsm::Hierarchy's,
+    // empty for a flat machine, and superstates are drawn as boxes around
+    // the states nested in them
+    template <typename StateEnum, typename RequestEnum>
+    void write_dot(std::ostream& out, std::string_view title, const Graph<StateEnum, RequestEnum>& probed,
+        StateEnum initial, std::span<const StateEnum> parents = {})
+    {
+        constexpr std::size_t state_count{ stats::enum_count<StateEnum> };
+
+        typename stats::Transitions<StateEnum>::Snapshot taken = stats::Transitions<StateEnum>::snapshot();
+        bool traffic = taken.total() > 0;
+
+        // Transitions something made that probing didn't find, because it
+        // depends on more than the state and the request
+        Graph<StateEnum, RequestEnum> graph{ probed };
+
+        for (std::size_t from = 0; from < state_count; ++from)
+        {
+            for (std::size_t to = 0; to < state_count; ++to)
+            {
+                if (taken.at(static_cast<StateEnum>(from), static_cast<StateEnum>(to)) > 0
+                    && !graph.find(static_cast<StateEnum>(from), static_cast<StateEnum>(to)))
+                {
+                    graph.add(static_cast<StateEnum>(from), static_cast<StateEnum>(to), RequestEnum::count, "not found by probing");
+                }
+            }
+        }
+
+        std::vector<bool> reachable(state_count);
+        std::vector<StateEnum> pending{ initial };
+        reachable[fsm::index_of(initial)] = true;
+
+        while (!pending.empty())
+        {
+            StateEnum state = pending.back();
+            pending.pop_back();
+
+            for (const auto& edge : graph.edges())
+            {
+                if (edge.from == state && !reachable[fsm::index_of(edge.to)])
+                {
+                    reachable[fsm::index_of(edge.to)] = true;
+                    pending.push_back(edge.to);
+                }
+            }
+        }
+
+        std::vector<bool> entered(state_count);
+        entered[fsm::index_of(initial)] = true;
+
+        for (std::size_t from = 0; from < state_count; ++from)
+        {
+            for (std::size_t to = 0; to < state_count; ++to)
+            {
+                if (taken.at(static_cast<StateEnum>(from), static_cast<StateEnum>(to)) > 0)
+                {
+                    entered[to] = true;
+                }
+            }
+        }
+
+        // The slowest median of the handlers that take an edge, in ns, 0 if
+        // nothing was timed
+        double ns_per_tick = trace::ns_per_tick();
+
+        auto edge_latency = [ns_per_tick](const auto& edge)
+        {
+            std::uint64_t slowest{};
+
+            for (std::size_t request = 0; request < stats::enum_count<RequestEnum>; ++request)
+            {
+                if (edge.requests & (std::uint32_t{ 1 } << request))
+                {
+                    slowest = std::max(slowest, latency::Handlers<StateEnum, RequestEnum>::snapshot(
+                        edge.from, static_cast<RequestEnum>(request)).percentile(0.5));
+                }
+            }
+
+            return static_cast<double>(slowest) * ns_per_tick;
+        };
+
+        std::uint64_t most_taken{};
+        double slowest{};
+
+        for (const auto& edge : graph.edges())
+        {
+            most_taken = std::max(most_taken, taken.at(edge.from, edge.to));
+            slowest = std::max(slowest, edge_latency(edge));
+        }
+
+        out << "digraph \"" << escape(title) << "\" {\n"
+            << "    rankdir=LR;\n"
+            << "    node [shape=box, style=rounded, fontname=\"Helvetica\"];\n"
+            << "    edge [fontname=\"Helvetica\", fontsize=10];\n"
+            << "    \"start\" [shape=point];\n"
+            << "    \"start\" -> \"" << name(initial) << "\";\n";
+
+        auto write = [&](StateEnum state, const std::string& indent)
+        {
+            write_state(out, state, indent, reachable[fsm::index_of(state)], entered[fsm::index_of(state)] || !traffic);
+        };
+
+        if (parents.empty())
+        {
+            for (std::size_t state = 0; state < state_count; ++state)
+            {
+                write(static_cast<StateEnum>(state), "    ");
+            }
+        }
+        else
+        {
+            // States at the top level have the end of the enum as parent
+            write_cluster(out, parents, StateEnum::count, std::string{ "    " }, write);
+        }
+
+        out << std::fixed;
+
+        for (const auto& edge : graph.edges())
+        {
+            std::uint64_t count = taken.at(edge.from, edge.to);
+            double ns = edge_latency(edge);
+
+            std::string label;
+
+            for (const std::string& part : edge.labels)
+            {
+                label += (label.empty() ? "" : "\\n") + escape(part);
+            }
+
+            out << "    \"" << name(edge.from) << "\" -> \"" << name(edge.to) << "\" [label=\"" << label;
+
+            if (count > 0)
+            {
+                out << "\\n" << count << "x";
+
+                if (ns > 0)
+                {
+                    out << ", p50 " << std::setprecision(0) << ns << " ns";
+                }
+
+                // Thickness grows with the log of the count, so the rare
+                // edges stay visible next to the hot ones
+                double width = 1.0 + 5.0 * std::log(static_cast<double>(count) + 1.0)
+                    / std::log(static_cast<double>(most_taken) + 1.0);
+
+                out << "\", penwidth=" << std::setprecision(2) << width;
+
+                if (slowest > 0)
+                {
+                    // Hue from green for the fastest to red for the slowest
+                    out << ", color=\"" << std::setprecision(3) << 0.333 * (1.0 - ns / slowest) << " 0.85 0.8\"";
+                }
+            }
+            else if (traffic)
+            {
+                out << "\\nnever taken\", style=dashed, color=red, fontcolor=red";
+            }
+            else
+            {
+                out << "\"";
+            }
+
+            out << "];\n";
+        }
+
+        out << std::defaultfloat << "}\n";
+    }
+
+
+    // Sends events from a workload::Generator to connections from
+    // make_driver, so the graph of a TCP machine has traffic to show
+    template <typename MakeDriver>
+    void run_tcp_events(const std::string& load, MakeDriver make_driver)
+    {
+        std::uint64_t events = load.empty() ? 100000 : std::stoull(load);
+
+        workload::Profile profile{};
+        profile.connections = 1000;
+
+        workload::Generator generator{ profile, 42 };
+        auto driver = make_driver(profile.connections);
+
+        for (std::uint64_t i = 0; i < events; ++i)
+        {
+            driver.step(generator.next());
+        }
+    }
+
+    // Runs a workload through the machine so the graph has something to
+    // show, then probes it and writes the graph to path. The chat bots
+    // replay a transcript if one is given, the TCP connections, tcp:: or
+    // the book's, are sent events from a workload::Generator
+    bool run_dot_export(std::string_view machine, const std::string& path, const std::string& load)
+    {
+        std::ofstream out{ path, std::ios::trunc };
+
+        if (!out)
+        {
+            std::cerr << "Error: could not create " << path << std::endl;
+            return false;
+        }
+
+        latency::enable(true);
+
+        if (machine == "tcp")
+        {
+            run_tcp_events(load, [](std::size_t connections) { return workload::make_tcp_driver(connections); });
+            latency::enable(false);
+
+            write_dot(out, "tcp", probe_tcp(), tcp::TCPStateName::Closed);
+        }
+        else if (machine == "book")
+        {
+            run_tcp_events(load, [](std::size_t connections) { return workload::make_book_driver(connections); });
+            latency::enable(false);
+
+            write_dot(out, "book", probe_book(), book::TCPStateName::Closed);
+        }
+        else if (machine == "chat")
+        {
+            if (!load.empty() && !replay::run_replay(load, "chat"))
+            {
+                latency::enable(false);
+                return false;
+            }
+
+            latency::enable(false);
+
+            write_dot<chat::StateName, chat::Request>(out, "chat", probe_chat(), chat::StateName::StartState,
+                chat::state_parents);
+        }
+        else
+        {
+            latency::enable(false);
+
+            std::cerr << "Error: unknown machine " << machine << std::endl;
+            return false;
+        }
+
+        std::cout << "Graph written to " << path << std::endl;
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef TRANSITIONSTATS
+#define TRANSITIONSTATS
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace stats
+{
+    // How often every machine makes each transition and is sent each request
+    // its current state doesn't handle, counted all the time. The hot
+    // transitions are the ones worth optimizing and the ones never taken
+    // are candidates for deleting.
+    //
+    // Every thread counts into its own block of counters, a cache line
+    // aligned copy of the whole matrix, so counting is an increment with no
+    // atomic read-modify-write and no line shared with another thread, see
+    // PerThread. snapshot sums the blocks while the threads carry on
+    // counting, which can miss an increment that is in flight but never
+    // blocks anyone.
+    //
+    // Rows and columns are enums ending in count, named by the name function
+    // declared next to them like trace uses
+
+    template <typename Enum>
+    constexpr std::size_t enum_count{ static_cast<std::size_t>(Enum::count) };
+
+    // A Block for every thread that uses one, only ever written by that
+    // thread. Blocks are kept after their thread exits so what it recorded
+    // still adds up
+    template <typename Block>
+    class PerThread
+    {
+    public:
+
+        static Block& local()
+        {
+            // The first use on a thread gives it a block
+            if (!block_) [[unlikely]]
+            {
+                block_ = add();
+            }
+
+            return *block_;
+        }
+
+        // Visits every block while their threads carry on writing them
+        template <typename Visitor>
+        static void for_each(Visitor&& visit)
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+
+            for (const std::unique_ptr<Block>& block : blocks_)
+            {
+                visit(static_cast<const Block&>(*block));
+            }
+        }
+
+        // Points the calling thread's writes at a block of the caller's
+        // own until the scope ends, so for_each never sees them
+        class Redirect
+        {
+        public:
+
+            explicit Redirect(Block& block)
+                : previous_(std::exchange(block_, &block))
+            {
+            }
+
+            ~Redirect() { block_ = previous_; }
+
+            Redirect(const Redirect&) = delete;
+            Redirect& operator=(const Redirect&) = delete;
+
+        private:
+
+            Block* previous_{};
+        };
+
+    private:
+
+        static Block* add()
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+
+            blocks_.push_back(std::make_unique<Block>());
+            return blocks_.back().get();
+        }
+
+        static inline constinit thread_local Block* block_{};
+
+        static inline std::mutex mutex_;
+        static inline std::vector<std::unique_ptr<Block>> blocks_;
+    };
+
+    // Only the owning thread writes a counter, readers only need a value
+    // that isn't torn, so no read-modify-write is needed
+    void increment(std::atomic<std::uint64_t>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    template <typename Row, typename Column>
+    class CountMatrix
+    {
+    public:
+
+        static constexpr std::size_t rows{ enum_count<Row> };
+        static constexpr std::size_t columns{ enum_count<Column> };
+
+        class Snapshot
+        {
+        public:
+
+            std::uint64_t at(Row row, Column column) const { return counts_[index(row, column)]; }
+
+            std::uint64_t total() const
+            {
+                std::uint64_t sum{};
+
+                for (std::uint64_t count : counts_)
+                {
+                    sum += count;
+                }
+
+                return sum;
+            }
+
+        private:
+
+            friend CountMatrix;
+
+            std::array<std::uint64_t, rows * columns> counts_{};
+        };
+
+        // Counts on the calling thread's block
+        static void add(Row row, Column column)
+        {
+            increment(Blocks::local().counts[index(row, column)]);
+        }
+
+        static Snapshot snapshot();
+
+    private:
+
+        struct alignas(64) Block
+        {
+            std::array<std::atomic<std::uint64_t>, rows * columns> counts{};
+        };
+
+        static constexpr std::size_t index(Row row, Column column)
+        {
+            return static_cast<std::size_t>(row) * columns + static_cast<std::size_t>(column);
+        }
+
+        using Blocks = PerThread<Block>;
+
+        static void add_block(Snapshot& snapshot, const Block& block)
+        {
+            for (std::size_t i = 0; i < rows * columns; ++i)
+            {
+                snapshot.counts_[i] += block.counts[i].load(std::memory_order_relaxed);
+            }
+        }
+
+    public:
+
+        // Counts what the calling thread adds while it exists into a matrix
+        // of its own rather than the totals, for work that shouldn't show up
+        // in them, like finding out which transitions a machine can make
+        class Capture
+        {
+        public:
+
+            Capture() = default;
+
+            Capture(const Capture&) = delete;
+            Capture& operator=(const Capture&) = delete;
+
+            Snapshot snapshot() const
+            {
+                Snapshot snapshot{};
+                add_block(snapshot, block_);
+
+                return snapshot;
+            }
+
+        private:
+
+            Block block_{};
+            typename Blocks::Redirect redirect_{ block_ };
+        };
+    };
+
+    template <typename Row, typename Column>
+    typename CountMatrix<Row, Column>::Snapshot CountMatrix<Row, Column>::snapshot()
+    {
+        Snapshot snapshot{};
+
+        Blocks::for_each([&snapshot](const Block& block)
+        {
+            add_block(snapshot, block);
+        });
+
+        return snapshot;
+    }
+
+
+    // From state to state, counted by every fsm::StateMachine
+    template <typename StateEnum>
+    using Transitions = CountMatrix<StateEnum, StateEnum>;
+
+    // State and request the state didn't handle, counted by the contexts'
+    // default handlers
+    template <typename StateEnum, typename RequestEnum>
+    using Unhandled = CountMatrix<StateEnum, RequestEnum>;
+
+
+    // Lists the pairs that were counted, most often first
+    template <typename Row, typename Column>
+    void write_counts(std::ostream& out, const typename CountMatrix<Row, Column>::Snapshot& snapshot,
+        std::string_view separator)
+    {
+        struct Entry
+        {
+            std::uint64_t count{};
+            Row row{};
+            Column column{};
+        };
+
+        std::vector<Entry> entries;
+
+        for (std::size_t row = 0; row < enum_count<Row>; ++row)
+        {
+            for (std::size_t column = 0; column < enum_count<Column>; ++column)
+            {
+                std::uint64_t count = snapshot.at(static_cast<Row>(row), static_cast<Column>(column));
+
+                if (count > 0)
+                {
+                    entries.push_back({ count, static_cast<Row>(row), static_cast<Column>(column) });
+                }
+            }
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.count > b.count; });
+
+        for (const Entry& entry : entries)
+        {
+            out << "  " << entry.count << "  " << name(entry.row) << separator << name(entry.column) << "\n";
+        }
+
+        if (entries.empty())
+        {
+            out << "  none\n";
+        }
+    }
+
+    // The transitions taken and the states no transition ever entered,
+    // which are candidates for deleting. The initial state is left out, and
+    // so are the superstates, which parents gives like fsm::Hierarchy's and
+    // which are entered through the hierarchy rather than by a transition
+    template <typename StateEnum>
+    void write_transitions(std::ostream& out, StateEnum initial, std::span<const StateEnum> parents = {})
+    {
+        typename Transitions<StateEnum>::Snapshot snapshot = Transitions<StateEnum>::snapshot();
+
+        out << "Transitions (" << snapshot.total() << ")\n";
+        write_counts<StateEnum, StateEnum>(out, snapshot, " -> ");
+
+        out << "Never entered:";
+
+        for (std::size_t to = 0; to < enum_count<StateEnum>; ++to)
+        {
+            StateEnum state = static_cast<StateEnum>(to);
+
+            if (state == initial || std::find(parents.begin(), parents.end(), state) != parents.end())
+            {
+                continue;
+            }
+
+            std::uint64_t entered{};
+
+            for (std::size_t from = 0; from < enum_count<StateEnum>; ++from)
+            {
+                entered += snapshot.at(static_cast<StateEnum>(from), state);
+            }
+
+            if (entered == 0)
+            {
+                out << " " << name(state);
+            }
+        }
+
+        out << std::endl;
+    }
+
+    template <typename StateEnum, typename RequestEnum>
+    void write_unhandled(std::ostream& out)
+    {
+        typename Unhandled<StateEnum, RequestEnum>::Snapshot snapshot = Unhandled<StateEnum, RequestEnum>::snapshot();
+
+        out << "Unhandled requests (" << snapshot.total() << ")\n";
+        write_counts<StateEnum, RequestEnum>(out, snapshot, " <- ");
+        out.flush();
+    }
+}
+
+#endif
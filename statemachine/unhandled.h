@@ -0,0 +1,330 @@
+#ifndef UNHANDLED
+#define UNHANDLED
+
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "asynclog.h"
+#include "trace.h"
+#include "transitionstats.h"
+
+namespace unhandled
+{
+    // What the default handlers do with a request the current state doesn't
+    // handle. They used to print a line to std::cerr with std::endl every
+    // time, so a client sending nonsense could keep every thread busy
+    // writing to stderr. Now only the first few of each state and request
+    // pair are reported, anything after that is summed up periodically,
+    // and while a Reporter is running nothing is written on the thread
+    // that made the request at all.
+    //
+    // Every request also returns a Status, and in strict mode nothing is
+    // reported, the caller is expected to act on the Status instead
+
+    enum class Status
+    {
+        handled,
+        unhandled
+    };
+
+    // Reported one by one for each state and request pair, the rest are
+    // summarised
+    constexpr std::uint64_t report_first{ 5 };
+
+    constinit std::atomic<bool> strict_flag{};
+
+    void set_strict(bool strict)
+    {
+        strict_flag.store(strict, std::memory_order_relaxed);
+    }
+
+    bool strict()
+    {
+        return strict_flag.load(std::memory_order_relaxed);
+    }
+
+    constinit thread_local bool quiet_thread{};
+
+    // Nothing the calling thread leaves unhandled while it exists is
+    // reported or summarised, for requests sent only to see what a state
+    // does with them
+    class Quiet
+    {
+    public:
+
+        Quiet()
+            : previous_(std::exchange(quiet_thread, true))
+        {
+        }
+
+        ~Quiet() { quiet_thread = previous_; }
+
+        Quiet(const Quiet&) = delete;
+        Quiet& operator=(const Quiet&) = delete;
+
+    private:
+
+        bool previous_{};
+    };
+
+
+    // One of the first few of a pair, waiting for a Reporter to write it
+    struct Notice
+    {
+        trace::NameFn state_names{};
+        trace::NameFn request_names{};
+        std::uint16_t state{};
+        std::uint16_t request{};
+        std::uint64_t occurrence{};
+        std::atomic<bool> ready{};
+    };
+
+    // Append only. Each pair adds at most report_first notices, so slots
+    // are never reused and a producer claims one with a single fetch_add
+    class NoticeLog
+    {
+    public:
+
+        static constexpr std::size_t capacity{ 4096 };
+
+        // False once the log is full, the notice is then only counted
+        bool push(trace::NameFn state_names, trace::NameFn request_names, std::uint16_t state,
+            std::uint16_t request, std::uint64_t occurrence)
+        {
+            std::size_t slot = claimed_.fetch_add(1, std::memory_order_relaxed);
+
+            if (slot >= capacity)
+            {
+                return false;
+            }
+
+            Notice& notice = notices_[slot];
+            notice.state_names = state_names;
+            notice.request_names = request_names;
+            notice.state = state;
+            notice.request = request;
+            notice.occurrence = occurrence;
+            notice.ready.store(true, std::memory_order_release);
+
+            return true;
+        }
+
+        // Only from the reporter, writes the notices that are ready in order
+        void drain(std::ostream& out);
+
+    private:
+
+        std::array<Notice, capacity> notices_{};
+        std::atomic<std::size_t> claimed_{};
+        std::size_t written_{};
+    };
+
+    NoticeLog notice_log{};
+
+    void write_notice(std::ostream& out, std::string_view state, std::string_view request, std::uint64_t occurrence)
+    {
+        out << "Error: state " << state << " does not handle " << request;
+
+        if (occurrence == report_first)
+        {
+            out << ", any more of these are only summarised";
+        }
+
+        out << "\n";
+    }
+
+    void NoticeLog::drain(std::ostream& out)
+    {
+        while (written_ < capacity && notices_[written_].ready.load(std::memory_order_acquire))
+        {
+            const Notice& notice = notices_[written_];
+            write_notice(out, notice.state_names(notice.state), notice.request_names(notice.request), notice.occurrence);
+            ++written_;
+        }
+    }
+
+    constinit std::atomic<bool> reporter_running{};
+
+
+    // Kinds of machine that have reported anything, each summarises its
+    // own pairs. Only the first report of a kind adds to this
+    using SummaryFn = void (*)(std::ostream&);
+
+    std::mutex summaries_mutex;
+    std::vector<SummaryFn> summaries;
+
+    // How many times each state and request pair of one kind of machine has
+    // gone unhandled, across all threads. Only touched on the unhandled
+    // path, so a shared counter per pair is fine
+    template <typename StateEnum, typename RequestEnum>
+    class Pairs
+    {
+    public:
+
+        static constexpr std::size_t states{ stats::enum_count<StateEnum> };
+        static constexpr std::size_t requests{ stats::enum_count<RequestEnum> };
+
+        static void report(StateEnum state, RequestEnum request);
+
+    private:
+
+        static void summarise(std::ostream& out);
+
+        static constexpr std::size_t index(StateEnum state, RequestEnum request)
+        {
+            return static_cast<std::size_t>(state) * requests + static_cast<std::size_t>(request);
+        }
+
+        static inline std::array<std::atomic<std::uint64_t>, states * requests> counts_{};
+        static inline std::atomic<bool> registered_{};
+
+        // Only the reporter thread uses this
+        static inline std::array<std::uint64_t, states * requests> summarised_{};
+    };
+
+    template <typename StateEnum, typename RequestEnum>
+    void Pairs<StateEnum, RequestEnum>::report(StateEnum state, RequestEnum request)
+    {
+        if (quiet_thread)
+        {
+            return;
+        }
+
+        std::uint64_t occurrence = counts_[index(state, request)].fetch_add(1, std::memory_order_relaxed) + 1;
+
+        if (!registered_.load(std::memory_order_relaxed) && !registered_.exchange(true))
+        {
+            std::lock_guard<std::mutex> lock{ summaries_mutex };
+            summaries.push_back(&summarise);
+        }
+
+        if (occurrence > report_first || strict())
+        {
+            return;
+        }
+
+        if (reporter_running.load(std::memory_order_relaxed))
+        {
+            notice_log.push(&trace::enum_name<StateEnum>, &trace::enum_name<RequestEnum>,
+                static_cast<std::uint16_t>(state), static_cast<std::uint16_t>(request), occurrence);
+        }
+        else
+        {
+            // Nobody to hand it to, but it is still only the first few, and
+            // a Logger routing errors keeps the write off this thread
+            write_notice(logging::errors(), name(state), name(request), occurrence);
+        }
+    }
+
+    template <typename StateEnum, typename RequestEnum>
+    void Pairs<StateEnum, RequestEnum>::summarise(std::ostream& out)
+    {
+        for (std::size_t i = 0; i < states * requests; ++i)
+        {
+            std::uint64_t count = counts_[i].load(std::memory_order_relaxed);
+
+            // Until then each one was reported by itself
+            std::uint64_t from = std::max(summarised_[i], report_first);
+
+            if (count > from)
+            {
+                out << "Unhandled: " << name(static_cast<StateEnum>(i / requests)) << " <- "
+                    << name(static_cast<RequestEnum>(i % requests)) << " " << count - from << " more, "
+                    << count << " in all\n";
+
+                summarised_[i] = count;
+            }
+        }
+    }
+
+
+    // Writes the notices and the periodic summaries from its own thread for
+    // as long as it exists. Only one at a time
+    class Reporter
+    {
+    public:
+
+        explicit Reporter(std::chrono::milliseconds interval = std::chrono::seconds{ 10 }, std::ostream& out = std::cerr);
+        ~Reporter();
+
+        Reporter(const Reporter&) = delete;
+        Reporter& operator=(const Reporter&) = delete;
+
+    private:
+
+        void report();
+
+        std::ostream& out_;
+        std::chrono::milliseconds interval_{};
+
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        bool stopping_{};
+
+        std::thread thread_;
+    };
+
+
+    // Reporter
+
+    Reporter::Reporter(std::chrono::milliseconds interval, std::ostream& out)
+        : out_(out)
+        , interval_(interval)
+    {
+        bool running = reporter_running.exchange(true);
+        assert(!running);
+
+        thread_ = std::thread{ [this]
+        {
+            std::unique_lock<std::mutex> lock{ mutex_ };
+
+            while (!wake_.wait_for(lock, interval_, [this] { return stopping_; }))
+            {
+                report();
+            }
+        } };
+    }
+
+    Reporter::~Reporter()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            stopping_ = true;
+        }
+
+        wake_.notify_one();
+        thread_.join();
+
+        reporter_running.store(false, std::memory_order_relaxed);
+        report();
+    }
+
+    void Reporter::report()
+    {
+        notice_log.drain(out_);
+
+        std::lock_guard<std::mutex> lock{ summaries_mutex };
+
+        for (SummaryFn summarise : summaries)
+        {
+            summarise(out_);
+        }
+
+        out_.flush();
+    }
+}
+
+#endif